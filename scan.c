@@ -0,0 +1,122 @@
+/*
+ * sercd byte scanning
+ * Copyright 2008 Peter Åstrand <astrand@cendio.se> for Cendio AB
+ * see file COPYING for license details
+ */
+
+#include "scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define SCAN_SSE2 1
+#define SCAN_AVX2 1
+#include <immintrin.h>
+#elif defined(__GNUC__) && (defined(__aarch64__) || defined(__ARM_NEON))
+#define SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Byte at a time, used for short tails and where no SIMD is available */
+static size_t
+ScanBytesPortable(const unsigned char *Data, size_t Len, unsigned char A, unsigned char B)
+{
+    size_t i;
+
+    for (i = 0; i < Len; i++) {
+	if (Data[i] == A || Data[i] == B)
+	    return i;
+    }
+    return Len;
+}
+
+#ifdef SCAN_SSE2
+static size_t
+ScanBytesSSE2(const unsigned char *Data, size_t Len, unsigned char A, unsigned char B)
+{
+    __m128i VA = _mm_set1_epi8((char) A);
+    __m128i VB = _mm_set1_epi8((char) B);
+    size_t i = 0;
+
+    for (; i + 16 <= Len; i += 16) {
+	__m128i V = _mm_loadu_si128((const __m128i *) (Data + i));
+	int Mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(V, VA), _mm_cmpeq_epi8(V, VB)));
+	if (Mask)
+	    return i + __builtin_ctz(Mask);
+    }
+    return i + ScanBytesPortable(Data + i, Len - i, A, B);
+}
+#endif
+
+#ifdef SCAN_AVX2
+__attribute__ ((target("avx2")))
+static size_t
+ScanBytesAVX2(const unsigned char *Data, size_t Len, unsigned char A, unsigned char B)
+{
+    __m256i VA = _mm256_set1_epi8((char) A);
+    __m256i VB = _mm256_set1_epi8((char) B);
+    size_t i = 0;
+
+    for (; i + 32 <= Len; i += 32) {
+	__m256i V = _mm256_loadu_si256((const __m256i *) (Data + i));
+	unsigned int Mask =
+	    _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(V, VA),
+						 _mm256_cmpeq_epi8(V, VB)));
+	if (Mask)
+	    return i + __builtin_ctz(Mask);
+    }
+    return i + ScanBytesSSE2(Data + i, Len - i, A, B);
+}
+#endif
+
+#ifdef SCAN_NEON
+static size_t
+ScanBytesNEON(const unsigned char *Data, size_t Len, unsigned char A, unsigned char B)
+{
+    uint8x16_t VA = vdupq_n_u8(A);
+    uint8x16_t VB = vdupq_n_u8(B);
+    size_t i = 0;
+
+    for (; i + 16 <= Len; i += 16) {
+	uint8x16_t V = vld1q_u8(Data + i);
+	uint8x16_t Match = vorrq_u8(vceqq_u8(V, VA), vceqq_u8(V, VB));
+	/* Narrow to 4 bits per byte to get a testable 64 bit mask */
+	uint64_t Mask =
+	    vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(Match), 4)), 0);
+	if (Mask)
+	    return i + (__builtin_ctzll(Mask) >> 2);
+    }
+    return i + ScanBytesPortable(Data + i, Len - i, A, B);
+}
+#endif
+
+typedef size_t (*ScanBytesFunc) (const unsigned char *, size_t, unsigned char, unsigned char);
+
+/* Pick the best implementation for this CPU on first use */
+static size_t
+ScanBytesInit(const unsigned char *Data, size_t Len, unsigned char A, unsigned char B);
+
+static ScanBytesFunc ScanBytesImpl = ScanBytesInit;
+
+static size_t
+ScanBytesInit(const unsigned char *Data, size_t Len, unsigned char A, unsigned char B)
+{
+#if defined(SCAN_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	ScanBytesImpl = ScanBytesAVX2;
+    else
+	ScanBytesImpl = ScanBytesSSE2;
+#elif defined(SCAN_SSE2)
+    ScanBytesImpl = ScanBytesSSE2;
+#elif defined(SCAN_NEON)
+    ScanBytesImpl = ScanBytesNEON;
+#else
+    ScanBytesImpl = ScanBytesPortable;
+#endif
+    return ScanBytesImpl(Data, Len, A, B);
+}
+
+size_t
+ScanBytes(const unsigned char *Data, size_t Len, unsigned char A, unsigned char B)
+{
+    return ScanBytesImpl(Data, Len, A, B);
+}
@@ -0,0 +1,16 @@
+/*
+ * sercd byte scanning
+ * Copyright 2008 Peter Åstrand <astrand@cendio.se> for Cendio AB
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_SCAN_H
+#define SERCD_SCAN_H
+
+#include <stddef.h>
+
+/* Return the offset of the first byte in Data equal to A or B, or Len
+   if there is none. Uses SIMD instructions where available. */
+size_t ScanBytes(const unsigned char *Data, size_t Len, unsigned char A, unsigned char B);
+
+#endif /* SERCD_SCAN_H */
@@ -31,7 +31,9 @@
 
       . Lack of Telnet AUTHENTICATION
 
-      . LineState processing is not implemented
+      . LineState notifications only cover break and the error
+        conditions, and need a driver keeping error counters (Linux
+        TIOCGICOUNT)
 
       . The code probably won't compile on most versions of Unix due to the
         highly platform dependent nature of the serial apis.
@@ -49,12 +51,22 @@
 #include <time.h>		/* CLOCKS_PER_SEC */
 #include <fcntl.h>		/* open */
 #include <assert.h>		/* assert */
+#include <stdarg.h>		/* va_list */
+#include <stddef.h>		/* offsetof */
+#include <signal.h>		/* sig_atomic_t */
 #include "sercd.h"
 #include "unix.h"
 #include "win.h"
+#include "scan.h"
 
-/* Buffer size */
-#define BufferSize 2048
+/* Default and minimum buffer sizes; sizes are rounded up to a power
+   of two */
+#define DefaultBufferSize 2048
+#define MinBufferSize 1024
+#define MaxBufferSize (16 * 1024 * 1024)
+
+/* Size of the network and device buffers of each session */
+unsigned int BufferSize = DefaultBufferSize;
 
 /* Cisco IOS bug compatibility */
 Boolean CiscoIOSCompatible = False;
@@ -62,73 +74,195 @@ Boolean CiscoIOSCompatible = False;
 /* Log to stderr instead of syslog */
 Boolean StdErrLogging = False;
 
-/* Buffer structure */
+/* Use select() even where a better event mechanism is available */
+Boolean ForceSelect = False;
+
+/* Use io_uring instead of epoll, and keep reads outstanding in it */
+Boolean UseUring = False;
+
+/* Timestamp forwarded data to measure its latency */
+static Boolean LatencyTiming = False;
+
+/* Set by the signal asking for the latency histograms to be logged */
+volatile sig_atomic_t LatencyDumpRequested = 0;
+
+/* Set by the signals asking sercd to stop */
+static volatile sig_atomic_t StopRequested = 0;
+
+/* Event loop threads are running, each owning its sessions */
+static Boolean ReactorsRunning = False;
+
+/* Exit status once the event loops have stopped */
+static int ExitStatus = NoError;
+
+/* Buffer structure. A ring with a power of two size; the positions
+   run freely and are masked on access. A mirrored ring has its memory
+   mapped twice back to back, so its contents and free space are always
+   contiguous. */
 typedef struct
 {
-    unsigned char Buffer[BufferSize];
+    unsigned char *Buffer;
+    unsigned int Mask;
     unsigned int RdPos;
     unsigned int WrPos;
+    Boolean Mirrored;
 }
 BufferType;
 
-/* Complete lock file pathname */
-static char *LockFileName;
+/* Maximum number of replies held back while port changes are done */
+#define MaxCPCReplies 16
 
-/* Complete device file pathname */
-static char *DeviceName;
+/* Line state conditions notified, and interval in ms between checks
+   of the line error counters */
+#define LineStateSupported (TNCOM_LINEMASK_BREAK_ERR | TNCOM_LINEMASK_FRAME_ERR | \
+			    TNCOM_LINEMASK_PARITY_ERR | TNCOM_LINEMASK_OVERRUN_ERR)
+#define LineCheckInterval 100
 
-/* Device file descriptor */
-static PORTHANDLE *DeviceFd = NULL;
+/* Network output coalescing modes */
+#define CoalesceOff 0
+#define CoalesceFixed 1
+#define CoalesceAuto 2
 
-/* Network sockets */
-static SERCD_SOCKET *InSocketFd = NULL;
-static SERCD_SOCKET *OutSocketFd = NULL;
+/* Default coalescing delay in ms and size threshold in bytes */
+#define DefaultCoalesceDelay 5
+#define DefaultCoalesceThreshold 1024
 
-/* Com Port Control enabled flag */
-Boolean PortControlEnable = True;
+/* Network output coalescing policy. Output is held until Threshold
+   bytes are queued or the oldest byte has waited Delay ms. In auto
+   mode output is only held while the device delivers data in quick
+   succession, so interactive use isn't delayed. */
+typedef struct
+{
+    int Mode;
+    long Delay;
+    unsigned int Threshold;
+}
+CoalesceType;
 
-/* Maximum log level to log in the system log */
-int MaxLogLevel = LOG_DEBUG + 1;
+/* Coalescing policy for ports not configuring their own */
+CoalesceType DefaultCoalesce = { CoalesceOff, DefaultCoalesceDelay, DefaultCoalesceThreshold };
 
-/* Status enumeration for IAC escaping and interpretation */
-typedef enum
-{ IACNormal, IACReceived, IACComReceiving }
-IACState;
+/* Default maximum frame length, the largest Modbus RTU frame */
+#define DefaultFrameMaxLen 256
 
-/* Effective status for IAC escaping and interpretation */
-static IACState IACEscape = IACNormal;
+/* Packetizing of device input for framed protocols. Device data is
+   held until the line has been idle for Gap character times, or
+   MaxLen bytes have been received, and then sent as one unit. */
+typedef struct
+{
+    /* Idle gap in tenths of a character time, 0 when off */
+    unsigned int Gap;
+    unsigned int MaxLen;
+}
+FramingType;
 
-/* Same as above during signature reception */
-static IACState IACSigEscape;
+/* Framing for ports not configuring their own */
+FramingType DefaultFraming = { 0, DefaultFrameMaxLen };
 
-/* Current IAC command begin received */
-static unsigned char IACCommand[TmpStrLen];
+/* Keep devices open between clients, and the most device bytes kept
+   while no client is connected, for ports not configuring their own */
+Boolean DefaultKeepOpen = False;
+unsigned int DefaultBacklog = 0;
 
-/* Position of insertion into IACCommand[] */
-static size_t IACPos;
+/* Largest device output history of a port */
+#define MaxHistorySize (1024 * 1024 * 1024)
 
-/* Modem state mask set by the client */
-static unsigned char ModemStateMask = ((unsigned char) 255);
+/* Number of seconds with device output noted in a history, for
+   replays by time */
+#define HistoryMarks 1024
 
-/* Line state mask set by the client */
-static unsigned char LineStateMask = ((unsigned char) 0);
+/* Start of a history, in memory or in a file kept across restarts */
+#define HistoryMagic "sercdhst"
+typedef struct
+{
+    char Magic[8];
+    unsigned long long Size;	/* Bytes of history following the header */
+    unsigned long long Total;	/* Bytes ever added */
+}
+HistoryHeaderType;
 
-#ifdef COMMENT
-/* Current status of the line control lines */
-static unsigned char LineState = ((unsigned char) 0);
-#endif
+/* Total of a history when the first output of a second arrived */
+typedef struct
+{
+    unsigned long long Second;
+    unsigned long long Pos;
+}
+HistoryMarkType;
+
+/* The last Size bytes of device output of a port, whether a client is
+   connected or not. Position Pos of the output is kept at Pos % Size. */
+typedef struct
+{
+    HistoryHeaderType *Header;	/* NULL without history */
+    unsigned char *Data;
+    unsigned int Size;
+    HistoryMarkType *Marks;
+    unsigned int FirstMark;
+    unsigned int MarkCount;
+}
+HistoryType;
+
+/* How much of the history is sent to a new client, in bytes or in
+   seconds */
+typedef struct
+{
+    unsigned long Limit;
+    Boolean Seconds;
+}
+ReplayType;
+
+/* History size, file and replay for ports not configuring their own */
+unsigned int DefaultHistorySize = 0;
+char *DefaultHistoryFile = NULL;
+ReplayType DefaultReplay = { MaxHistorySize, False };
+
+/* Most observers a port may allow */
+#define MaxObserverLimit 1024
+
+/* Size of the segments of device output shared by the observers of a
+   port, and the most segments a port holds. An observer that falls
+   further behind is dropped, or skipped ahead to the data still held. */
+#define FanOutSegmentSize 4096
+#define FanOutMaxSegments 64
+
+/* Segment of device output, ready to be sent to observers. Refs counts
+   the observers whose cursor is in it. */
+typedef struct FanOutSegment
+{
+    struct FanOutSegment *Next;
+    unsigned int Refs;
+    unsigned int Len;
+    unsigned char Data[FanOutSegmentSize];
+}
+FanOutSegmentType;
+
+/* Read-only client of a port. It only keeps its position in the
+   shared segments: Pos bytes into Seg have been sent. */
+typedef struct
+{
+    SERCD_SOCKET socket;
+    SERCD_SOCKET *SocketFd;	/* NULL when the slot is free */
+    FanOutSegmentType *Seg;
+    unsigned int Pos;
+    int Watch;			/* Index of its watch, -1 if none */
+}
+ObserverType;
 
-/* Current status of the modem control lines */
-static unsigned char ModemState = ((unsigned char) 0);
+/* Most observers per port, and whether slow ones are skipped ahead
+   instead of dropped, for ports not configuring their own */
+unsigned int DefaultMaxObservers = 0;
+Boolean DefaultSkipObservers = False;
 
-/* Break state flag */
-Boolean BreakSignaled = False;
+/* Maximum log level to log in the system log */
+int MaxLogLevel = LOG_DEBUG + 1;
 
-/* Input flow control flag */
-Boolean InputFlow = True;
+/* Status enumeration for IAC escaping and interpretation */
+typedef enum
+{ IACNormal, IACReceived, IACComReceiving }
+IACState;
 
-/* Telnet State Machine */
-static struct _tnstate
+/* Telnet State Machine, per option */
+typedef struct
 {
     int sent_will:1;
     int sent_do:1;
@@ -137,12 +271,344 @@ static struct _tnstate
     int is_will:1;
     int is_do:1;
 }
-tnstate[256];
+TelnetOptionState;
+
+/* Port settings applied when the device is opened; zero fields leave
+   the device setting unchanged */
+typedef struct
+{
+    unsigned long Speed;
+    unsigned char DataSize;
+    unsigned char Parity;
+    unsigned char StopSize;
+    unsigned char FlowControl;
+}
+PortSettingsType;
+
+/* Number of COM-PORT-OPTION command codes, TNCAS_SIGNATURE to
+   TNCAS_PURGE_DATA */
+#define CPCCommandTypes 13
+
+/* Forwarding latency histogram, in microseconds. Delays below twice
+   LatencySubBuckets are counted exactly, longer ones in
+   LatencySubBuckets steps per power of two, so that percentiles are
+   good to 1/8. The last bucket takes everything beyond an hour. */
+#define LatencySubBits 3
+#define LatencySubBuckets (1 << LatencySubBits)
+#define LatencyBuckets (30 * LatencySubBuckets)
+typedef struct
+{
+    unsigned long Count[LatencyBuckets];
+    unsigned long long Total;
+    unsigned long long SumUs;
+    unsigned long long MaxUs;
+}
+LatencyType;
+
+/* Reads not yet completely written out at the other side: the output
+   position their data ends at, and when they were read */
+#define LatencyMarks 32
+typedef struct
+{
+    unsigned long long End;
+    unsigned long long Time;
+}
+LatencyMarkType;
+
+/* The marks of one direction, oldest first */
+typedef struct
+{
+    LatencyMarkType Marks[LatencyMarks];
+    unsigned int First;
+    unsigned int Count;
+}
+LatencyTrackType;
+
+/* Statistics of one served port since startup. Plain counters only
+   touched by the event loop, so they can stay enabled. */
+typedef struct
+{
+    unsigned long Connections;
+    unsigned long LockFailures;	/* Device opens failing on the lock file */
+    unsigned long long NetIn;	/* Bytes read from the network */
+    unsigned long long NetOut;	/* Bytes written to the network */
+    unsigned long long DevIn;	/* Bytes read from the device */
+    unsigned long long DevOut;	/* Bytes written to the device */
+    unsigned long IACEscapes;	/* Doubled IAC bytes, both directions */
+    unsigned long CPCCommands[CPCCommandTypes];
+    unsigned long Wakeups;	/* Event loop rounds with events */
+    unsigned long ShortWrites;	/* Writes that took less than offered */
+    unsigned long WouldBlock;	/* Reads and writes failing with EWOULDBLOCK */
+    unsigned int NetBufHigh;	/* Most bytes queued for the network */
+    unsigned int DevBufHigh;	/* Most bytes queued for the device */
+    unsigned long long FlowOffUs;	/* Time with InputFlow off, in us */
+    struct timeval FlowOffSince;	/* Start of the current flow off */
+    unsigned long long BacklogDropped;	/* Device bytes lost with no client */
+    unsigned long Observers;	/* Observer connections accepted */
+    unsigned long ObserversDropped;	/* Observers dropped for falling behind */
+    unsigned long long ObserverSkipped;	/* Bytes observers were skipped past */
+    /* Last, so that they are only copied with latency timing */
+    LatencyType ToNetLatency;	/* Device read to network write */
+    LatencyType ToDevLatency;	/* Network read to device write */
+}
+StatsType;
+
+/* What the reports show of a served port. The reports are served by
+   the first event loop, which never reads the sessions of the others:
+   each event loop publishes a copy of its own. */
+typedef struct
+{
+    StatsType Stats;
+    LineCountType LineErrors;
+    Boolean Connected;
+    Boolean DeviceOpen;
+    Boolean InputFlow;
+    Boolean ModemKnown;
+    unsigned char ModemState;
+    unsigned int Backlog;
+    unsigned long long HistoryTotal;
+    unsigned int ObserverCount;
+    unsigned int FanOutSegments;
+}
+SessionReportType;
+
+/* State of one served port: its configuration, descriptors, buffers
+   and the Telnet/CPC protocol state of the connected client */
+typedef struct
+{
+    /* Complete device file pathname */
+    char *DeviceName;
+
+    /* Complete lock file pathname */
+    char *LockFileName;
+
+    /* TCP port to listen on in standalone mode */
+    unsigned int ListenPort;
+
+    /* Settings applied when opening the device */
+    PortSettingsType Defaults;
+
+    /* Raw TCP mode: no Telnet negotiation and no IAC processing */
+    Boolean Raw;
+
+    /* Device file descriptor, NULL when not open */
+    PORTHANDLE *DeviceFd;
+    PORTHANDLE devicefd;
+
+    /* Network sockets, NULL when not connected */
+    SERCD_SOCKET *InSocketFd;
+    SERCD_SOCKET *OutSocketFd;
+    SERCD_SOCKET insocket, outsocket;
+
+    /* Listening socket in standalone mode, NULL otherwise */
+    SERCD_SOCKET *LSocketFd;
+    SERCD_SOCKET lsocket;
+
+    /* Buffer to Device from Network */
+    BufferType ToDevBuf;
+
+    /* Buffer to Network from Device */
+    BufferType ToNetBuf;
+
+    /* Raw mode pipes replacing the buffers while splicing works */
+    RawPipeType ToDevPipe;
+    RawPipeType ToNetPipe;
+
+    /* The device stays open, locked and configured between clients.
+       Device data arriving while no client is connected is kept in
+       Backlog, at most BacklogSize bytes of the latest, and sent to
+       the next client. */
+    Boolean KeepOpen;
+    unsigned int BacklogSize;
+    BufferType Backlog;
+
+    /* Device output history, kept in HistoryFile if set. A new client
+       is sent the part selected by Replay, from ReplayPos up to
+       ReplayEnd, instead of the backlog. */
+    unsigned int HistorySize;
+    char *HistoryFile;
+    HistoryType History;
+    ReplayType Replay;
+    unsigned long long ReplayPos;
+    unsigned long long ReplayEnd;
+
+    /* Read-only observers besides the client, which is then the owner.
+       Device output is added once, escaped, to the segments from
+       FanOutHead to FanOutTail while there are observers. Segments
+       no longer needed are kept in FanOutFree for reuse. */
+    unsigned int MaxObservers;
+    Boolean SkipObservers;
+    ObserverType *Observers;
+    unsigned int ObserverCount;
+    FanOutSegmentType *FanOutHead;
+    FanOutSegmentType *FanOutTail;
+    FanOutSegmentType *FanOutFree;
+    unsigned int FanOutSegments;
+
+    /* Network output coalescing policy */
+    CoalesceType Coalesce;
+
+    /* Time the oldest unsent network output was queued */
+    struct timeval NetQueued;
+
+    /* Send network output with a hint that more follows */
+    Boolean NetMore;
+
+    /* Time of the last device read, and the averaged gap between
+       device reads in microseconds */
+    struct timeval LastDevRead;
+    long DevReadGap;
+
+    /* Device input framing, and the frame being received: its length
+       in device bytes, its start in ToNetBuf, and its length in
+       ToNetPipe */
+    FramingType Framing;
+    unsigned int FrameBytes;
+    unsigned int FrameStart;
+    unsigned int FramePending;
+
+    /* Com Port Control enabled flag */
+    Boolean PortControlEnable;
+
+    /* Effective status for IAC escaping and interpretation */
+    IACState IACEscape;
+
+    /* Same as above during signature reception */
+    IACState IACSigEscape;
+
+    /* Current IAC command begin received */
+    unsigned char IACCommand[TmpStrLen];
+
+    /* Position of insertion into IACCommand[] */
+    size_t IACPos;
+
+    /* Modem state mask set by the client */
+    unsigned char ModemStateMask;
+
+    /* Line state mask set by the client */
+    unsigned char LineStateMask;
+
+    /* Line state not yet notified to the client */
+    unsigned char LineState;
+
+    /* Driver keeps line error counters, last values read from it and
+       time of the next check */
+    Boolean LineCounted;
+    LineCountType LineCounts;
+    struct timeval LineCheckDue;
+
+    /* Line errors seen since startup */
+    LineCountType LineErrors;
+
+    /* Current status of the modem control lines */
+    unsigned char ModemState;
+
+    /* Modem lines as last read for the client, if ModemLinesKnown */
+    unsigned char ModemLines;
+    Boolean ModemLinesKnown;
+
+    /* Break state flag */
+    Boolean BreakSignaled;
+
+    /* Input flow control flag */
+    Boolean InputFlow;
+
+    /* Last byte written by EscWriteChar and redirected by EscRedirectChar */
+    unsigned char EscWriteLast;
+    unsigned char EscRedirectLast;
+
+    /* Port setting changes are being staged, and the replies owed
+       to the client as command and value pairs, with the room they
+       need in ToNetBuf */
+    Boolean CPCStaged;
+    unsigned char CPCReplies[MaxCPCReplies][2];
+    unsigned int CPCReplyCount;
+    unsigned int CPCReplyBytes;
+
+    /* Network input not yet decoded, held while CPCReplies is full,
+       and the room its replies may need in ToNetBuf */
+    unsigned char *NetHeld;
+    unsigned int NetHeldLen;
+    unsigned int NetHeldBytes;
+
+    /* Most reply bytes a network byte can cause, see NetReadLimit */
+    unsigned int ReplyRatio;
+
+    /* Statistics for the control socket and metrics */
+    StatsType Stats;
+
+    /* Copy of what the reports show, published by the event loop under
+       PublishLock, and whether it is out of date */
+    SessionReportType Published;
+    void *PublishLock;
+    Boolean Unpublished;
+
+    /* Reads awaiting their write, when latency timing is enabled */
+    LatencyTrackType ToNetMarks;
+    LatencyTrackType ToDevMarks;
+
+    /* Telnet State Machine */
+    TelnetOptionState tnstate[256];
+}
+SessionType;
+
+/* All served ports */
+static SessionType *Sessions = NULL;
+static int SessionCount = 0;
+
+/* Most event loop threads */
+#define MaxReactors 256
+
+/* Event loop serving a share of the ports: sessions First, First + Step
+   and so on. The first one runs in the main thread and also serves the
+   reports. */
+typedef struct
+{
+    int First, Step;
+    int Cpu;			/* CPU to run on, -1 for any */
+    long PollInterval;
+    SercdWatch *Watches;
+    void *PublishLock;		/* Of the copies its sessions publish */
+}
+ReactorType;
+
+/* What the sessions published, as last read for a report */
+static SessionReportType *Snapshots = NULL;
+
+/* Seconds a report client may take to send its request and read the
+   report */
+#define ReportTimeout 5
+
+/* Listener serving reports on the statistics. One client is served at
+   a time; it is sent the report and disconnected. */
+typedef struct
+{
+    SERCD_SOCKET lsocket, socket;
+    SERCD_SOCKET *LSocketFd;	/* NULL when not enabled */
+    SERCD_SOCKET *SocketFd;	/* Client being served, NULL if none */
+    Boolean Http;		/* Clients send an HTTP request first */
+    char Request[1024];		/* Request received so far */
+    size_t RequestLen;
+    struct timeval Due;		/* The client is dropped at this time */
+    char *Out;			/* Report being sent */
+    size_t OutLen, OutPos, OutSize;
+}
+ReportType;
+
+/* Control socket with JSON statistics, and OpenMetrics endpoint */
+static ReportType Control, Metrics;
+static char *ControlPath = NULL;
 
 /* Function prototypes */
 
+/* Disconnect the client of a report listener, if any */
+static void CloseReportClient(ReportType * R);
+
 /* initialize Telnet State Machine */
-void InitTelnetStateMachine(void);
+void InitTelnetStateMachine(SessionType * S);
+
+/* Allocate the storage of a buffer */
+void AllocBuffer(BufferType * B, unsigned int Size);
 
 /* Initialize a buffer for operation */
 void InitBuffer(BufferType * B);
@@ -153,9 +619,24 @@ Boolean IsBufferEmpty(BufferType * B);
 /* Add a byte to a buffer */
 void AddToBuffer(BufferType * B, unsigned char C);
 
+/* Add Len bytes to a buffer */
+void AddBytesToBuffer(BufferType * B, const unsigned char *Data, unsigned int Len);
+
 /* Get a byte from a buffer */
 unsigned char GetFromBuffer(BufferType * B);
 
+/* Copy up to Len bytes from a buffer, without removing them */
+unsigned int BufferPeekBytes(BufferType * B, unsigned char *Data, unsigned int Len);
+
+/* Describe the buffer contents as up to two segments */
+int GetBufferIovec(BufferType * B, struct iovec *Iov, unsigned int Max);
+
+/* Get the contiguous free space at the end of a buffer */
+unsigned char *GetBufferSpace(BufferType * B, unsigned int *len);
+
+/* Add bytes written directly into the buffer space */
+void BufferCommitBytes(BufferType * B, unsigned int len);
+
 /* Retrieves the port speed from PortFd */
 unsigned long int GetPortSpeed(PORTHANDLE PortFd);
 
@@ -175,6 +656,13 @@ unsigned char GetPortFlowControl(PORTHANDLE PortFd, unsigned char Which);
 /* Return the status of the modem control lines (DCD, CTS, DSR, RNG) */
 unsigned char GetModemState(PORTHANDLE PortFd, unsigned char PMState);
 
+/* The same, if known without asking the driver. Returns False if not. */
+Boolean GetKnownModemState(PORTHANDLE PortFd, unsigned char *State);
+
+/* Read the line error counters of the driver. Returns False if it
+   keeps none. */
+Boolean GetLineCounts(PORTHANDLE PortFd, LineCountType * Counts);
+
 /* Set the serial port data size */
 void SetPortDataSize(PORTHANDLE PortFd, unsigned char DataSize);
 
@@ -190,6 +678,19 @@ void SetPortFlowControl(PORTHANDLE PortFd, unsigned char How);
 /* Set the serial port speed */
 void SetPortSpeed(PORTHANDLE PortFd, unsigned long BaudRate);
 
+/* Stage the following port setting changes instead of applying them */
+void StagePortSettings(PORTHANDLE PortFd);
+
+/* Apply the staged port setting changes at once */
+void CommitPortSettings(PORTHANDLE PortFd);
+
+/* Port changes may be carried out in the background: number of them
+   still in progress, and waiting for all of this thread's, closes
+   included */
+int PortJobsPending(PORTHANDLE PortFd);
+void FinishPortJobs(void);
+Boolean PortClosing(const char *DeviceName);
+
 /* Serial port break */
 void SetBreak(PORTHANDLE PortFd, Boolean on);
 
@@ -206,47 +707,51 @@ int OpenPort(const char *DeviceName, const char *LockFileName, PORTHANDLE * Port
 void ClosePort(PORTHANDLE PortFd, const char *LockFileName);
 
 /* Send the signature Sig to the client */
-void SendSignature(BufferType * B, char *Sig);
+void SendSignature(SessionType * S, char *Sig);
 
 /* Write a char to SockFd performing IAC escaping */
-void EscWriteChar(BufferType * B, unsigned char C);
+void EscWriteChar(SessionType * S, unsigned char C);
 
 /* Redirect char C to PortFd checking for IAC escape sequences */
-void EscRedirectChar(BufferType * SockB, BufferType * DevB, PORTHANDLE PortFd, unsigned char C);
+void EscRedirectChar(SessionType * S, unsigned char C);
+
+/* Redirect a buffer to PortFd checking for IAC escape sequences,
+   returning the bytes handled */
+unsigned int EscRedirectBuffer(SessionType * S, const unsigned char *Buffer, unsigned int BSize);
 
 /* Send the specific telnet option to SockFd using Command as command */
 void SendTelnetOption(BufferType * B, unsigned char Command, char Option);
 
 /* Send a string to SockFd performing IAC escaping */
-void SendStr(BufferType * B, char *Str);
+void SendStr(SessionType * S, char *Str);
 
 /* Send the baud rate BR to SockFd */
-void SendBaudRate(BufferType * B, unsigned long int BR);
+void SendBaudRate(SessionType * S, unsigned long int BR);
 
 /* Send the CPC command Command using Parm as parameter */
-void SendCPCByteCommand(BufferType * B, unsigned char Command, unsigned char Parm);
+void SendCPCByteCommand(SessionType * S, unsigned char Command, unsigned char Parm);
 
 /* Handling of COM Port Control specific commands */
-void HandleCPCCommand(BufferType * B, PORTHANDLE PortFd, unsigned char *Command, size_t CSize);
+void HandleCPCCommand(SessionType * S, unsigned char *Command, size_t CSize);
 
 /* Common telnet IAC commands handling */
-void HandleIACCommand(BufferType * B, PORTHANDLE PortFd, unsigned char *Command, size_t CSize);
+void HandleIACCommand(SessionType * S, unsigned char *Command, size_t CSize);
 
 /* Write a buffer to SockFd with IAC escaping */
-void EscWriteBuffer(BufferType * B, unsigned char *Buffer, unsigned int BSize);
+void EscWriteBuffer(SessionType * S, unsigned char *Buffer, unsigned int BSize);
 
 /* initialize Telnet State Machine */
 void
-InitTelnetStateMachine(void)
+InitTelnetStateMachine(SessionType * S)
 {
     int i;
     for (i = 0; i < 256; i++) {
-	tnstate[i].sent_do = 0;
-	tnstate[i].sent_will = 0;
-	tnstate[i].sent_wont = 0;
-	tnstate[i].sent_dont = 0;
-	tnstate[i].is_do = 0;
-	tnstate[i].is_will = 0;
+	S->tnstate[i].sent_do = 0;
+	S->tnstate[i].sent_will = 0;
+	S->tnstate[i].sent_wont = 0;
+	S->tnstate[i].sent_dont = 0;
+	S->tnstate[i].is_do = 0;
+	S->tnstate[i].is_will = 0;
     }
 }
 
@@ -287,6 +792,26 @@ SetSocketOptions(SERCD_SOCKET insocket, SERCD_SOCKET outsocket)
 #endif
 }
 
+/* Allocate the storage of a buffer. Size must be a power of two. The
+   buffer is mirrored if the platform allows, which may round the size
+   up to the page size. */
+void
+AllocBuffer(BufferType * B, unsigned int Size)
+{
+    assert((Size & (Size - 1)) == 0);
+
+    B->Buffer = MapMirrorBuffer(&Size);
+    B->Mirrored = (B->Buffer != NULL);
+    if (!B->Mirrored)
+	B->Buffer = malloc(Size);
+    if (!B->Buffer) {
+	fprintf(stderr, "Out of memory\n");
+	exit(Error);
+    }
+    B->Mask = Size - 1;
+    InitBuffer(B);
+}
+
 /* Initialize a buffer for operation */
 void
 InitBuffer(BufferType * B)
@@ -301,15 +826,14 @@ InitBuffer(BufferType * B)
 unsigned int
 BufferLength(BufferType * B)
 {
-    return (B->WrPos - B->RdPos + BufferSize) % BufferSize;
+    return B->WrPos - B->RdPos;
 }
 
 /* Return how much room is left */
 unsigned int
 BufferRoomLeft(BufferType * B)
 {
-    /* -1 is for full/empty distinction */
-    return BufferSize - 1 - BufferLength(B);
+    return B->Mask + 1 - BufferLength(B);
 }
 
 /* Check if there's room for a number of additional bytes */
@@ -323,7 +847,7 @@ BufferHasRoomFor(BufferType * B, unsigned int x)
 Boolean
 IsBufferEmpty(BufferType * B)
 {
-    return BufferLength(B) == 0;
+    return B->WrPos == B->RdPos;
 }
 
 /* Add a byte to a buffer. */
@@ -332,45 +856,139 @@ AddToBuffer(BufferType * B, unsigned char C)
 {
     assert(BufferHasRoomFor(B, 1));
 
-    B->Buffer[B->WrPos] = C;
-    B->WrPos = (B->WrPos + 1) % BufferSize;
+    B->Buffer[B->WrPos++ & B->Mask] = C;
+}
+
+/* Add Len bytes to a buffer. Data may point into the free space of
+   the buffer itself, at or after the write position. */
+void
+AddBytesToBuffer(BufferType * B, const unsigned char *Data, unsigned int Len)
+{
+    unsigned int Pos = B->WrPos & B->Mask;
+    unsigned int First = B->Mirrored ? Len : MIN(Len, B->Mask + 1 - Pos);
+
+    assert(BufferHasRoomFor(B, Len));
+
+    if (Data != &B->Buffer[Pos]) {
+	memmove(&B->Buffer[Pos], Data, First);
+	memmove(B->Buffer, Data + First, Len - First);
+    }
+    B->WrPos += Len;
 }
 
 /* Get a byte from a buffer */
 unsigned char
 GetFromBuffer(BufferType * B)
 {
-    unsigned char C = B->Buffer[B->RdPos];
-    B->RdPos = (B->RdPos + 1) % BufferSize;
-    return (C);
+    return B->Buffer[B->RdPos++ & B->Mask];
+}
+
+/* Copy up to Len bytes from a buffer, without removing them. Returns
+   the number of bytes copied. */
+unsigned int
+BufferPeekBytes(BufferType * B, unsigned char *Data, unsigned int Len)
+{
+    unsigned int Pos = B->RdPos & B->Mask;
+    unsigned int First;
+
+    Len = MIN(Len, BufferLength(B));
+    First = B->Mirrored ? Len : MIN(Len, B->Mask + 1 - Pos);
+    memcpy(Data, &B->Buffer[Pos], First);
+    memcpy(Data + First, B->Buffer, Len - First);
+    return Len;
+}
+
+/* Describe up to Max bytes of the buffer contents as up to two
+   segments, for writev. Returns the number of segments used. */
+int
+GetBufferIovec(BufferType * B, struct iovec *Iov, unsigned int Max)
+{
+    unsigned int Pos = B->RdPos & B->Mask;
+    unsigned int Len = MIN(BufferLength(B), Max);
+    unsigned int First = B->Mirrored ? Len : MIN(Len, B->Mask + 1 - Pos);
+
+    if (Len == 0)
+	return 0;
+
+    Iov[0].iov_base = &B->Buffer[Pos];
+    Iov[0].iov_len = First;
+    if (First == Len)
+	return 1;
+
+    Iov[1].iov_base = B->Buffer;
+    Iov[1].iov_len = Len - First;
+    return 2;
 }
 
-/* Get string from buffer, without removing it. Returns the length of
-   the string. */
+/* Get the contiguous free space at the end of a buffer, for reading
+   into it directly. Returns its start and sets len to its length. */
 unsigned char *
-GetBufferString(BufferType * B, unsigned int *len)
+GetBufferSpace(BufferType * B, unsigned int *len)
 {
-    if (B->RdPos <= B->WrPos)
-	*len = B->WrPos - B->RdPos;
-    else
-	*len = BufferSize - B->RdPos;
+    unsigned int Pos = B->WrPos & B->Mask;
+
+    *len = BufferRoomLeft(B);
+    if (!B->Mirrored)
+	*len = MIN(*len, B->Mask + 1 - Pos);
+    return &B->Buffer[Pos];
+}
+
+/* Add len bytes written directly into the buffer space */
+void
+BufferCommitBytes(BufferType * B, unsigned int len)
+{
+    assert(BufferHasRoomFor(B, len));
 
-    return &(B->Buffer[B->RdPos]);
+    B->WrPos += len;
 }
 
 /* Remove the number of read bytes specified */
 void
 BufferPopBytes(BufferType * B, unsigned int len)
 {
+    assert(len <= BufferLength(B));
+
     B->RdPos += len;
-    B->RdPos %= BufferSize;
+}
+
+/* Close the connections of sessions First, First + Step and so on,
+   from the thread serving them */
+static void
+CloseSessions(int First, int Step)
+{
+    int i;
+
+    for (i = First; i < SessionCount; i += Step) {
+	SessionType *S = &Sessions[i];
+	DropConnection(S->DeviceFd, S->InSocketFd, S->OutSocketFd, S->LockFileName);
+	S->DeviceFd = NULL;
+	S->InSocketFd = S->OutSocketFd = NULL;
+    }
+    /* The devices are closed by the port workers */
+    FinishPortJobs();
 }
 
 /* Function executed when the program exits */
 void
 ExitFunction(void)
 {
-    DropConnection(DeviceFd, InSocketFd, OutSocketFd, LockFileName);
+    /* Only a fatal error exits while event loop threads still run:
+       their sessions are theirs, and are left to the process exit */
+    if (ReactorsRunning) {
+	LogMsg(LOG_NOTICE, "sercd stopped.");
+	return;
+    }
+
+    /* The event loops close their own sessions when they return; this
+       is for an exit before they started */
+    CloseSessions(0, 1);
+
+    CloseReportClient(&Control);
+    if (Control.LSocketFd) {
+	CloseControlSocket(*Control.LSocketFd, ControlPath);
+	Control.LSocketFd = NULL;
+    }
+    CloseReportClient(&Metrics);
 
     /* Program termination notification */
     LogMsg(LOG_NOTICE, "sercd stopped.");
@@ -387,8 +1005,11 @@ BreakFunction(int unused)
        because this function is almost never called */
     unused = unused;
 
-    /* ExitFunction will be called through atexit */
-    exit(NoError);
+    /* The event loops return and ExitFunction is called through
+       atexit; exiting here could deadlock on the locks the signal
+       interrupted */
+    StopRequested = 1;
+    WakeEventLoops();
 #else /* COMMENT */
 
     unsigned char LineState;
@@ -410,19 +1031,29 @@ BreakFunction(int unused)
 #endif /* COMMENT */
 }
 
+/* Function called on the signal asking for the latency histograms */
+void
+LatencyDumpFunction(int unused)
+{
+    unused = unused;
+    LatencyDumpRequested = 1;
+}
+
 
 /* Send the signature Sig to the client. Sig must not be longer than
    255 characters. */
 #define SendSignature_bytes (6 + 2 * 255)
 void
-SendSignature(BufferType * B, char *Sig)
+SendSignature(SessionType * S, char *Sig)
 {
+    BufferType *B = &S->ToNetBuf;
+
     assert(strlen(Sig) <= 255);
     AddToBuffer(B, TNIAC);
     AddToBuffer(B, TNSB);
     AddToBuffer(B, TNCOM_PORT_OPTION);
     AddToBuffer(B, TNASC_SIGNATURE);
-    SendStr(B, Sig);
+    SendStr(S, Sig);
     AddToBuffer(B, TNIAC);
     AddToBuffer(B, TNSE);
 }
@@ -430,37 +1061,130 @@ SendSignature(BufferType * B, char *Sig)
 /* Write a char to socket performing IAC escaping */
 #define EscWriteChar_bytes 2
 void
-EscWriteChar(BufferType * B, unsigned char C)
+EscWriteChar(SessionType * S, unsigned char C)
 {
-    /* Last received byte */
-    static unsigned char Last = 0;
+    BufferType *B = &S->ToNetBuf;
 
-    if (C == TNIAC)
+    if (C == TNIAC) {
 	AddToBuffer(B, C);
-    else if (C != 0x0A && !tnstate[TN_TRANSMIT_BINARY].is_will && Last == 0x0D)
+	S->Stats.IACEscapes++;
+    }
+    else if (C != 0x0A && !S->tnstate[TN_TRANSMIT_BINARY].is_will && S->EscWriteLast == 0x0D)
 	AddToBuffer(B, 0x00);
     AddToBuffer(B, C);
 
     /* Set last received byte */
-    Last = C;
+    S->EscWriteLast = C;
+}
+
+/* Write a buffer to socket performing IAC escaping. Runs without IAC,
+   and without CR when not sending BINARY, are copied as is. */
+void
+EscWriteBuffer(SessionType * S, unsigned char *Buffer, unsigned int BSize)
+{
+    unsigned int i = 0, Run;
+
+    while (i < BSize) {
+	Boolean Binary = S->tnstate[TN_TRANSMIT_BINARY].is_will;
+
+	if (!Binary && S->EscWriteLast == 0x0D) {
+	    EscWriteChar(S, Buffer[i++]);
+	    continue;
+	}
+
+	Run = ScanBytes(Buffer + i, BSize - i, TNIAC, Binary ? TNIAC : 0x0D);
+	if (Run > 0) {
+	    AddBytesToBuffer(&S->ToNetBuf, Buffer + i, Run);
+	    S->EscWriteLast = Buffer[i + Run - 1];
+	    i += Run;
+	}
+	if (i < BSize)
+	    EscWriteChar(S, Buffer[i++]);
+    }
+}
+
+/* Escape a buffer as EscWriteBuffer does, into Out instead of the
+   network buffer. Out must hold BSize * EscWriteChar_bytes bytes.
+   Returns the length of the result. */
+static unsigned int
+EscWriteTo(SessionType * S, const unsigned char *Buffer, unsigned int BSize, unsigned char *Out)
+{
+    Boolean Binary = S->tnstate[TN_TRANSMIT_BINARY].is_will;
+    unsigned int i, Len = 0;
+    unsigned char C;
+
+    for (i = 0; i < BSize; i++) {
+	C = Buffer[i];
+	if (C == TNIAC)
+	    Out[Len++] = C;
+	else if (C != 0x0A && !Binary && S->EscWriteLast == 0x0D)
+	    Out[Len++] = 0x00;
+	Out[Len++] = C;
+	S->EscWriteLast = C;
+    }
+    return Len;
+}
+
+/* Escape Len bytes read directly into the free space of the network
+   buffer and add them to it. The space must hold at least
+   Len * EscWriteChar_bytes bytes. Bytes up to the first one needing
+   escaping stay where they are; the rest is expanded from the end. */
+static void
+EscWriteInPlace(SessionType * S, unsigned char *Data, unsigned int Len)
+{
+    Boolean Binary = S->tnstate[TN_TRANSMIT_BINARY].is_will;
+    unsigned int First, Extra = 0, i, Out;
+    unsigned char Prev, Last;
+
+    if (Len == 0)
+	return;
+
+    Last = Data[Len - 1];
+    if (!Binary && S->EscWriteLast == 0x0D)
+	First = 0;
+    else
+	First = ScanBytes(Data, Len, TNIAC, Binary ? TNIAC : 0x0D);
+
+    /* Count the inserted bytes */
+    for (i = First; i < Len; i++) {
+	Prev = i ? Data[i - 1] : S->EscWriteLast;
+	if (Data[i] == TNIAC || (!Binary && Prev == 0x0D && Data[i] != 0x0A))
+	    Extra++;
+    }
+
+    /* Expand backwards, so that nothing is overwritten before use */
+    Out = Len + Extra;
+    for (i = Len; i-- > First;) {
+	unsigned char C = Data[i];
+	Prev = i ? Data[i - 1] : S->EscWriteLast;
+	Data[--Out] = C;
+	if (C == TNIAC) {
+	    Data[--Out] = TNIAC;
+	    S->Stats.IACEscapes++;
+	}
+	else if (!Binary && Prev == 0x0D && C != 0x0A)
+	    Data[--Out] = 0x00;
+    }
+
+    BufferCommitBytes(&S->ToNetBuf, Len + Extra);
+    S->EscWriteLast = Last;
 }
 
 /* Redirect char C to Device checking for IAC escape sequences */
 #define EscRedirectChar_bytes_SockB HandleIACCommand_bytes
 #define EscRedirectChar_bytes_DevB 1
 void
-EscRedirectChar(BufferType * SockB, BufferType * DevB, PORTHANDLE PortFd, unsigned char C)
+EscRedirectChar(SessionType * S, unsigned char C)
 {
-    /* Last received byte */
-    static unsigned char Last = 0;
+    BufferType *DevB = &S->ToDevBuf;
 
     /* Check the IAC escape status */
-    switch (IACEscape) {
+    switch (S->IACEscape) {
 	/* Normal status */
     case IACNormal:
 	if (C == TNIAC)
-	    IACEscape = IACReceived;
-	else if (!tnstate[TN_TRANSMIT_BINARY].is_do && C == 0x00 && Last == 0x0D)
+	    S->IACEscape = IACReceived;
+	else if (!S->tnstate[TN_TRANSMIT_BINARY].is_do && C == 0x00 && S->EscRedirectLast == 0x0D)
 	    /* Swallow the NUL after a CR if not receiving BINARY */
 	    break;
 	else
@@ -471,66 +1195,67 @@ EscRedirectChar(BufferType * SockB, BufferType * DevB, PORTHANDLE PortFd, unsign
     case IACReceived:
 	if (C == TNIAC) {
 	    AddToBuffer(DevB, C);
-	    IACEscape = IACNormal;
+	    S->IACEscape = IACNormal;
+	    S->Stats.IACEscapes++;
 	}
 	else {
-	    IACCommand[0] = TNIAC;
-	    IACCommand[1] = C;
-	    IACPos = 2;
-	    IACEscape = IACComReceiving;
-	    IACSigEscape = IACNormal;
+	    S->IACCommand[0] = TNIAC;
+	    S->IACCommand[1] = C;
+	    S->IACPos = 2;
+	    S->IACEscape = IACComReceiving;
+	    S->IACSigEscape = IACNormal;
 	}
 	break;
 
 	/* IAC Command reception */
     case IACComReceiving:
 	/* Telnet suboption, could be only CPC */
-	if (IACCommand[1] == TNSB) {
+	if (S->IACCommand[1] == TNSB) {
 	    /* Get the suboption signature */
-	    if (IACPos < 4) {
-		IACCommand[IACPos] = C;
-		IACPos++;
+	    if (S->IACPos < 4) {
+		S->IACCommand[S->IACPos] = C;
+		S->IACPos++;
 	    }
 	    else {
 		/* Check which suboption we are dealing with */
-		switch (IACCommand[3]) {
+		switch (S->IACCommand[3]) {
 		    /* Signature, which needs further escaping */
 		case TNCAS_SIGNATURE:
-		    switch (IACSigEscape) {
+		    switch (S->IACSigEscape) {
 		    case IACNormal:
 			if (C == TNIAC)
-			    IACSigEscape = IACReceived;
-			else if (IACPos < sizeof(IACCommand)) {
-			    IACCommand[IACPos] = C;
-			    IACPos++;
+			    S->IACSigEscape = IACReceived;
+			else if (S->IACPos < sizeof(S->IACCommand)) {
+			    S->IACCommand[S->IACPos] = C;
+			    S->IACPos++;
 			}
 			break;
 
 		    case IACComReceiving:
-			IACSigEscape = IACNormal;
+			S->IACSigEscape = IACNormal;
 			break;
 
 		    case IACReceived:
 			if (C == TNIAC) {
-			    if (IACPos < sizeof(IACCommand)) {
-				IACCommand[IACPos] = C;
-				IACPos++;
+			    if (S->IACPos < sizeof(S->IACCommand)) {
+				S->IACCommand[S->IACPos] = C;
+				S->IACPos++;
 			    }
-			    IACSigEscape = IACNormal;
+			    S->IACSigEscape = IACNormal;
 			}
 			else {
-			    if (IACPos < sizeof(IACCommand)) {
-				IACCommand[IACPos] = TNIAC;
-				IACPos++;
+			    if (S->IACPos < sizeof(S->IACCommand)) {
+				S->IACCommand[S->IACPos] = TNIAC;
+				S->IACPos++;
 			    }
 
-			    if (IACPos < sizeof(IACCommand)) {
-				IACCommand[IACPos] = C;
-				IACPos++;
+			    if (S->IACPos < sizeof(S->IACCommand)) {
+				S->IACCommand[S->IACPos] = C;
+				S->IACPos++;
 			    }
 
-			    HandleIACCommand(SockB, PortFd, IACCommand, IACPos);
-			    IACEscape = IACNormal;
+			    HandleIACCommand(S, S->IACCommand, S->IACPos);
+			    S->IACEscape = IACNormal;
 			}
 			break;
 		    }
@@ -538,35 +1263,35 @@ EscRedirectChar(BufferType * SockB, BufferType * DevB, PORTHANDLE PortFd, unsign
 
 		    /* Set baudrate */
 		case TNCAS_SET_BAUDRATE:
-		    IACCommand[IACPos] = C;
-		    IACPos++;
+		    S->IACCommand[S->IACPos] = C;
+		    S->IACPos++;
 
-		    if (IACPos == 10) {
-			HandleIACCommand(SockB, PortFd, IACCommand, IACPos);
-			IACEscape = IACNormal;
+		    if (S->IACPos == 10) {
+			HandleIACCommand(S, S->IACCommand, S->IACPos);
+			S->IACEscape = IACNormal;
 		    }
 		    break;
 
 		    /* Flow control command */
 		case TNCAS_FLOWCONTROL_SUSPEND:
 		case TNCAS_FLOWCONTROL_RESUME:
-		    IACCommand[IACPos] = C;
-		    IACPos++;
+		    S->IACCommand[S->IACPos] = C;
+		    S->IACPos++;
 
-		    if (IACPos == 6) {
-			HandleIACCommand(SockB, PortFd, IACCommand, IACPos);
-			IACEscape = IACNormal;
+		    if (S->IACPos == 6) {
+			HandleIACCommand(S, S->IACCommand, S->IACPos);
+			S->IACEscape = IACNormal;
 		    }
 		    break;
 
 		    /* Normal CPC command with single byte parameter */
 		default:
-		    IACCommand[IACPos] = C;
-		    IACPos++;
+		    S->IACCommand[S->IACPos] = C;
+		    S->IACPos++;
 
-		    if (IACPos == 7) {
-			HandleIACCommand(SockB, PortFd, IACCommand, IACPos);
-			IACEscape = IACNormal;
+		    if (S->IACPos == 7) {
+			HandleIACCommand(S, S->IACCommand, S->IACPos);
+			S->IACEscape = IACNormal;
 		    }
 		    break;
 		}
@@ -574,19 +1299,48 @@ EscRedirectChar(BufferType * SockB, BufferType * DevB, PORTHANDLE PortFd, unsign
 	}
 	else {
 	    /* Normal 3 byte IAC option */
-	    IACCommand[IACPos] = C;
-	    IACPos++;
+	    S->IACCommand[S->IACPos] = C;
+	    S->IACPos++;
 
-	    if (IACPos == 3) {
-		HandleIACCommand(SockB, PortFd, IACCommand, IACPos);
-		IACEscape = IACNormal;
+	    if (S->IACPos == 3) {
+		HandleIACCommand(S, S->IACCommand, S->IACPos);
+		S->IACEscape = IACNormal;
 	    }
 	}
 	break;
     }
 
     /* Set last received byte */
-    Last = C;
+    S->EscRedirectLast = C;
+}
+
+/* Redirect a buffer to Device checking for IAC escape sequences. Runs
+   without IAC, and without CR when not receiving BINARY, are copied
+   as is; escapes go through EscRedirectChar. Stops after a command
+   filling the CPC reply queue, returning the bytes handled. */
+unsigned int
+EscRedirectBuffer(SessionType * S, const unsigned char *Buffer, unsigned int BSize)
+{
+    unsigned int i = 0, Run;
+
+    while (i < BSize && S->CPCReplyCount < MaxCPCReplies) {
+	Boolean Binary = S->tnstate[TN_TRANSMIT_BINARY].is_do;
+
+	if (S->IACEscape != IACNormal || (!Binary && S->EscRedirectLast == 0x0D)) {
+	    EscRedirectChar(S, Buffer[i++]);
+	    continue;
+	}
+
+	Run = ScanBytes(Buffer + i, BSize - i, TNIAC, Binary ? TNIAC : 0x0D);
+	if (Run > 0) {
+	    AddBytesToBuffer(&S->ToDevBuf, Buffer + i, Run);
+	    S->EscRedirectLast = Buffer[i + Run - 1];
+	    i += Run;
+	}
+	if (i < BSize)
+	    EscRedirectChar(S, Buffer[i++]);
+    }
+    return i;
 }
 
 /* Send the specific telnet option to SockFd using Command as command */
@@ -604,26 +1358,28 @@ SendTelnetOption(BufferType * B, unsigned char Command, char Option)
 /* Send initial Telnet negotiations to the client */
 #define SendTelnetInitialOptions_bytes (SendTelnetOption_bytes*3)
 void
-SendTelnetInitialOptions(BufferType * B)
+SendTelnetInitialOptions(SessionType * S)
 {
+    BufferType *B = &S->ToNetBuf;
+
     SendTelnetOption(B, TNWILL, TN_TRANSMIT_BINARY);
-    tnstate[TN_TRANSMIT_BINARY].sent_will = 1;
+    S->tnstate[TN_TRANSMIT_BINARY].sent_will = 1;
     SendTelnetOption(B, TNDO, TN_TRANSMIT_BINARY);
-    tnstate[TN_TRANSMIT_BINARY].sent_do = 1;
+    S->tnstate[TN_TRANSMIT_BINARY].sent_do = 1;
     SendTelnetOption(B, TNWILL, TN_ECHO);
-    tnstate[TN_ECHO].sent_will = 1;
+    S->tnstate[TN_ECHO].sent_will = 1;
     SendTelnetOption(B, TNWILL, TN_SUPPRESS_GO_AHEAD);
-    tnstate[TN_SUPPRESS_GO_AHEAD].sent_will = 1;
+    S->tnstate[TN_SUPPRESS_GO_AHEAD].sent_will = 1;
     SendTelnetOption(B, TNDO, TN_SUPPRESS_GO_AHEAD);
-    tnstate[TN_SUPPRESS_GO_AHEAD].sent_do = 1;
+    S->tnstate[TN_SUPPRESS_GO_AHEAD].sent_do = 1;
     SendTelnetOption(B, TNDO, TNCOM_PORT_OPTION);
-    tnstate[TNCOM_PORT_OPTION].sent_do = 1;
+    S->tnstate[TNCOM_PORT_OPTION].sent_do = 1;
 }
 
 /* Send a string to SockFd performing IAC escaping
    Max buffer fill: 2*len(Str) */
 void
-SendStr(BufferType * B, char *Str)
+SendStr(SessionType * S, char *Str)
 {
     size_t I;
     size_t L;
@@ -631,27 +1387,24 @@ SendStr(BufferType * B, char *Str)
     L = strlen(Str);
 
     for (I = 0; I < L; I++)
-	EscWriteChar(B, (unsigned char) Str[I]);
+	EscWriteChar(S, (unsigned char) Str[I]);
 }
 
-/* Send the baud rate BR to Buffer */
-#define SendBaudRate_bytes (6 + 2*sizeof(unsigned long int))
+/* Send the baud rate BR to Buffer, as the four bytes in network order
+   RFC 2217 specifies */
+#define SendBaudRate_bytes (6 + 2*4)
 void
-SendBaudRate(BufferType * B, unsigned long int BR)
+SendBaudRate(SessionType * S, unsigned long int BR)
 {
-    unsigned char *p;
-    unsigned long int NBR;
+    BufferType *B = &S->ToNetBuf;
     int i;
 
-    NBR = htonl(BR);
-
     AddToBuffer(B, TNIAC);
     AddToBuffer(B, TNSB);
     AddToBuffer(B, TNCOM_PORT_OPTION);
     AddToBuffer(B, TNASC_SET_BAUDRATE);
-    p = (unsigned char *) &NBR;
-    for (i = 0; i < (int) sizeof(NBR); i++)
-	EscWriteChar(B, p[i]);
+    for (i = 24; i >= 0; i -= 8)
+	EscWriteChar(S, (unsigned char) ((BR >> i) & 0xFF));
     AddToBuffer(B, TNIAC);
     AddToBuffer(B, TNSE);
 }
@@ -659,75 +1412,230 @@ SendBaudRate(BufferType * B, unsigned long int BR)
 /* Send the CPC command Command using Parm as parameter */
 #define SendCPCByteCommand_bytes 8
 void
-SendCPCByteCommand(BufferType * B, unsigned char Command, unsigned char Parm)
+SendCPCByteCommand(SessionType * S, unsigned char Command, unsigned char Parm)
 {
+    BufferType *B = &S->ToNetBuf;
+
     AddToBuffer(B, TNIAC);
     AddToBuffer(B, TNSB);
     AddToBuffer(B, TNCOM_PORT_OPTION);
     AddToBuffer(B, Command);
-    EscWriteChar(B, Parm);
+    EscWriteChar(S, Parm);
     AddToBuffer(B, TNIAC);
     AddToBuffer(B, TNSE);
 }
 
-/* Handling of COM Port Control specific commands */
-#define HandleCPCCommand_bytes \
- MAX(SendSignature_bytes, MAX(SendBaudRate_bytes, SendCPCByteCommand_bytes))
-void
-HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command, size_t CSize)
+/* Whether a COM Port Control command only changes or queries the
+   termios settings, so it can be staged */
+static Boolean
+IsStagedCPCCommand(const unsigned char *Command)
 {
-    char LogStr[TmpStrLen];
-    char SigStr[255];
-    unsigned long int BaudRate;
-    unsigned char DataSize;
-    unsigned char Parity;
-    unsigned char StopSize;
-    unsigned char FlowControl;
-
-    /* Check wich command has been requested */
     switch (Command[3]) {
-	/* Signature */
-    case TNCAS_SIGNATURE:
-	if (CSize == 6) {
-	    /* Void signature, client is asking for our signature */
-	    snprintf(SigStr, sizeof(SigStr), "sercd %s %s", VERSION, DeviceName);
-	    LogStr[sizeof(SigStr) - 1] = '\0';
-	    SendSignature(SockB, SigStr);
-	    snprintf(LogStr, sizeof(LogStr), "Sent signature: %s", SigStr);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_INFO, LogStr);
-	}
-	else {
-	    /* Received client signature */
-	    strncpy(SigStr, (char *) &Command[4], MAX(CSize - 6, sizeof(SigStr) - 1));
-	    snprintf(LogStr, sizeof(LogStr) - 1, "Received client signature: %s", SigStr);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_INFO, LogStr);
-	}
-	break;
-
-	/* Set serial baud rate */
     case TNCAS_SET_BAUDRATE:
-	/* Retrieve the baud rate which is in network order */
-	BaudRate = ntohl(*((unsigned long int *) &Command[4]));
+    case TNCAS_SET_DATASIZE:
+    case TNCAS_SET_PARITY:
+    case TNCAS_SET_STOPSIZE:
+	return True;
+    case TNCAS_SET_CONTROL:
+	switch (Command[4]) {
+	case TNCOM_CMD_DTR_REQ:
+	case TNCOM_CMD_DTR_ON:
+	case TNCOM_CMD_DTR_OFF:
+	case TNCOM_CMD_RTS_REQ:
+	case TNCOM_CMD_RTS_ON:
+	case TNCOM_CMD_RTS_OFF:
+	case TNCOM_CMD_BREAK_REQ:
+	case TNCOM_CMD_BREAK_ON:
+	case TNCOM_CMD_BREAK_OFF:
+	    return False;
+	default:
+	    return True;
+	}
+    default:
+	return False;
+    }
+}
+
+/* Send the reply to a COM Port Control command. Replies to port
+   setting commands report the settings in effect. */
+static void
+SendCPCReply(SessionType * S, unsigned char Which, unsigned char Value)
+{
+    PORTHANDLE PortFd = *S->DeviceFd;
+    char SigStr[255];
+    unsigned long int BaudRate;
+    unsigned char Setting;
+
+    switch (Which) {
+    case TNCAS_SIGNATURE:
+	snprintf(SigStr, sizeof(SigStr), "sercd %s %s", VERSION, S->DeviceName);
+	SigStr[sizeof(SigStr) - 1] = '\0';
+	SendSignature(S, SigStr);
+	LogMsg(LOG_INFO, "Sent signature: %s", SigStr);
+	return;
+
+    case TNCAS_SET_BAUDRATE:
+	BaudRate = GetPortSpeed(PortFd);
+	SendBaudRate(S, BaudRate);
+	LogMsg(LOG_DEBUG, "Port baud rate: %lu", BaudRate);
+	break;
+
+    case TNCAS_SET_DATASIZE:
+	Setting = GetPortDataSize(PortFd);
+	SendCPCByteCommand(S, TNASC_SET_DATASIZE, Setting);
+	LogMsg(LOG_DEBUG, "Port data size: %u", (unsigned int) Setting);
+	break;
+
+    case TNCAS_SET_PARITY:
+	Setting = GetPortParity(PortFd);
+	SendCPCByteCommand(S, TNASC_SET_PARITY, Setting);
+	LogMsg(LOG_DEBUG, "Port parity: %u", (unsigned int) Setting);
+	break;
+
+    case TNCAS_SET_STOPSIZE:
+	Setting = GetPortStopSize(PortFd);
+	SendCPCByteCommand(S, TNASC_SET_STOPSIZE, Setting);
+	LogMsg(LOG_DEBUG, "Port stop size: %u", (unsigned int) Setting);
+	break;
+
+    case TNCAS_SET_CONTROL:
+	if (Value == TNCOM_CMD_BREAK_ON || Value == TNCOM_CMD_BREAK_OFF) {
+	    /* Break state, known when the command was handled */
+	    SendCPCByteCommand(S, TNASC_SET_CONTROL, Value);
+	    return;
+	}
+	if (Value == TNCOM_CMD_FLOW_REQ || Value == TNCOM_CMD_INFLOW_REQ ||
+	    Value == TNCOM_CMD_DTR_REQ || Value == TNCOM_CMD_RTS_REQ)
+	    /* Client asked for the current flow control or DTR/RTS */
+	    Setting = GetPortFlowControl(PortFd, Value);
+	else if (CiscoIOSCompatible && Value >= TNCOM_CMD_INFLOW_REQ
+		 && Value <= TNCOM_CMD_INFLOW_HARDWARE)
+	    /* INBOUND not supported separately.
+	       Following the behavior of Cisco ISO 11.3
+	     */
+	    Setting = 0;
+	else
+	    /* Return the actual port flow control settings */
+	    Setting = GetPortFlowControl(PortFd, TNCOM_CMD_FLOW_REQ);
+	SendCPCByteCommand(S, TNASC_SET_CONTROL, Setting);
+	LogMsg(LOG_DEBUG, "Port flow control: %u", (unsigned int) Setting);
+	break;
+
+    default:
+	/* Replies echoing a value, such as masks and purge requests */
+	SendCPCByteCommand(S, Which + TNASC_SIGNATURE, Value);
+	return;
+    }
+}
+
+/* Apply the staged port setting changes, and send the replies owed
+   once the port changes in progress have finished */
+static void
+CommitCPCCommands(SessionType * S)
+{
+    unsigned int i;
+
+    if (S->CPCStaged) {
+	S->CPCStaged = False;
+	CommitPortSettings(*S->DeviceFd);
+    }
+    if (PortJobsPending(*S->DeviceFd) > 0)
+	return;
+
+    for (i = 0; i < S->CPCReplyCount; i++)
+	SendCPCReply(S, S->CPCReplies[i][0], S->CPCReplies[i][1]);
+    S->CPCReplyCount = 0;
+    S->CPCReplyBytes = 0;
+}
+
+/* Note a reply owed to the client. Replies are sent in order, after
+   the port changes requested before them. Decoding stops while the
+   queue is full, see DecodeNetInput. */
+static void
+QueueCPCReply(SessionType * S, unsigned char Which, unsigned char Value)
+{
+    assert(S->CPCReplyCount < MaxCPCReplies);
+    S->CPCReplies[S->CPCReplyCount][0] = Which;
+    S->CPCReplies[S->CPCReplyCount][1] = Value;
+    S->CPCReplyCount++;
+    if (Which == TNCAS_SIGNATURE)
+	S->CPCReplyBytes += 6 * S->ReplyRatio;
+    else
+	S->CPCReplyBytes += MAX(SendBaudRate_bytes, SendCPCByteCommand_bytes);
+}
+
+/* Suspend or resume sending device data to the client, accounting the
+   time it is suspended */
+static void
+SetInputFlow(SessionType * S, Boolean On)
+{
+    struct timeval now;
+
+    if (On && !S->InputFlow && timerisset(&S->Stats.FlowOffSince)) {
+	gettimeofday(&now, NULL);
+	S->Stats.FlowOffUs += (now.tv_sec - S->Stats.FlowOffSince.tv_sec) * 1000000LL +
+	    (now.tv_usec - S->Stats.FlowOffSince.tv_usec);
+	timerclear(&S->Stats.FlowOffSince);
+    }
+    else if (!On && S->InputFlow)
+	gettimeofday(&S->Stats.FlowOffSince, NULL);
+    S->InputFlow = On;
+}
+
+/* Handling of COM Port Control specific commands */
+#define HandleCPCCommand_bytes \
+ MAX(SendSignature_bytes, MAX(SendBaudRate_bytes, SendCPCByteCommand_bytes))
+void
+HandleCPCCommand(SessionType * S, unsigned char *Command, size_t CSize)
+{
+    PORTHANDLE PortFd = *S->DeviceFd;
+    char SigStr[255];
+    unsigned long int BaudRate;
+
+    /* Port setting changes are staged until the whole network read
+       has been handled, and then applied together. Any other command
+       applies them first, so that the port sees the changes in the
+       order requested. */
+    if (!IsStagedCPCCommand(Command))
+	CommitCPCCommands(S);
+    else if (!S->CPCStaged) {
+	StagePortSettings(PortFd);
+	S->CPCStaged = True;
+    }
+
+    if (Command[3] < CPCCommandTypes)
+	S->Stats.CPCCommands[Command[3]]++;
+
+    /* Check wich command has been requested */
+    switch (Command[3]) {
+	/* Signature */
+    case TNCAS_SIGNATURE:
+	if (CSize == 6) {
+	    /* Void signature, client is asking for our signature */
+	    QueueCPCReply(S, Command[3], 0);
+	}
+	else {
+	    /* Received client signature */
+	    strncpy(SigStr, (char *) &Command[4], MAX(CSize - 6, sizeof(SigStr) - 1));
+	    LogMsg(LOG_INFO, "Received client signature: %s", SigStr);
+	}
+	break;
+
+	/* Set serial baud rate */
+    case TNCAS_SET_BAUDRATE:
+	/* Retrieve the baud rate which is in network order */
+	BaudRate = ((unsigned long int) Command[4] << 24) | ((unsigned long int) Command[5] << 16) |
+	    ((unsigned long int) Command[6] << 8) | (unsigned long int) Command[7];
 
 	if (BaudRate == 0)
 	    /* Client is asking for current baud rate */
 	    LogMsg(LOG_DEBUG, "Baud rate notification received.");
 	else {
 	    /* Change the baud rate */
-	    snprintf(LogStr, sizeof(LogStr), "Port baud rate change to %lu requested.", BaudRate);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_DEBUG, LogStr);
+	    LogMsg(LOG_DEBUG, "Port baud rate change to %lu requested.", BaudRate);
 	    SetPortSpeed(PortFd, BaudRate);
 	}
-
-	/* Send confirmation */
-	BaudRate = GetPortSpeed(PortFd);
-	SendBaudRate(SockB, BaudRate);
-	snprintf(LogStr, sizeof(LogStr), "Port baud rate: %lu", BaudRate);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_DEBUG, LogStr);
+	QueueCPCReply(S, Command[3], 0);
 	break;
 
 	/* Set serial data size */
@@ -737,19 +1645,10 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
 	    LogMsg(LOG_DEBUG, "Data size notification requested.");
 	else {
 	    /* Set the data size */
-	    snprintf(LogStr, sizeof(LogStr),
-		     "Port data size change to %u requested.", (unsigned int) Command[4]);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_DEBUG, LogStr);
+	    LogMsg(LOG_DEBUG, "Port data size change to %u requested.", (unsigned int) Command[4]);
 	    SetPortDataSize(PortFd, Command[4]);
 	}
-
-	/* Send confirmation */
-	DataSize = GetPortDataSize(PortFd);
-	SendCPCByteCommand(SockB, TNASC_SET_DATASIZE, DataSize);
-	snprintf(LogStr, sizeof(LogStr), "Port data size: %u", (unsigned int) DataSize);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_DEBUG, LogStr);
+	QueueCPCReply(S, Command[3], 0);
 	break;
 
 	/* Set the serial parity */
@@ -759,19 +1658,10 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
 	    LogMsg(LOG_DEBUG, "Parity notification requested.");
 	else {
 	    /* Set the parity */
-	    snprintf(LogStr, sizeof(LogStr),
-		     "Port parity change to %u requested", (unsigned int) Command[4]);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_DEBUG, LogStr);
+	    LogMsg(LOG_DEBUG, "Port parity change to %u requested", (unsigned int) Command[4]);
 	    SetPortParity(PortFd, Command[4]);
 	}
-
-	/* Send confirmation */
-	Parity = GetPortParity(PortFd);
-	SendCPCByteCommand(SockB, TNASC_SET_PARITY, Parity);
-	snprintf(LogStr, sizeof(LogStr), "Port parity: %u", (unsigned int) Parity);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_DEBUG, LogStr);
+	QueueCPCReply(S, Command[3], 0);
 	break;
 
 	/* Set the serial stop size */
@@ -781,134 +1671,96 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
 	    LogMsg(LOG_DEBUG, "Stop size notification requested.");
 	else {
 	    /* Set the stop size */
-	    snprintf(LogStr, sizeof(LogStr),
-		     "Port stop size change to %u requested.", (unsigned int) Command[4]);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_DEBUG, LogStr);
+	    LogMsg(LOG_DEBUG, "Port stop size change to %u requested.", (unsigned int) Command[4]);
 	    SetPortStopSize(PortFd, Command[4]);
 	}
-
-	/* Send confirmation */
-	StopSize = GetPortStopSize(PortFd);
-	SendCPCByteCommand(SockB, TNASC_SET_STOPSIZE, StopSize);
-	snprintf(LogStr, sizeof(LogStr), "Port stop size: %u", (unsigned int) StopSize);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_DEBUG, LogStr);
+	QueueCPCReply(S, Command[3], 0);
 	break;
 
 	/* Flow control and DTR/RTS handling */
     case TNCAS_SET_CONTROL:
 	switch (Command[4]) {
 	case TNCOM_CMD_FLOW_REQ:
+	case TNCOM_CMD_INFLOW_REQ:
 	case TNCOM_CMD_DTR_REQ:
 	case TNCOM_CMD_RTS_REQ:
-	case TNCOM_CMD_INFLOW_REQ:
 	    /* Client is asking for current flow control or DTR/RTS status */
 	    LogMsg(LOG_DEBUG, "Flow control notification requested.");
-	    FlowControl = GetPortFlowControl(PortFd, Command[4]);
-	    SendCPCByteCommand(SockB, TNASC_SET_CONTROL, FlowControl);
-	    snprintf(LogStr, sizeof(LogStr), "Port flow control: %u", (unsigned int) FlowControl);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_DEBUG, LogStr);
+	    QueueCPCReply(S, Command[3], Command[4]);
 	    break;
 
 	case TNCOM_CMD_BREAK_REQ:
-	    if (BreakSignaled) {
-		SendCPCByteCommand(SockB, TNASC_SET_CONTROL, TNCOM_CMD_BREAK_ON);
+	    if (S->BreakSignaled) {
+		QueueCPCReply(S, Command[3], TNCOM_CMD_BREAK_ON);
 	    }
 	    else {
-		SendCPCByteCommand(SockB, TNASC_SET_CONTROL, TNCOM_CMD_BREAK_OFF);
+		QueueCPCReply(S, Command[3], TNCOM_CMD_BREAK_OFF);
 	    }
 	    break;
 
 	case TNCOM_CMD_BREAK_ON:
 	    /* Break command */
 	    SetBreak(PortFd, True);
-	    BreakSignaled = True;
+	    S->BreakSignaled = True;
 	    LogMsg(LOG_DEBUG, "Break Signal ON.");
-	    SendCPCByteCommand(SockB, TNASC_SET_CONTROL, TNCOM_CMD_BREAK_ON);
+	    QueueCPCReply(S, Command[3], TNCOM_CMD_BREAK_ON);
 	    break;
 
 	case TNCOM_CMD_BREAK_OFF:
 	    SetBreak(PortFd, False);
-	    BreakSignaled = False;
+	    S->BreakSignaled = False;
 	    LogMsg(LOG_DEBUG, "Break Signal OFF.");
-	    SendCPCByteCommand(SockB, TNASC_SET_CONTROL, TNCOM_CMD_BREAK_OFF);
+	    QueueCPCReply(S, Command[3], TNCOM_CMD_BREAK_OFF);
 	    break;
 
 	default:
 	    /* Set the flow control */
-	    snprintf(LogStr, sizeof(LogStr),
-		     "Port flow control change to %u requested.", (unsigned int) Command[4]);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_DEBUG, LogStr);
+	    LogMsg(LOG_DEBUG,
+		   "Port flow control change to %u requested.", (unsigned int) Command[4]);
 	    SetPortFlowControl(PortFd, Command[4]);
-
-	    /* Flow control status confirmation */
-	    if (CiscoIOSCompatible && Command[4] >= TNCOM_CMD_INFLOW_REQ
-		&& Command[4] <= TNCOM_CMD_INFLOW_HARDWARE)
-		/* INBOUND not supported separately.
-		   Following the behavior of Cisco ISO 11.3
-		 */
-		FlowControl = 0;
-	    else
-		/* Return the actual port flow control settings */
-		FlowControl = GetPortFlowControl(PortFd, TNCOM_CMD_FLOW_REQ);
-
-	    SendCPCByteCommand(SockB, TNASC_SET_CONTROL, FlowControl);
-	    snprintf(LogStr, sizeof(LogStr), "Port flow control: %u", (unsigned int) FlowControl);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_DEBUG, LogStr);
+	    QueueCPCReply(S, Command[3], Command[4]);
 	    break;
 	}
 	break;
 
 	/* Set the line state mask */
     case TNCAS_SET_LINESTATE_MASK:
-	snprintf(LogStr, sizeof(LogStr), "Line state set to %u", (unsigned int) Command[4]);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_DEBUG, LogStr);
+	LogMsg(LOG_DEBUG, "Line state set to %u", (unsigned int) Command[4]);
 
-	/* Only break notification supported */
-	LineStateMask = Command[4] & (unsigned char) 16;
-	SendCPCByteCommand(SockB, TNASC_SET_LINESTATE_MASK, LineStateMask);
+	/* Only break and error notifications supported */
+	S->LineStateMask = Command[4] & LineStateSupported;
+	QueueCPCReply(S, Command[3], S->LineStateMask);
 	break;
 
 	/* Set the modem state mask */
     case TNCAS_SET_MODEMSTATE_MASK:
-	snprintf(LogStr, sizeof(LogStr), "Modem state mask set to %u", (unsigned int) Command[4]);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_DEBUG, LogStr);
-	ModemStateMask = Command[4];
-	SendCPCByteCommand(SockB, TNASC_SET_MODEMSTATE_MASK, ModemStateMask);
+	LogMsg(LOG_DEBUG, "Modem state mask set to %u", (unsigned int) Command[4]);
+	S->ModemStateMask = Command[4];
+	QueueCPCReply(S, Command[3], S->ModemStateMask);
 	break;
 
 	/* Port flush requested */
     case TNCAS_PURGE_DATA:
-	snprintf(LogStr, sizeof(LogStr), "Port flush %u requested.", (unsigned int) Command[4]);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_DEBUG, LogStr);
+	LogMsg(LOG_DEBUG, "Port flush %u requested.", (unsigned int) Command[4]);
 	SetFlush(PortFd, Command[4]);
-	SendCPCByteCommand(SockB, TNASC_PURGE_DATA, Command[4]);
+	QueueCPCReply(S, Command[3], Command[4]);
 	break;
 
 	/* Suspend output to the client */
     case TNCAS_FLOWCONTROL_SUSPEND:
 	LogMsg(LOG_DEBUG, "Flow control suspend requested.");
-	InputFlow = False;
+	SetInputFlow(S, False);
 	break;
 
 	/* Resume output to the client */
     case TNCAS_FLOWCONTROL_RESUME:
 	LogMsg(LOG_DEBUG, "Flow control resume requested.");
-	InputFlow = True;
+	SetInputFlow(S, True);
 	break;
 
 	/* Unknown request */
     default:
-	snprintf(LogStr, sizeof(LogStr), "Unhandled request %u", (unsigned int) Command[3]);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_DEBUG, LogStr);
+	LogMsg(LOG_DEBUG, "Unhandled request %u", (unsigned int) Command[3]);
 	break;
     }
 }
@@ -916,28 +1768,23 @@ HandleCPCCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
 /* Common telnet IAC commands handling */
 #define HandleIACCommand_bytes MAX(HandleCPCCommand_bytes, SendTelnetOption_bytes)
 void
-HandleIACCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command, size_t CSize)
+HandleIACCommand(SessionType * S, unsigned char *Command, size_t CSize)
 {
-    char LogStr[TmpStrLen];
-
     /* Check which command */
     switch (Command[1]) {
 	/* Suboptions */
     case TNSB:
-	if (!(tnstate[Command[2]].is_will || tnstate[Command[2]].is_do))
+	if (!(S->tnstate[Command[2]].is_will || S->tnstate[Command[2]].is_do))
 	    break;
 
 	switch (Command[2]) {
 	    /* RFC 2217 COM Port Control Protocol option */
 	case TNCOM_PORT_OPTION:
-	    HandleCPCCommand(SockB, PortFd, Command, CSize);
+	    HandleCPCCommand(S, Command, CSize);
 	    break;
 
 	default:
-	    snprintf(LogStr, sizeof(LogStr), "Unknown suboption received: %u",
-		     (unsigned int) Command[2]);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_DEBUG, LogStr);
+	    LogMsg(LOG_DEBUG, "Unknown suboption received: %u", (unsigned int) Command[2]);
 	    break;
 	}
 	break;
@@ -948,49 +1795,46 @@ HandleIACCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
 	    /* COM Port Control Option */
 	case TNCOM_PORT_OPTION:
 	    LogMsg(LOG_INFO, "Telnet COM Port Control Enabled (WILL).");
-	    PortControlEnable = True;
-	    if (!tnstate[Command[2]].sent_do) {
-		SendTelnetOption(SockB, TNDO, Command[2]);
+	    S->PortControlEnable = True;
+	    if (!S->tnstate[Command[2]].sent_do) {
+		SendTelnetOption(&S->ToNetBuf, TNDO, Command[2]);
 	    }
-	    tnstate[Command[2]].is_do = 1;
+	    S->tnstate[Command[2]].is_do = 1;
 	    break;
 
 	    /* Telnet Binary mode */
 	case TN_TRANSMIT_BINARY:
 	    LogMsg(LOG_INFO, "Telnet Binary Transfer Enabled (WILL).");
-	    if (!tnstate[Command[2]].sent_do)
-		SendTelnetOption(SockB, TNDO, Command[2]);
-	    tnstate[Command[2]].is_do = 1;
+	    if (!S->tnstate[Command[2]].sent_do)
+		SendTelnetOption(&S->ToNetBuf, TNDO, Command[2]);
+	    S->tnstate[Command[2]].is_do = 1;
 	    break;
 
 	    /* Echo request not handled */
 	case TN_ECHO:
 	    LogMsg(LOG_INFO, "Rejecting Telnet Echo Option (WILL).");
-	    if (!tnstate[Command[2]].sent_do)
-		SendTelnetOption(SockB, TNDO, Command[2]);
-	    tnstate[Command[2]].is_do = 1;
+	    if (!S->tnstate[Command[2]].sent_do)
+		SendTelnetOption(&S->ToNetBuf, TNDO, Command[2]);
+	    S->tnstate[Command[2]].is_do = 1;
 	    break;
 
 	    /* No go ahead needed */
 	case TN_SUPPRESS_GO_AHEAD:
 	    LogMsg(LOG_INFO, "Suppressing Go Ahead characters (WILL).");
-	    if (!tnstate[Command[2]].sent_do)
-		SendTelnetOption(SockB, TNDO, Command[2]);
-	    tnstate[Command[2]].is_do = 1;
+	    if (!S->tnstate[Command[2]].sent_do)
+		SendTelnetOption(&S->ToNetBuf, TNDO, Command[2]);
+	    S->tnstate[Command[2]].is_do = 1;
 	    break;
 
 	    /* Reject everything else */
 	default:
-	    snprintf(LogStr, sizeof(LogStr), "Rejecting option WILL: %u",
-		     (unsigned int) Command[2]);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_DEBUG, LogStr);
-	    SendTelnetOption(SockB, TNDONT, Command[2]);
-	    tnstate[Command[2]].is_do = 0;
+	    LogMsg(LOG_DEBUG, "Rejecting option WILL: %u", (unsigned int) Command[2]);
+	    SendTelnetOption(&S->ToNetBuf, TNDONT, Command[2]);
+	    S->tnstate[Command[2]].is_do = 0;
 	    break;
 	}
-	tnstate[Command[2]].sent_do = 0;
-	tnstate[Command[2]].sent_dont = 0;
+	S->tnstate[Command[2]].sent_do = 0;
+	S->tnstate[Command[2]].sent_dont = 0;
 	break;
 
 	/* Confirmations for options */
@@ -999,61 +1843,56 @@ HandleIACCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
 	    /* COM Port Control Option */
 	case TNCOM_PORT_OPTION:
 	    LogMsg(LOG_INFO, "Telnet COM Port Control Enabled (DO).");
-	    PortControlEnable = True;
-	    if (!tnstate[Command[2]].sent_will)
-		SendTelnetOption(SockB, TNWILL, Command[2]);
-	    tnstate[Command[2]].is_will = 1;
+	    S->PortControlEnable = True;
+	    if (!S->tnstate[Command[2]].sent_will)
+		SendTelnetOption(&S->ToNetBuf, TNWILL, Command[2]);
+	    S->tnstate[Command[2]].is_will = 1;
 	    break;
 
 	    /* Telnet Binary mode */
 	case TN_TRANSMIT_BINARY:
 	    LogMsg(LOG_INFO, "Telnet Binary Transfer Enabled (DO).");
-	    if (!tnstate[Command[2]].sent_will)
-		SendTelnetOption(SockB, TNWILL, Command[2]);
-	    tnstate[Command[2]].is_will = 1;
+	    if (!S->tnstate[Command[2]].sent_will)
+		SendTelnetOption(&S->ToNetBuf, TNWILL, Command[2]);
+	    S->tnstate[Command[2]].is_will = 1;
 	    break;
 
 	    /* Echo request handled.  The modem will echo for the user. */
 	case TN_ECHO:
 	    LogMsg(LOG_INFO, "Rejecting Telnet Echo Option (DO).");
-	    if (!tnstate[Command[2]].sent_will)
-		SendTelnetOption(SockB, TNWILL, Command[2]);
-	    tnstate[Command[2]].is_will = 1;
+	    if (!S->tnstate[Command[2]].sent_will)
+		SendTelnetOption(&S->ToNetBuf, TNWILL, Command[2]);
+	    S->tnstate[Command[2]].is_will = 1;
 	    break;
 
 	    /* No go ahead needed */
 	case TN_SUPPRESS_GO_AHEAD:
 	    LogMsg(LOG_INFO, "Suppressing Go Ahead characters (DO).");
-	    if (!tnstate[Command[2]].sent_will)
-		SendTelnetOption(SockB, TNWILL, Command[2]);
-	    tnstate[Command[2]].is_will = 1;
+	    if (!S->tnstate[Command[2]].sent_will)
+		SendTelnetOption(&S->ToNetBuf, TNWILL, Command[2]);
+	    S->tnstate[Command[2]].is_will = 1;
 	    break;
 
 	    /* Reject everything else */
 	default:
-	    snprintf(LogStr, sizeof(LogStr), "Rejecting option DO: %u", (unsigned int) Command[2]);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_DEBUG, LogStr);
-	    SendTelnetOption(SockB, TNWONT, Command[2]);
-	    tnstate[Command[2]].is_will = 0;
+	    LogMsg(LOG_DEBUG, "Rejecting option DO: %u", (unsigned int) Command[2]);
+	    SendTelnetOption(&S->ToNetBuf, TNWONT, Command[2]);
+	    S->tnstate[Command[2]].is_will = 0;
 	    break;
 	}
-	tnstate[Command[2]].sent_will = 0;
-	tnstate[Command[2]].sent_wont = 0;
+	S->tnstate[Command[2]].sent_will = 0;
+	S->tnstate[Command[2]].sent_wont = 0;
 	break;
 
 	/* Notifications of rejections for options */
     case TNDONT:
-	snprintf(LogStr, sizeof(LogStr), "Received rejection for option: %u",
-		 (unsigned int) Command[2]);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_DEBUG, LogStr);
-	if (tnstate[Command[2]].is_will) {
-	    SendTelnetOption(SockB, TNWONT, Command[2]);
-	    tnstate[Command[2]].is_will = 0;
+	LogMsg(LOG_DEBUG, "Received rejection for option: %u", (unsigned int) Command[2]);
+	if (S->tnstate[Command[2]].is_will) {
+	    SendTelnetOption(&S->ToNetBuf, TNWONT, Command[2]);
+	    S->tnstate[Command[2]].is_will = 0;
 	}
-	tnstate[Command[2]].sent_will = 0;
-	tnstate[Command[2]].sent_wont = 0;
+	S->tnstate[Command[2]].sent_will = 0;
+	S->tnstate[Command[2]].sent_wont = 0;
 	break;
 
     case TNWONT:
@@ -1062,17 +1901,14 @@ HandleIACCommand(BufferType * SockB, PORTHANDLE PortFd, unsigned char *Command,
 		   "Protocol Option (RFC 2217), trying to serve anyway.");
 	}
 	else {
-	    snprintf(LogStr, sizeof(LogStr),
-		     "Received rejection for option: %u", (unsigned int) Command[2]);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_DEBUG, LogStr);
+	    LogMsg(LOG_DEBUG, "Received rejection for option: %u", (unsigned int) Command[2]);
 	}
-	if (tnstate[Command[2]].is_do) {
-	    SendTelnetOption(SockB, TNDONT, Command[2]);
-	    tnstate[Command[2]].is_do = 0;
+	if (S->tnstate[Command[2]].is_do) {
+	    SendTelnetOption(&S->ToNetBuf, TNDONT, Command[2]);
+	    S->tnstate[Command[2]].is_do = 0;
 	}
-	tnstate[Command[2]].sent_do = 0;
-	tnstate[Command[2]].sent_dont = 0;
+	S->tnstate[Command[2]].sent_do = 0;
+	S->tnstate[Command[2]].sent_dont = 0;
 	break;
     }
 }
@@ -1084,23 +1920,190 @@ IOResultError(int iobytes, const char *err, const char *eof_err)
     switch (iobytes) {
     case -1:
 	if (errno != EWOULDBLOCK) {
-	    LogMsg(LOG_NOTICE, err);
+	    LogMsg(LOG_NOTICE, "%s", err);
 	    return True;
 	}
 	break;
     case 0:
-	LogMsg(LOG_NOTICE, eof_err);
+	LogMsg(LOG_NOTICE, "%s", eof_err);
 	return True;
 	break;
     }
     return False;
 }
 
+/* Add the result of a read or write to Total. Writes moving less than
+   Offered bytes count as short; reads pass 0. Uses errno. */
+static void
+CountIO(SessionType * S, unsigned long long *Total, ssize_t iobytes, size_t Offered)
+{
+    if (iobytes > 0) {
+	*Total += iobytes;
+	if ((size_t) iobytes < Offered)
+	    S->Stats.ShortWrites++;
+    }
+    else if (iobytes < 0 && errno == EWOULDBLOCK)
+	S->Stats.WouldBlock++;
+}
+
+/* Raise a buffer high-water mark to Level */
+static void
+NoteHighWater(unsigned int *High, unsigned int Level)
+{
+    if (Level > *High)
+	*High = Level;
+}
+
+/* Histogram bucket counting a delay of Us microseconds */
+static unsigned int
+LatencyIndex(unsigned long long Us)
+{
+    unsigned int e = 0;
+
+    if (Us < 2 * LatencySubBuckets)
+	return Us;
+    while ((Us >> e) >= 2 * LatencySubBuckets)
+	e++;
+    return MIN((e + 1) * LatencySubBuckets + (Us >> e) - LatencySubBuckets,
+	       LatencyBuckets - 1);
+}
+
+/* Smallest delay in microseconds above histogram bucket i */
+static unsigned long long
+LatencyLimit(unsigned int i)
+{
+    if (i < 2 * LatencySubBuckets)
+	return i + 1;
+    return (unsigned long long) (LatencySubBuckets + i % LatencySubBuckets + 1) <<
+	(i / LatencySubBuckets - 1);
+}
+
+/* Add a delay of Us microseconds to a latency histogram */
+static void
+AddLatency(LatencyType * L, unsigned long long Us)
+{
+    L->Count[LatencyIndex(Us)]++;
+    L->Total++;
+    L->SumUs += Us;
+    if (Us > L->MaxUs)
+	L->MaxUs = Us;
+}
+
+/* Delay in microseconds not exceeded by PerMyriad 1/10000ths of the
+   samples of a latency histogram */
+static unsigned long long
+LatencyPercentile(LatencyType * L, unsigned int PerMyriad)
+{
+    unsigned long long Sum = 0;
+    unsigned int i;
+
+    if (L->Total == 0)
+	return 0;
+    for (i = 0; i < LatencyBuckets - 1; i++) {
+	Sum += L->Count[i];
+	if (Sum * 10000 >= L->Total * PerMyriad)
+	    break;
+    }
+    return MIN(LatencyLimit(i) - 1, L->MaxUs);
+}
+
+/* Note that the data just read ends Queued bytes after output
+   position Written. When all marks are in use, the newest one is
+   extended. */
+static void
+MarkQueued(LatencyTrackType * T, unsigned long long Written, unsigned int Queued)
+{
+    unsigned long long End = Written + Queued;
+    LatencyMarkType *M;
+
+    if (!LatencyTiming || Queued == 0)
+	return;
+    if (T->Count > 0) {
+	M = &T->Marks[(T->First + T->Count - 1) % LatencyMarks];
+	if (M->End >= End)
+	    return;
+	if (T->Count == LatencyMarks) {
+	    M->End = End;
+	    return;
+	}
+    }
+    M = &T->Marks[(T->First + T->Count++) % LatencyMarks];
+    M->End = End;
+    M->Time = MonotonicUs();
+}
+
+/* Account in L the latency of the data now written up to output
+   position Written */
+static void
+MarkWritten(LatencyTrackType * T, LatencyType * L, unsigned long long Written)
+{
+    unsigned long long now;
+    LatencyMarkType *M;
+
+    if (T->Count == 0 || T->Marks[T->First].End > Written)
+	return;
+    now = MonotonicUs();
+    while (T->Count > 0) {
+	M = &T->Marks[T->First];
+	if (M->End > Written)
+	    break;
+	AddLatency(L, now - M->Time);
+	T->First = (T->First + 1) % LatencyMarks;
+	T->Count--;
+    }
+}
+
+/* Milliseconds from Now to Then, rounded up; -1 if Then has passed */
+long
+TimevalDiffMs(const struct timeval *Then, const struct timeval *Now)
+{
+    long usec = (Then->tv_sec - Now->tv_sec) * 1000000L + (Then->tv_usec - Now->tv_usec);
+
+    if (usec < 0)
+	return -1;
+    return (usec + 999) / 1000;
+}
+
+/* Combine Timeout (ms, -1 for none) with the earliest deadline of the
+   watches */
+long
+WatchTimeout(SercdWatch * Watches, int Count, const struct timeval *Now, long Timeout)
+{
+    long ms;
+    int i;
+
+    for (i = 0; i < Count; i++) {
+	if (!timerisset(&Watches[i].Deadline))
+	    continue;
+	ms = MAX(TimevalDiffMs(&Watches[i].Deadline, Now), 0);
+	if (Timeout < 0 || ms < Timeout)
+	    Timeout = ms;
+    }
+    return Timeout;
+}
+
+/* Flag SERCD_EV_TIMEOUT on the watches whose deadline has passed.
+   Returns the number of such watches. */
+int
+WatchDeadlines(SercdWatch * Watches, int Count)
+{
+    struct timeval now;
+    int i, ret = 0;
+
+    gettimeofday(&now, NULL);
+    for (i = 0; i < Count; i++) {
+	if (timerisset(&Watches[i].Deadline) && !timercmp(&now, &Watches[i].Deadline, <)) {
+	    Watches[i].Events |= SERCD_EV_TIMEOUT;
+	    ret++;
+	}
+    }
+    return ret;
+}
+
 void
 LogPortSettings(unsigned long speed, unsigned char datasize, unsigned char parity,
 		unsigned char stopsize, unsigned char outflow, unsigned char inflow)
 {
-    char LogStr[TmpStrLen];
     char parchar;
     char *stopbits = "";
     char *outflowtype = "";
@@ -1178,11 +2181,8 @@ LogPortSettings(unsigned long speed, unsigned char datasize, unsigned char parit
 	break;
     }
 
-    snprintf(LogStr, sizeof(LogStr),
-	     "Port settings:%lu-%u-%c-%s outflow:%s inflow:%s",
-	     speed, datasize, parchar, stopbits, outflowtype, inflowtype);
-    LogStr[sizeof(LogStr) - 1] = '\0';
-    LogMsg(LOG_NOTICE, LogStr);
+    LogMsg(LOG_NOTICE, "Port settings:%lu-%u-%c-%s outflow:%s inflow:%s",
+	   speed, datasize, parchar, stopbits, outflowtype, inflowtype);
 }
 
 void
@@ -1194,368 +2194,2762 @@ Usage(void)
 	    "This program can be run by the inetd superserver or standalone\n"
 	    "\n"
 	    "Usage:\n"
-	    "sercd [-ie] [-p port] [-l addr] <loglevel> <device> <lockfile> [pollingterval]\n"
+	    "sercd [-iestu] [-b size] [-k backlog] [-H size] [-R limit] [-O max] [-C policy] [-F gap] [-S path] [-M port] [-T threads] [-p port] [-l addr] <loglevel> <device> <lockfile> [pollingterval]\n"
+	    "sercd [-iestu] [-b size] [-k backlog] [-H size] [-R limit] [-O max] [-C policy] [-F gap] [-S path] [-M port] [-T threads] [-l addr] -c porttable <loglevel> [pollingterval]\n"
 	    "-i       indicates Cisco IOS Bug compatibility\n"
 	    "-e       send output to standard error instead of syslog\n"
+	    "-s       use select() instead of epoll() for event handling\n"
+	    "-u       use io_uring for event handling and reads (Linux)\n"
+	    "-t       measure the latency of forwarded data\n"
 	    "-p port  listen on specified port, instead of port 7000\n"
 	    "-l addr  standalone mode, bind to specified adress, empty string for all\n"
+	    "-c file  standalone mode, serve all ports listed in file\n"
+	    "-b size  size of the network and device buffers, default is %d\n"
+	    "-k backlog  keep devices open between clients, and up to backlog\n"
+	    "         bytes of device data for the next client (standalone mode)\n"
+	    "-H size[:file]  keep the last size bytes of device data, in file if\n"
+	    "         given, and replay them to new clients (standalone mode)\n"
+	    "-R limit  replay only the last limit bytes, or with an s suffix the\n"
+	    "         data of the last limit seconds\n"
+	    "-O max[:drop|:skip]  let up to max further clients watch the device\n"
+	    "         output read-only, dropping or skipping ahead those falling behind\n"
+	    "-C policy  coalesce network output: off (default), auto, or\n"
+	    "         <delay>[:<threshold>] to hold output up to delay ms until\n"
+	    "         threshold bytes are queued\n"
+	    "-F gap[:maxlen]  send device input in frames ending after gap idle\n"
+	    "         character times, or maxlen bytes (default %d)\n"
+	    "-S path  serve statistics as JSON on a Unix domain socket\n"
+	    "-M [addr:]port  standalone mode, serve OpenMetrics over HTTP on port\n"
+	    "-T threads[:pin]  standalone mode, share the ports out to threads\n"
+	    "         event loops, 0 for one per CPU, pinned to a CPU each if :pin\n"
 	    "Poll interval is in milliseconds, default is %d,\n"
-	    "0 means no polling\n", VERSION, DEFAULT_POLL_INTERVAL);
+	    "0 means no polling\n"
+	    "Each port table line has the form\n"
+	    "  <tcpport> <device> <lockfile> [speed-datasize-parity-stopsize[-flow]] [raw]\n"
+	    "  [coalesce=policy] [frame=gap[:maxlen]] [keep[=backlog]]\n"
+	    "  [history=size[:file]] [replay=limit] [observers=max[:drop|:skip]]\n"
+	    "for example: 7001 /dev/ttyS0 /var/lock/LCK..ttyS0 9600-8-N-1-none\n",
+	    VERSION, DefaultBufferSize, DefaultFrameMaxLen, DEFAULT_POLL_INTERVAL);
 }
 
-/* Main function */
-int
-main(int argc, char **argv)
+/* Add a session for the given port to the session table. Must not be
+   called once descriptors are in use, since the table may move. */
+static SessionType *
+NewSession(char *DeviceName, char *LockFileName, unsigned int ListenPort)
 {
-    /* Chars read */
-    char readbuf[512];
+    SessionType *S;
 
-    /* Temporary string for logging */
-    char LogStr[TmpStrLen];
+    S = realloc(Sessions, (SessionCount + 1) * sizeof(SessionType));
+    if (!S) {
+	fprintf(stderr, "Out of memory\n");
+	exit(Error);
+    }
+    Sessions = S;
+    S = &Sessions[SessionCount++];
+
+    memset(S, 0, sizeof(*S));
+    S->Unpublished = True;
+    S->DeviceName = DeviceName;
+    S->LockFileName = LockFileName;
+    S->ListenPort = ListenPort;
+    S->DeviceFd = NULL;
+    S->InSocketFd = S->OutSocketFd = S->LSocketFd = NULL;
+    AllocBuffer(&S->ToDevBuf, BufferSize);
+    AllocBuffer(&S->ToNetBuf, BufferSize);
+    S->Coalesce = DefaultCoalesce;
+    S->Framing = DefaultFraming;
+    S->KeepOpen = DefaultKeepOpen;
+    S->BacklogSize = DefaultBacklog;
+    S->HistorySize = DefaultHistorySize;
+    S->HistoryFile = DefaultHistoryFile;
+    S->Replay = DefaultReplay;
+    S->MaxObservers = DefaultMaxObservers;
+    S->SkipObservers = DefaultSkipObservers;
+
+    /* The longest reply per request byte is the one to the 6 byte
+       signature request; the signature is "sercd <version> <device>" */
+    S->ReplyRatio = (6 + 2 * MIN(strlen("sercd  ") + strlen(VERSION) + strlen(DeviceName), 254) + 5) / 6;
+    S->ReplyRatio = MAX(S->ReplyRatio, 3);
+    return S;
+}
 
-    /* Poll interval and timer */
-    long PollInterval;
+/* Parse port settings in the form speed-datasize-parity-stopsize[-flow],
+   such as 9600-8-N-1 or 115200-8-E-1-rtscts. Returns False if invalid. */
+static Boolean
+ParsePortSettings(const char *Str, PortSettingsType * P)
+{
+    char Parity, Flow[16];
+    unsigned long Speed;
+    unsigned int DataSize, StopSize;
+    int n;
+
+    memset(P, 0, sizeof(*P));
+    Flow[0] = '\0';
+    n = sscanf(Str, "%lu-%u-%c-%u-%15s", &Speed, &DataSize, &Parity, &StopSize, Flow);
+    if (n < 4 || DataSize < 5 || DataSize > 8 || StopSize < 1 || StopSize > 2)
+	return False;
+
+    P->Speed = Speed;
+    P->DataSize = DataSize;
+    P->StopSize = (StopSize == 2) ? TNCOM_TWOSTOPBITS : TNCOM_ONESTOPBIT;
+
+    switch (Parity) {
+    case 'N':
+    case 'n':
+	P->Parity = TNCOM_NOPARITY;
+	break;
+    case 'O':
+    case 'o':
+	P->Parity = TNCOM_ODDPARITY;
+	break;
+    case 'E':
+    case 'e':
+	P->Parity = TNCOM_EVENPARITY;
+	break;
+    default:
+	return False;
+    }
 
-    /* Buffer to Device from Network */
-    BufferType ToDevBuf;
+    if (n < 5)
+	return True;
+    if (!strcmp(Flow, "none"))
+	P->FlowControl = TNCOM_CMD_FLOW_NONE;
+    else if (!strcmp(Flow, "xonxoff"))
+	P->FlowControl = TNCOM_CMD_FLOW_XONXOFF;
+    else if (!strcmp(Flow, "rtscts"))
+	P->FlowControl = TNCOM_CMD_FLOW_HARDWARE;
+    else
+	return False;
 
-    /* Buffer to Network from Device */
-    BufferType ToNetBuf;
+    return True;
+}
 
-    int opt = 0;
-    char *optstring = "iep:l:";
-    unsigned int opt_port = 7000;
-    Boolean inetd_mode = True;
-    struct in_addr opt_bind_addr;
-    SERCD_SOCKET insocket, outsocket, lsocket;
-    SERCD_SOCKET *LSocketFd = NULL;
-    PORTHANDLE devicefd;
+/* Parse a coalescing policy: off, auto, or <delay>[:<threshold>] with
+   the delay in ms and the threshold in bytes. Returns False if
+   invalid. */
+static Boolean
+ParseCoalesce(const char *Str, CoalesceType * C)
+{
+    char *p;
 
-    opt_bind_addr.s_addr = INADDR_ANY;
+    C->Delay = DefaultCoalesceDelay;
+    C->Threshold = DefaultCoalesceThreshold;
+    if (!strcmp(Str, "off")) {
+	C->Mode = CoalesceOff;
+	return True;
+    }
+    if (!strcmp(Str, "auto")) {
+	C->Mode = CoalesceAuto;
+	return True;
+    }
 
-    while (opt != -1) {
-	opt = getopt(argc, argv, optstring);
-	switch (opt) {
-	    /* Cisco IOS compatibility */
-	case 'i':
-	    CiscoIOSCompatible = True;
-	    break;
-	case 'e':
-	    StdErrLogging = True;
-	    break;
-	case 'p':
-	    opt_port = strtol(optarg, NULL, 10);
-	    if (opt_port == 0) {
-		fprintf(stderr, "Invalid port\n");
-		exit(Error);
-	    }
-	    break;
-	case 'l':
-	    if (*optarg) {
-		opt_bind_addr.s_addr = inet_addr(optarg);
-		if (opt_bind_addr.s_addr == (unsigned) -1) {
-		    fprintf(stderr, "Invalid bind address\n");
-		    exit(Error);
-		}
-	    }
-	    inetd_mode = False;
-	    break;
-	}
+    C->Mode = CoalesceFixed;
+    C->Delay = strtol(Str, &p, 10);
+    if (p == Str || C->Delay < 0 || C->Delay > 10000)
+	return False;
+    if (*p == ':') {
+	Str = p + 1;
+	C->Threshold = strtoul(Str, &p, 10);
+	if (p == Str || C->Threshold == 0)
+	    return False;
     }
+    return *p == '\0';
+}
 
-    /* Check the command line argument count */
-    if (argc - optind < 3 || argc - optind > 4) {
-	Usage();
-	exit(Error);
+/* Parse a framing setting: <gap>[:<maxlen>] with the idle gap in
+   character times, such as 3.5 for Modbus RTU, and the maximum frame
+   length in bytes. Returns False if invalid. */
+static Boolean
+ParseFraming(const char *Str, FramingType * F)
+{
+    char *p;
+    double Gap;
+
+    F->MaxLen = DefaultFrameMaxLen;
+    Gap = strtod(Str, &p);
+    if (p == Str || Gap < 0.1 || Gap > 1000)
+	return False;
+    F->Gap = (unsigned int) (Gap * 10 + 0.5);
+    if (*p == ':') {
+	Str = p + 1;
+	F->MaxLen = strtoul(Str, &p, 10);
+	if (p == Str || F->MaxLen == 0)
+	    return False;
     }
+    return *p == '\0';
+}
 
-    /* Sets the log level */
-    MaxLogLevel = atoi(argv[optind++]);
+/* Parse a backlog size in bytes. Returns False if invalid. */
+static Boolean
+ParseBacklog(const char *Str, unsigned int *Size)
+{
+    char *p;
+    unsigned long Value = strtoul(Str, &p, 10);
 
-    /* Gets device and lock file names */
-    DeviceName = argv[optind++];
-    LockFileName = argv[optind++];
+    if (p == Str || *p || Value > MaxBufferSize)
+	return False;
+    *Size = Value;
+    return True;
+}
 
-    /* Retrieve the polling interval */
-    if (optind < argc) {
-	char *endptr;
-	PollInterval = strtol(argv[optind++], &endptr, 0);
-	if (!endptr || *endptr || PollInterval < 0) {
-	    fprintf(stderr, "Invalid polling interval\n");
-	    exit(Error);
-	}
-    }
-    else {
-	PollInterval = DEFAULT_POLL_INTERVAL;
-    }
+/* Parse a history in the form size[:file]. Returns False if invalid. */
+static Boolean
+ParseHistory(const char *Str, unsigned int *Size, char **File)
+{
+    char *p;
+    unsigned long Value = strtoul(Str, &p, 10);
+
+    if (p == Str || Value == 0 || Value > MaxHistorySize || (*p && (*p != ':' || !p[1])))
+	return False;
+    *Size = Value;
+    *File = *p ? strdup(p + 1) : NULL;
+    return True;
+}
 
-    PlatformInit();
+/* Parse a replay limit, in bytes or, followed by s, in seconds.
+   Returns False if invalid. */
+static Boolean
+ParseReplay(const char *Str, ReplayType * R)
+{
+    char *p;
 
-    /* Logs sercd start */
-    LogMsg(LOG_NOTICE, "sercd started.");
+    R->Limit = strtoul(Str, &p, 10);
+    if (p == Str)
+	return False;
+    R->Seconds = (*p == 's');
+    return *p == '\0' || (R->Seconds && p[1] == '\0');
+}
 
-    /* Logs sercd log level */
-    snprintf(LogStr, sizeof(LogStr), "Log level: %i", MaxLogLevel);
-    LogStr[sizeof(LogStr) - 1] = '\0';
-    LogMsg(LOG_INFO, LogStr);
+/* Parse observers in the form max[:drop|:skip]. Returns False if
+   invalid. */
+static Boolean
+ParseObservers(const char *Str, unsigned int *Max, Boolean * Skip)
+{
+    char *p;
+    unsigned long Value = strtoul(Str, &p, 10);
+
+    if (p == Str || Value > MaxObserverLimit)
+	return False;
+    *Max = Value;
+    *Skip = !strcmp(p, ":skip");
+    return *Skip || *p == '\0' || !strcmp(p, ":drop");
+}
 
-    /* Logs the polling interval */
-    snprintf(LogStr, sizeof(LogStr), "Polling interval (ms): %ld", PollInterval);
-    LogStr[sizeof(LogStr) - 1] = '\0';
-    LogMsg(LOG_INFO, LogStr);
+/* Parse event loop threads in the form count[:pin], 0 for one per CPU.
+   Returns False if invalid. */
+static Boolean
+ParseThreads(const char *Str, unsigned int *Count, Boolean * Pin)
+{
+    char *p;
+    unsigned long Value = strtoul(Str, &p, 10);
+
+    if (p == Str || Value > MaxReactors)
+	return False;
+    if (Value == 0)
+	Value = MIN(CpuCount(), MaxReactors);
+    *Count = Value;
+    *Pin = !strcmp(p, ":pin");
+    return *Pin || *p == '\0';
+}
 
-    if (inetd_mode) {
-	/* inetd mode */
-	insocket = STDIN_FILENO;
-	outsocket = STDOUT_FILENO;
-	InSocketFd = &insocket;
-	OutSocketFd = &outsocket;
-	SetSocketOptions(*InSocketFd, *OutSocketFd);
-	InitBuffer(&ToNetBuf);
-	InitTelnetStateMachine();
-	SendTelnetInitialOptions(&ToNetBuf);
+/* Read the port table for multi-port mode. Each non-empty line, except
+   comments starting with #, describes one port:
+   <tcpport> <device> <lockfile> [settings] [raw] [coalesce=policy]
+   [frame=gap[:maxlen]] [keep[=backlog]] [history=size[:file]] [replay=limit]
+   [observers=max[:drop|:skip]] */
+static void
+ReadPortTable(const char *FileName)
+{
+    FILE *f;
+    char Line[1024];
+    int LineNo = 0;
+
+    f = fopen(FileName, "r");
+    if (!f) {
+	perror(FileName);
+	exit(Error);
     }
-    else {
-	/* Standalone mode */
-	struct sockaddr_in sin;
-	lsocket = socket(PF_INET, SOCK_STREAM, 0);
-	if (lsocket < 0) {
-	    perror("socket");
+
+    while (fgets(Line, sizeof(Line), f)) {
+	char *Port, *Device, *Lock, *Option, *p;
+	unsigned long ListenPort;
+	SessionType *S;
+
+	LineNo++;
+	if ((p = strchr(Line, '#')))
+	    *p = '\0';
+
+	Port = strtok(Line, " \t\r\n");
+	if (!Port)
+	    continue;
+	Device = strtok(NULL, " \t\r\n");
+	Lock = strtok(NULL, " \t\r\n");
+
+	ListenPort = strtoul(Port, &p, 10);
+	if (*p || ListenPort == 0 || ListenPort > 65535 || !Device || !Lock) {
+	    fprintf(stderr, "%s:%d: invalid port table entry\n", FileName, LineNo);
 	    exit(Error);
 	}
-#ifndef WIN32
-	int SockParmEnable = 1;
-	/* Windows is totally broken wrt SO_REUSEADDR - it uses
-	   non-standard and mostly useless semantics. This is
-	   confirmed by Microsoft: From
-	   http://msdn.microsoft.com/en-us/library/ms740621(VS.85).aspx:
-	   "the behavior for all sockets bound to that port is
-	   indeterminate". "The exception to this non-deterministic
-	   behavior is multicast sockets. " Instead, they
-	   are recommending SO_EXCLUSIVEADDRUSE, but it typically only
-	   works if you have administrator privs. Bah. */
-	setsockopt(lsocket, SOL_SOCKET, SO_REUSEADDR, (char *) &SockParmEnable,
-		   sizeof(SockParmEnable));
+
+	S = NewSession(strdup(Device), strdup(Lock), ListenPort);
+	while ((Option = strtok(NULL, " \t\r\n"))) {
+	    if (!strcmp(Option, "raw")) {
+		S->Raw = True;
+	    }
+	    else if (!strncmp(Option, "coalesce=", 9)) {
+		if (!ParseCoalesce(Option + 9, &S->Coalesce)) {
+		    fprintf(stderr, "%s:%d: invalid coalescing policy %s\n", FileName, LineNo,
+			    Option + 9);
+		    exit(Error);
+		}
+	    }
+	    else if (!strncmp(Option, "frame=", 6)) {
+		if (!ParseFraming(Option + 6, &S->Framing)) {
+		    fprintf(stderr, "%s:%d: invalid framing %s\n", FileName, LineNo, Option + 6);
+		    exit(Error);
+		}
+	    }
+	    else if (!strcmp(Option, "keep")) {
+		S->KeepOpen = True;
+	    }
+	    else if (!strncmp(Option, "keep=", 5)) {
+		S->KeepOpen = True;
+		if (!ParseBacklog(Option + 5, &S->BacklogSize)) {
+		    fprintf(stderr, "%s:%d: invalid backlog %s\n", FileName, LineNo, Option + 5);
+		    exit(Error);
+		}
+	    }
+	    else if (!strncmp(Option, "history=", 8)) {
+		if (!ParseHistory(Option + 8, &S->HistorySize, &S->HistoryFile)) {
+		    fprintf(stderr, "%s:%d: invalid history %s\n", FileName, LineNo, Option + 8);
+		    exit(Error);
+		}
+	    }
+	    else if (!strncmp(Option, "observers=", 10)) {
+		if (!ParseObservers(Option + 10, &S->MaxObservers, &S->SkipObservers)) {
+		    fprintf(stderr, "%s:%d: invalid observers %s\n", FileName, LineNo, Option + 10);
+		    exit(Error);
+		}
+	    }
+	    else if (!strncmp(Option, "replay=", 7)) {
+		if (!ParseReplay(Option + 7, &S->Replay)) {
+		    fprintf(stderr, "%s:%d: invalid replay %s\n", FileName, LineNo, Option + 7);
+		    exit(Error);
+		}
+	    }
+	    else if (!ParsePortSettings(Option, &S->Defaults)) {
+		fprintf(stderr, "%s:%d: invalid port option %s\n", FileName, LineNo, Option);
+		exit(Error);
+	    }
+	}
+    }
+
+    fclose(f);
+
+    if (SessionCount == 0) {
+	fprintf(stderr, "%s: no ports defined\n", FileName);
+	exit(Error);
+    }
+}
+
+/* Create a non-blocking TCP listening socket on Port. Exits on
+   failure. */
+static SERCD_SOCKET
+OpenTcpListener(struct in_addr BindAddr, unsigned int Port)
+{
+    struct sockaddr_in sin;
+    SERCD_SOCKET lsocket;
+
+    lsocket = socket(PF_INET, SOCK_STREAM, 0);
+    if (lsocket < 0) {
+	perror("socket");
+	exit(Error);
+    }
+#ifndef WIN32
+    int SockParmEnable = 1;
+    /* Windows is totally broken wrt SO_REUSEADDR - it uses
+       non-standard and mostly useless semantics. This is
+       confirmed by Microsoft: From
+       http://msdn.microsoft.com/en-us/library/ms740621(VS.85).aspx:
+       "the behavior for all sockets bound to that port is
+       indeterminate". "The exception to this non-deterministic
+       behavior is multicast sockets. " Instead, they
+       are recommending SO_EXCLUSIVEADDRUSE, but it typically only
+       works if you have administrator privs. Bah. */
+    setsockopt(lsocket, SOL_SOCKET, SO_REUSEADDR, (char *) &SockParmEnable,
+	       sizeof(SockParmEnable));
 #endif
 
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(opt_port);
-	sin.sin_addr.s_addr = opt_bind_addr.s_addr;
-	if (bind(lsocket, (struct sockaddr *) &sin, sizeof(struct sockaddr))) {
-	    perror("bind");
-	    fprintf(stderr, "Couldn't bind to tcp port %d\n", opt_port);
-	    exit(Error);
-	}
-	if (listen(lsocket, 1) < 0) {
-	    perror("listen");
-	    exit(Error);
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(Port);
+    sin.sin_addr.s_addr = BindAddr.s_addr;
+    if (bind(lsocket, (struct sockaddr *) &sin, sizeof(struct sockaddr))) {
+	perror("bind");
+	fprintf(stderr, "Couldn't bind to tcp port %d\n", Port);
+	exit(Error);
+    }
+    if (listen(lsocket, 1) < 0) {
+	perror("listen");
+	exit(Error);
+    }
+#ifndef WIN32
+    /* Several listeners share one loop; a client that goes away
+       between select and accept must not block the others */
+    ioctl(lsocket, FIONBIO, &SockParmEnable);
+#endif
+    return lsocket;
+}
+
+/* Create the listening socket of a session in standalone mode */
+static void
+OpenListener(SessionType * S, struct in_addr BindAddr)
+{
+    S->lsocket = OpenTcpListener(BindAddr, S->ListenPort);
+    S->LSocketFd = &S->lsocket;
+    NewListener(*S->LSocketFd);
+}
+
+/* Reset the protocol state and send the initial negotiation to a newly
+   connected client */
+static void
+StartSession(SessionType * S)
+{
+    SetSocketOptions(*S->InSocketFd, *S->OutSocketFd);
+    InitBuffer(&S->ToNetBuf);
+    S->PortControlEnable = True;
+    S->IACEscape = IACNormal;
+    S->IACPos = 0;
+    S->ModemStateMask = ((unsigned char) 255);
+    S->LineStateMask = ((unsigned char) 0);
+    S->LineState = ((unsigned char) 0);
+    S->LineCounted = False;
+    S->ModemState = ((unsigned char) 0);
+    S->BreakSignaled = False;
+    SetInputFlow(S, True);
+    S->Stats.Connections++;
+    S->ToNetMarks.Count = S->ToDevMarks.Count = 0;
+    S->EscWriteLast = S->EscRedirectLast = 0;
+    S->CPCStaged = False;
+    S->CPCReplyCount = S->CPCReplyBytes = 0;
+    timerclear(&S->NetQueued);
+    timerclear(&S->LastDevRead);
+    S->DevReadGap = 1000000L;
+    S->NetMore = False;
+    S->FrameBytes = S->FramePending = 0;
+    S->ReplayPos = S->ReplayEnd = 0;
+
+    if (S->Raw) {
+	/* Plain data only; the settings come from the port table. Device
+	   output kept in a history or sent to observers must pass through
+	   user space. */
+	S->PortControlEnable = False;
+	if (!OpenRawPipe(&S->ToDevPipe, S->ToDevBuf.Mask + 1) ||
+	    (!S->History.Header && !S->MaxObservers &&
+	     !OpenRawPipe(&S->ToNetPipe, S->ToNetBuf.Mask + 1))) {
+	    CloseRawPipe(&S->ToDevPipe);
+	    LogMsg(LOG_INFO, "Zero-copy forwarding not available, copying instead.");
+	}
+	return;
+    }
+
+    InitTelnetStateMachine(S);
+    SendTelnetInitialOptions(S);
+}
+
+/* Apply the configured default settings to a newly opened device */
+static void
+ApplyPortDefaults(SessionType * S)
+{
+    PORTHANDLE PortFd = *S->DeviceFd;
+
+    StagePortSettings(PortFd);
+    if (S->Defaults.Speed)
+	SetPortSpeed(PortFd, S->Defaults.Speed);
+    if (S->Defaults.DataSize)
+	SetPortDataSize(PortFd, S->Defaults.DataSize);
+    if (S->Defaults.Parity)
+	SetPortParity(PortFd, S->Defaults.Parity);
+    if (S->Defaults.StopSize)
+	SetPortStopSize(PortFd, S->Defaults.StopSize);
+    if (S->Defaults.FlowControl)
+	SetPortFlowControl(PortFd, S->Defaults.FlowControl);
+    CommitPortSettings(PortFd);
+}
+
+/* Take a segment for device output to observers, reusing a free one */
+static FanOutSegmentType *
+NewSegment(SessionType * S)
+{
+    FanOutSegmentType *Seg = S->FanOutFree;
+
+    if (Seg)
+	S->FanOutFree = Seg->Next;
+    else if (!(Seg = malloc(sizeof(*Seg)))) {
+	fprintf(stderr, "Out of memory\n");
+	exit(Error);
+    }
+    Seg->Next = NULL;
+    Seg->Refs = 0;
+    Seg->Len = 0;
+    S->FanOutSegments++;
+    return Seg;
+}
+
+/* Free the segments at the head that no observer needs any more */
+static void
+ReleaseSegments(SessionType * S)
+{
+    FanOutSegmentType *Seg;
+
+    while (S->FanOutHead != S->FanOutTail && S->FanOutHead->Refs == 0) {
+	Seg = S->FanOutHead;
+	S->FanOutHead = Seg->Next;
+	Seg->Next = S->FanOutFree;
+	S->FanOutFree = Seg;
+	S->FanOutSegments--;
+    }
+}
+
+/* Drop an observer connection */
+static void
+CloseObserver(SessionType * S, ObserverType * O)
+{
+    DropConnection(NULL, O->SocketFd, NULL, NULL);
+    O->SocketFd = NULL;
+    O->Seg->Refs--;
+    O->Watch = -1;
+    S->ObserverCount--;
+    ReleaseSegments(S);
+}
+
+/* Drop all observers of a session */
+static void
+CloseObservers(SessionType * S)
+{
+    unsigned int i;
+
+    for (i = 0; i < S->MaxObservers; i++) {
+	if (S->Observers[i].SocketFd)
+	    CloseObserver(S, &S->Observers[i]);
+    }
+}
+
+/* Attach a new connection as an observer of a session. Returns False
+   if all observer slots are taken. */
+static Boolean
+AddObserver(SessionType * S, SERCD_SOCKET csock)
+{
+    ObserverType *O;
+    unsigned int i;
+
+    for (i = 0; i < S->MaxObservers && S->Observers[i].SocketFd; i++);
+    if (i == S->MaxObservers)
+	return False;
+
+    if (!S->FanOutTail)
+	S->FanOutHead = S->FanOutTail = NewSegment(S);
+    O = &S->Observers[i];
+    O->socket = csock;
+    O->SocketFd = &O->socket;
+    SetSocketOptions(csock, csock);
+    O->Seg = S->FanOutTail;
+    O->Pos = O->Seg->Len;
+    O->Seg->Refs++;
+    O->Watch = -1;
+    S->ObserverCount++;
+    S->Stats.Observers++;
+    return True;
+}
+
+/* Make room for another segment when a session holds the most it may,
+   by moving the observers off the oldest one: they are skipped ahead
+   to the next, or dropped */
+static void
+ReclaimSegment(SessionType * S)
+{
+    FanOutSegmentType *Head = S->FanOutHead;
+    ObserverType *O;
+    unsigned int i;
+
+    for (i = 0; i < S->MaxObservers; i++) {
+	O = &S->Observers[i];
+	if (!O->SocketFd || O->Seg != Head)
+	    continue;
+	if (S->SkipObservers) {
+	    S->Stats.ObserverSkipped += Head->Len - O->Pos;
+	    Head->Refs--;
+	    O->Seg = Head->Next;
+	    O->Pos = 0;
+	    O->Seg->Refs++;
+	}
+	else {
+	    LogMsg(LOG_NOTICE, "Dropping observer of port %u, too far behind.", S->ListenPort);
+	    S->Stats.ObserversDropped++;
+	    CloseObserver(S, O);
+	}
+    }
+    ReleaseSegments(S);
+}
+
+/* Add output for the observers of a session, as it is to be sent */
+static void
+AddFanOut(SessionType * S, const unsigned char *Data, unsigned int Len)
+{
+    FanOutSegmentType *Tail;
+    unsigned int Chunk;
+
+    while (S->ObserverCount > 0 && Len > 0) {
+	Tail = S->FanOutTail;
+	if (Tail->Len == FanOutSegmentSize) {
+	    if (S->FanOutSegments == FanOutMaxSegments)
+		ReclaimSegment(S);
+	    Tail = Tail->Next = S->FanOutTail = NewSegment(S);
+	    continue;
+	}
+	Chunk = MIN(Len, FanOutSegmentSize - Tail->Len);
+	memcpy(Tail->Data + Tail->Len, Data, Chunk);
+	Tail->Len += Chunk;
+	Data += Chunk;
+	Len -= Chunk;
+    }
+}
+
+/* Add the last Len bytes of device output queued for the client, as
+   escaped for it, to the output of the observers */
+static void
+FanOutQueued(SessionType * S, unsigned int Len)
+{
+    BufferType *B = &S->ToNetBuf;
+    unsigned int Pos = (B->WrPos - Len) & B->Mask;
+    unsigned int First = B->Mirrored ? Len : MIN(Len, B->Mask + 1 - Pos);
+
+    AddFanOut(S, &B->Buffer[Pos], First);
+    AddFanOut(S, B->Buffer, Len - First);
+}
+
+/* Fill in the descriptors an observer is waiting for */
+static void
+SetupObserverWatch(SessionType * S, ObserverType * O, SercdWatch * W)
+{
+    memset(W, 0, sizeof(*W));
+    W->SocketIn = O->SocketFd;
+    if (O->Pos < O->Seg->Len || O->Seg != S->FanOutTail)
+	W->SocketOut = O->SocketFd;
+}
+
+/* Send an observer what it has not got yet. Anything it sends is
+   ignored. */
+static void
+HandleObserverEvents(SessionType * S, ObserverType * O, int Events)
+{
+    unsigned char readbuf[512];
+    struct iovec iov[8];
+    FanOutSegmentType *Seg;
+    unsigned int Pos;
+    ssize_t iobytes;
+    int iovcnt = 0;
+
+    S->Unpublished = True;
+    if (Events & SERCD_EV_SOCKETIN) {
+	iobytes = ReadFromNet(*O->SocketFd, readbuf, sizeof(readbuf));
+	if (iobytes == 0 || (iobytes < 0 && errno != EWOULDBLOCK)) {
+	    CloseObserver(S, O);
+	    return;
+	}
+    }
+
+    if (Events & SERCD_EV_SOCKETOUT) {
+	for (Seg = O->Seg, Pos = O->Pos; Seg && iovcnt < 8; Seg = Seg->Next, Pos = 0) {
+	    if (Pos < Seg->Len) {
+		iov[iovcnt].iov_base = Seg->Data + Pos;
+		iov[iovcnt++].iov_len = Seg->Len - Pos;
+	    }
+	}
+	iobytes = WriteToNetV(*O->SocketFd, iov, iovcnt, False);
+	if (iobytes < 0 && errno != EWOULDBLOCK) {
+	    CloseObserver(S, O);
+	    return;
+	}
+
+	/* Move the cursor past what was sent */
+	while (iobytes > 0 || (O->Pos == O->Seg->Len && O->Seg != S->FanOutTail)) {
+	    if (O->Pos == O->Seg->Len) {
+		O->Seg->Refs--;
+		O->Seg = O->Seg->Next;
+		O->Seg->Refs++;
+		O->Pos = 0;
+		continue;
+	    }
+	    Pos = MIN((size_t) iobytes, O->Seg->Len - O->Pos);
+	    O->Pos += Pos;
+	    iobytes -= Pos;
+	}
+	ReleaseSegments(S);
+    }
+}
+
+/* Fill in the watches of the observers of all sessions, from
+   Watches[Count] on. Returns the new number of watches. */
+static int
+SetupObserverWatches(ReactorType * R, int Count)
+{
+    ObserverType *O;
+    int i;
+    unsigned int j;
+
+    for (i = R->First; i < SessionCount; i += R->Step) {
+	for (j = 0; j < Sessions[i].MaxObservers; j++) {
+	    O = &Sessions[i].Observers[j];
+	    if (O->SocketFd) {
+		O->Watch = Count;
+		SetupObserverWatch(&Sessions[i], O, &R->Watches[Count++]);
+	    }
+	}
+    }
+    return Count;
+}
+
+/* Handle the events of the observers watched. Those dropped or added
+   since the watches were set up have no watch. */
+static void
+HandleObserverWatches(ReactorType * R)
+{
+    ObserverType *O;
+    int i, Events;
+    unsigned int j;
+
+    for (i = R->First; i < SessionCount; i += R->Step) {
+	for (j = 0; j < Sessions[i].MaxObservers; j++) {
+	    O = &Sessions[i].Observers[j];
+	    if (O->SocketFd && O->Watch >= 0) {
+		Events = R->Watches[O->Watch].Events;
+		O->Watch = -1;
+		if (Events)
+		    HandleObserverEvents(&Sessions[i], O, Events);
+	    }
+	}
+    }
+}
+
+/* Decode network input into the device buffer. Once the CPC reply
+   queue is full, the rest waits in NetHeld for the port changes to
+   finish; the room it needs in both buffers was set aside when it was
+   read. */
+static void
+DecodeNetInput(SessionType * S, const unsigned char *Data, unsigned int Len)
+{
+    unsigned int Done;
+
+    while (Len > 0) {
+	Done = EscRedirectBuffer(S, Data, Len);
+	CommitCPCCommands(S);
+	Data += Done;
+	Len -= Done;
+	if (Len == 0 || S->CPCReplyCount < MaxCPCReplies)
+	    continue;
+
+	S->NetHeld = malloc(Len);
+	if (S->NetHeld) {
+	    memcpy(S->NetHeld, Data, Len);
+	    S->NetHeldLen = Len;
+	    S->NetHeldBytes = Len * S->ReplyRatio;
+	    return;
+	}
+	/* Out of memory: wait for the port changes instead */
+	FinishPortJobs();
+	CommitCPCCommands(S);
+    }
+}
+
+/* Go on decoding the network input held, if the replies queued allow */
+static void
+ResumeNetInput(SessionType * S)
+{
+    unsigned char *Held = S->NetHeld;
+
+    if (!Held || S->CPCReplyCount == MaxCPCReplies)
+	return;
+    S->NetHeld = NULL;
+    S->NetHeldBytes = 0;
+    DecodeNetInput(S, Held, S->NetHeldLen);
+    free(Held);
+}
+
+/* Drop the network input held, with the client */
+static void
+DropNetInput(SessionType * S)
+{
+    free(S->NetHeld);
+    S->NetHeld = NULL;
+    S->NetHeldLen = S->NetHeldBytes = 0;
+}
+
+/* Drop the client connection, the observers and close the serial port
+   of a session */
+static void
+CloseSession(SessionType * S)
+{
+    DropConnection(S->DeviceFd, S->InSocketFd, S->OutSocketFd, S->LockFileName);
+    S->InSocketFd = S->OutSocketFd = NULL;
+    S->DeviceFd = NULL;
+    DropNetInput(S);
+    CloseObservers(S);
+    SetInputFlow(S, True);
+    CloseRawPipe(&S->ToDevPipe);
+    CloseRawPipe(&S->ToNetPipe);
+}
+
+/* Bytes queued in one direction of a raw mode session */
+static unsigned int
+RawQueued(RawPipeType * P, BufferType * B)
+{
+    return P->Open ? P->Len : BufferLength(B);
+}
+
+/* Room left in the network buffer, less what the replies held back
+   and those of the network input held will need */
+static unsigned int
+NetRoomLeft(SessionType * S)
+{
+    unsigned int Room = BufferRoomLeft(&S->ToNetBuf);
+
+    return Room - MIN(Room, S->CPCReplyBytes + S->NetHeldBytes);
+}
+
+/* Room left in one direction of a raw mode session */
+static unsigned int
+RawRoomLeft(RawPipeType * P, BufferType * B)
+{
+    return P->Open ? P->Size - P->Len : BufferRoomLeft(B);
+}
+
+/* Splicing is not supported by one of the descriptors: move the data
+   held by the pipe into the buffer, which is used from now on. The
+   pipe never holds more than the buffer size. */
+static void
+RawPipeFallback(RawPipeType * P, BufferType * B)
+{
+    unsigned char *p;
+    unsigned int len;
+    ssize_t iobytes;
+
+    LogMsg(LOG_INFO, "Zero-copy forwarding not supported, copying instead.");
+    while (P->Len > 0) {
+	p = GetBufferSpace(B, &len);
+	iobytes = ReadFromRawPipe(P, p, MIN(len, P->Len));
+	if (iobytes <= 0)
+	    break;
+	BufferCommitBytes(B, iobytes);
+    }
+    CloseRawPipe(P);
+}
+
+/* Add Us microseconds to a time */
+static void
+TimevalAddUs(struct timeval *T, long Us)
+{
+    T->tv_sec += Us / 1000000L;
+    T->tv_usec += Us % 1000000L;
+    if (T->tv_usec >= 1000000L) {
+	T->tv_sec++;
+	T->tv_usec -= 1000000L;
+    }
+}
+
+/* Move a watch deadline up to T if that is earlier */
+static void
+EarlierDeadline(struct timeval *Deadline, const struct timeval *T)
+{
+    if (!timerisset(Deadline) || timercmp(T, Deadline, <))
+	*Deadline = *T;
+}
+
+/* Bytes of network output held back as part of an unfinished frame */
+static unsigned int
+FrameHeld(SessionType * S)
+{
+    if (S->FrameBytes == 0)
+	return 0;
+    if (S->Raw && S->ToNetPipe.Open)
+	return S->FramePending;
+    return S->ToNetBuf.WrPos - S->FrameStart;
+}
+
+/* Device bytes that still fit in the frame being received */
+static unsigned int
+FrameRoom(SessionType * S)
+{
+    if (S->Framing.Gap == 0)
+	return S->ToNetBuf.Mask + 1;
+    return S->Framing.MaxLen - MIN(S->FrameBytes, S->Framing.MaxLen);
+}
+
+/* Release the frame being received for sending */
+static void
+EndFrame(SessionType * S)
+{
+    S->FrameBytes = S->FramePending = 0;
+}
+
+/* Note Bytes read from the device, before they are added to the
+   network buffer. Tracks the frame being received, and the gaps
+   between reads for auto coalescing. */
+static void
+NoteDeviceInput(SessionType * S, unsigned int Bytes)
+{
+    struct timeval now;
+    long gap;
+
+    if (S->Framing.Gap) {
+	if (S->FrameBytes == 0)
+	    S->FrameStart = S->ToNetBuf.WrPos;
+	S->FrameBytes += Bytes;
+	S->FramePending += Bytes;
+    }
+    else if (S->Coalesce.Mode != CoalesceAuto)
+	return;
+
+    gettimeofday(&now, NULL);
+    if (S->Coalesce.Mode == CoalesceAuto && timerisset(&S->LastDevRead)) {
+	gap = (now.tv_sec - S->LastDevRead.tv_sec) * 1000000L +
+	    (now.tv_usec - S->LastDevRead.tv_usec);
+	gap = MIN(MAX(gap, 0), 1000000L);
+	/* Exponential average over about four reads */
+	S->DevReadGap = (3 * S->DevReadGap + gap) / 4;
+    }
+    S->LastDevRead = now;
+}
+
+/* Time the line must be idle to end a frame, in microseconds */
+static long
+FrameGapUs(SessionType * S)
+{
+    unsigned long Speed = GetPortSpeed(*S->DeviceFd);
+    unsigned long Bits;
+
+    /* Start bit, data bits, parity bit and stop bits, where 1.5 stop
+       bits count as 2 */
+    Bits = 1 + GetPortDataSize(*S->DeviceFd);
+    if (GetPortParity(*S->DeviceFd) != TNCOM_NOPARITY)
+	Bits++;
+    Bits += GetPortStopSize(*S->DeviceFd) == TNCOM_ONESTOPBIT ? 1 : 2;
+
+    if (Speed == 0)
+	Speed = 9600;
+    return (long) (Bits * S->Framing.Gap * 100000UL / Speed);
+}
+
+/* End the frame being received if the line has been idle long enough,
+   it has reached its maximum length or no more input fits. Otherwise
+   Deadline is moved up to when the frame will end. */
+static void
+CheckFrameEnd(SessionType * S, struct timeval *Deadline)
+{
+    struct timeval now, End;
+    unsigned int Room;
+
+    if (S->FrameBytes == 0)
+	return;
+
+    Room = S->Raw ? RawRoomLeft(&S->ToNetPipe, &S->ToNetBuf) :
+	NetRoomLeft(S) / EscWriteChar_bytes;
+    if (!S->DeviceFd || S->FrameBytes >= S->Framing.MaxLen || Room == 0) {
+	EndFrame(S);
+	return;
+    }
+
+    gettimeofday(&now, NULL);
+    End = S->LastDevRead;
+    TimevalAddUs(&End, FrameGapUs(S));
+    if (!timercmp(&now, &End, <))
+	EndFrame(S);
+    else
+	EarlierDeadline(Deadline, &End);
+}
+
+/* Start following the line error counters of a newly opened device */
+static void
+StartLineState(SessionType * S)
+{
+    S->LineCounted = GetLineCounts(*S->DeviceFd, &S->LineCounts);
+    timerclear(&S->LineCheckDue);
+    S->LineState = 0;
+}
+
+/* Add the errors counted since Last to Total. Returns Bit if there
+   were any. */
+static unsigned char
+CountLineErrors(unsigned long *Total, unsigned long *Last, unsigned long Now, unsigned char Bit)
+{
+    unsigned long New = Now - *Last;
+
+    *Last = Now;
+    *Total += New;
+    return New ? Bit : 0;
+}
+
+/* Read the line error counters, at most every LineCheckInterval. New
+   errors are added to the totals, and notified as far as the client
+   asked for them. While it does, Deadline is moved up to the next
+   check, since breaks and errors need not come with any data. */
+static void
+CheckLineState(SessionType * S, struct timeval *Deadline)
+{
+    LineCountType Counts;
+    struct timeval now;
+    unsigned char State = 0;
+
+    if (!S->DeviceFd || !S->LineCounted)
+	return;
+
+    gettimeofday(&now, NULL);
+    if (!timercmp(&now, &S->LineCheckDue, <)) {
+	S->LineCheckDue = now;
+	TimevalAddUs(&S->LineCheckDue, LineCheckInterval * 1000L);
+	if (!GetLineCounts(*S->DeviceFd, &Counts)) {
+	    S->LineCounted = False;
+	    return;
+	}
+	State |= CountLineErrors(&S->LineErrors.Overrun, &S->LineCounts.Overrun,
+				 Counts.Overrun, TNCOM_LINEMASK_OVERRUN_ERR);
+	State |= CountLineErrors(&S->LineErrors.BufOverrun, &S->LineCounts.BufOverrun,
+				 Counts.BufOverrun, TNCOM_LINEMASK_OVERRUN_ERR);
+	State |= CountLineErrors(&S->LineErrors.Parity, &S->LineCounts.Parity,
+				 Counts.Parity, TNCOM_LINEMASK_PARITY_ERR);
+	State |= CountLineErrors(&S->LineErrors.Frame, &S->LineCounts.Frame,
+				 Counts.Frame, TNCOM_LINEMASK_FRAME_ERR);
+	State |= CountLineErrors(&S->LineErrors.Break, &S->LineCounts.Break,
+				 Counts.Break, TNCOM_LINEMASK_BREAK_ERR);
+	if (State) {
+	    LogMsg(LOG_INFO,
+		   "Line errors: overrun %lu, buffer overrun %lu, parity %lu, framing %lu, break %lu",
+		   S->LineErrors.Overrun, S->LineErrors.BufOverrun, S->LineErrors.Parity,
+		   S->LineErrors.Frame, S->LineErrors.Break);
+	}
+	S->LineState |= State & S->LineStateMask;
+    }
+
+    if (S->LineState && !S->Raw && NetRoomLeft(S) >= SendCPCByteCommand_bytes) {
+	SendCPCByteCommand(S, TNASC_NOTIFY_LINESTATE, S->LineState);
+	LogMsg(LOG_DEBUG, "Sent line state: %u", (unsigned int) S->LineState);
+	S->LineState = 0;
+    }
+    if (S->LineStateMask)
+	EarlierDeadline(Deadline, &S->LineCheckDue);
+}
+
+/* Decide whether Queued bytes of network output should be sent now.
+   If not, Deadline is moved up to when they must be. */
+static Boolean
+NetOutputDue(SessionType * S, unsigned int Queued, struct timeval *Deadline)
+{
+    CoalesceType *C = &S->Coalesce;
+    unsigned int Threshold = MIN(C->Threshold, (S->ToNetBuf.Mask + 1) / 2);
+    struct timeval now, Due;
+
+    S->NetMore = False;
+    if (Queued == 0) {
+	timerclear(&S->NetQueued);
+	return False;
+    }
+    if (C->Mode == CoalesceOff || C->Delay == 0 || !S->DeviceFd)
+	return True;
+
+    gettimeofday(&now, NULL);
+    if (!timerisset(&S->NetQueued))
+	S->NetQueued = now;
+
+    /* Auto mode holds output only while the device streams data */
+    if (C->Mode == CoalesceAuto && S->DevReadGap >= C->Delay * 1000L)
+	return True;
+
+    if (Queued >= Threshold) {
+	/* In the middle of a stream: let the kernel fill the segments */
+	S->NetMore = True;
+	return True;
+    }
+
+    Due = S->NetQueued;
+    TimevalAddUs(&Due, C->Delay * 1000L);
+    if (!timercmp(&now, &Due, <))
+	return True;
+    EarlierDeadline(Deadline, &Due);
+    return False;
+}
+
+/* Network bytes that can be read while leaving room for the replies
+   they may cause. A command completed by the first byte may need
+   HandleIACCommand_bytes, later ones at most ReplyRatio per byte. */
+static unsigned int
+NetReadLimit(SessionType * S)
+{
+    unsigned int Room = NetRoomLeft(S);
+
+    if (Room < HandleIACCommand_bytes + S->ReplyRatio)
+	return 0;
+    return (Room - HandleIACCommand_bytes) / S->ReplyRatio;
+}
+
+/* Drop the client connection of a session. A device kept open between
+   clients stays open as the client left it, except for a break, and
+   its data goes to the backlog until the next client connects. */
+static void
+CloseClient(SessionType * S)
+{
+    if (!S->KeepOpen || !S->DeviceFd) {
+	CloseSession(S);
+	return;
+    }
+    DropConnection(NULL, S->InSocketFd, S->OutSocketFd, NULL);
+    S->InSocketFd = S->OutSocketFd = NULL;
+    SetInputFlow(S, True);
+    CloseRawPipe(&S->ToDevPipe);
+    CloseRawPipe(&S->ToNetPipe);
+
+    /* Output of the client not yet written is dropped with it */
+    InitBuffer(&S->ToDevBuf);
+    S->ModemLinesKnown = False;
+    DropNetInput(S);
+    S->LineStateMask = S->LineState = 0;
+    S->FrameBytes = S->FramePending = 0;
+    if (S->BreakSignaled) {
+	SetBreak(*S->DeviceFd, False);
+	S->BreakSignaled = False;
+    }
+    LogMsg(LOG_INFO, "Keeping device %s open.", S->DeviceName);
+}
+
+/* Open, lock and set up the device of a session. Returns False if it
+   could not be opened. */
+static Boolean
+OpenDevice(SessionType * S)
+{
+    int OpenResult;
+
+    S->DeviceFd = &S->devicefd;
+    OpenResult = OpenPort(S->DeviceName, S->LockFileName, S->DeviceFd);
+    if (OpenResult != NoError) {
+	if (OpenResult == LockError)
+	    S->Stats.LockFailures++;
+	S->DeviceFd = NULL;
+	return False;
+    }
+    InitBuffer(&S->ToDevBuf);
+    S->ModemLinesKnown = False;
+    ApplyPortDefaults(S);
+    StartLineState(S);
+    return True;
+}
+
+/* Set up the history of a session, continuing the one in its file if
+   that was kept with the same size */
+static void
+OpenHistory(SessionType * S)
+{
+    HistoryType *H = &S->History;
+    size_t Len = sizeof(HistoryHeaderType) + S->HistorySize;
+
+    if (S->HistoryFile)
+	H->Header = MapHistoryFile(S->HistoryFile, Len);
+    else
+	H->Header = calloc(1, Len);
+    H->Marks = calloc(HistoryMarks, sizeof(HistoryMarkType));
+    if (!H->Header || !H->Marks) {
+	LogMsg(LOG_ERR, "Unable to set up the history of port %u: %s", S->ListenPort,
+	       strerror(errno));
+	exit(Error);
+    }
+    H->Data = (unsigned char *) (H->Header + 1);
+    H->Size = S->HistorySize;
+    H->FirstMark = H->MarkCount = 0;
+
+    if (memcmp(H->Header->Magic, HistoryMagic, sizeof(H->Header->Magic)) ||
+	H->Header->Size != H->Size) {
+	memcpy(H->Header->Magic, HistoryMagic, sizeof(H->Header->Magic));
+	H->Header->Size = H->Size;
+	H->Header->Total = 0;
+    }
+    else if (H->Header->Total) {
+	LogMsg(LOG_INFO, "Continuing the history of port %u from %s.", S->ListenPort,
+	       S->HistoryFile);
+    }
+}
+
+/* Add device output to the history of a session */
+static void
+AddHistory(SessionType * S, const unsigned char *Data, unsigned int Len)
+{
+    HistoryType *H = &S->History;
+    HistoryMarkType *M;
+    unsigned long long Second;
+    unsigned int Pos, First;
+
+    if (!H->Header)
+	return;
+
+    /* Note where each second of output starts */
+    Second = MonotonicUs() / 1000000;
+    M = &H->Marks[(H->FirstMark + H->MarkCount + HistoryMarks - 1) % HistoryMarks];
+    if (H->MarkCount == 0 || M->Second != Second) {
+	if (H->MarkCount == HistoryMarks) {
+	    H->FirstMark = (H->FirstMark + 1) % HistoryMarks;
+	    H->MarkCount--;
+	}
+	M = &H->Marks[(H->FirstMark + H->MarkCount++) % HistoryMarks];
+	M->Second = Second;
+	M->Pos = H->Header->Total;
+    }
+
+    if (Len > H->Size) {
+	H->Header->Total += Len - H->Size;
+	Data += Len - H->Size;
+	Len = H->Size;
+    }
+    Pos = H->Header->Total % H->Size;
+    First = MIN(Len, H->Size - Pos);
+    memcpy(H->Data + Pos, Data, First);
+    memcpy(H->Data, Data + First, Len - First);
+    H->Header->Total += Len;
+}
+
+/* Select the part of the history a new client is sent first: the
+   last Replay.Limit bytes, or what arrived in the last Replay.Limit
+   seconds, as far as it is still kept */
+static void
+StartReplay(SessionType * S)
+{
+    HistoryType *H = &S->History;
+    HistoryMarkType *M;
+    unsigned long long Total, Start, Now;
+    unsigned int i;
+
+    if (!H->Header)
+	return;
+
+    Total = H->Header->Total;
+    Start = Total - MIN(Total, H->Size);
+    if (!S->Replay.Seconds) {
+	if (Total - Start > S->Replay.Limit)
+	    Start = Total - S->Replay.Limit;
+    }
+    else {
+	/* Output from before the oldest mark is replayed only if the
+	   marks ran out within the time; output from before a restart
+	   has no marks and is not */
+	Now = MonotonicUs() / 1000000;
+	for (i = H->MarkCount; i > 0; i--) {
+	    M = &H->Marks[(H->FirstMark + i - 1) % HistoryMarks];
+	    if (M->Second + S->Replay.Limit <= Now)
+		break;
+	}
+	if (i == H->MarkCount)
+	    Start = Total;
+	else if (i > 0 || H->MarkCount < HistoryMarks)
+	    Start = MAX(Start, H->Marks[(H->FirstMark + i) % HistoryMarks].Pos);
+    }
+    S->ReplayPos = Start;
+    S->ReplayEnd = Total;
+    if (Start != Total)
+	LogMsg(LOG_INFO, "Replaying %llu bytes of history.", Total - Start);
+}
+
+/* Keep what an idle device kept open sends in the backlog, dropping
+   the oldest bytes beyond its size. Returns False if the device was
+   closed. */
+static Boolean
+ReadBacklog(SessionType * S, int Events)
+{
+    unsigned char readbuf[512], escbuf[sizeof(readbuf) * EscWriteChar_bytes];
+    unsigned int Len, Drop;
+    ssize_t iobytes;
+
+    if (!(Events & SERCD_EV_DEVICEIN))
+	return True;
+
+    iobytes = ReadFromDev(*S->DeviceFd, readbuf, sizeof(readbuf));
+    CountIO(S, &S->Stats.DevIn, iobytes, 0);
+    if (IOResultError(iobytes, "Error reading from device", "EOF from device")) {
+	DropConnection(S->DeviceFd, NULL, NULL, S->LockFileName);
+	S->DeviceFd = NULL;
+	return False;
+    }
+    if (iobytes <= 0)
+	return True;
+
+    /* Observers left by the client go on as it would have */
+    if (S->Raw)
+	AddFanOut(S, readbuf, iobytes);
+    else if (S->ObserverCount > 0)
+	AddFanOut(S, escbuf, EscWriteTo(S, readbuf, iobytes, escbuf));
+
+    /* With a history, new clients get a replay of it instead */
+    AddHistory(S, readbuf, iobytes);
+    if (S->History.Header)
+	return True;
+
+    Len = iobytes;
+    if (Len > S->BacklogSize) {
+	S->Stats.BacklogDropped += Len - S->BacklogSize;
+	memmove(readbuf, readbuf + Len - S->BacklogSize, S->BacklogSize);
+	Len = S->BacklogSize;
+    }
+    if (Len == 0)
+	return True;
+    Drop = BufferLength(&S->Backlog) + Len;
+    if (Drop > S->BacklogSize) {
+	Drop -= S->BacklogSize;
+	BufferPopBytes(&S->Backlog, Drop);
+	S->Stats.BacklogDropped += Drop;
+    }
+    AddBytesToBuffer(&S->Backlog, readbuf, Len);
+    return True;
+}
+
+/* Copy up to Len bytes of what is to be sent to a new client first:
+   the part of the history selected for replay, or else the backlog.
+   Returns the number of bytes copied. */
+static unsigned int
+PeekReplay(SessionType * S, unsigned char *Data, unsigned int Len)
+{
+    HistoryType *H = &S->History;
+    unsigned int Pos, First;
+
+    if (S->ReplayPos == S->ReplayEnd)
+	return BufferPeekBytes(&S->Backlog, Data, Len);
+
+    Len = MIN(Len, S->ReplayEnd - S->ReplayPos);
+    Pos = S->ReplayPos % H->Size;
+    First = MIN(Len, H->Size - Pos);
+    memcpy(Data, H->Data + Pos, First);
+    memcpy(Data + First, H->Data, Len - First);
+    return Len;
+}
+
+/* Check if there is history or backlog left to send to the client */
+static Boolean
+ReplayPending(SessionType * S)
+{
+    return S->ReplayPos != S->ReplayEnd || !IsBufferEmpty(&S->Backlog);
+}
+
+/* Pass the history replay or the backlog on to a newly connected
+   client, as far as there is room for it. The device is not read
+   until all of it has been queued, so it goes out before live data. */
+static void
+SendReplay(SessionType * S)
+{
+    unsigned char data[512];
+    unsigned int Len;
+    ssize_t iobytes;
+
+    while (ReplayPending(S)) {
+	if (S->Raw && S->ToNetPipe.Open) {
+	    Len = PeekReplay(S, data, sizeof(data));
+	    iobytes = WriteToRawPipe(&S->ToNetPipe, data, Len);
+	    Len = iobytes > 0 ? iobytes : 0;
+	}
+	else {
+	    Len = S->Raw ? BufferRoomLeft(&S->ToNetBuf) : NetRoomLeft(S) / EscWriteChar_bytes;
+	    Len = PeekReplay(S, data, MIN(Len, sizeof(data)));
+	    if (S->Raw)
+		AddBytesToBuffer(&S->ToNetBuf, data, Len);
+	    else
+		EscWriteBuffer(S, data, Len);
+	}
+	if (Len == 0)
+	    break;
+	if (S->ReplayPos != S->ReplayEnd)
+	    S->ReplayPos += Len;
+	else
+	    BufferPopBytes(&S->Backlog, Len);
+    }
+}
+
+/* Fill in the descriptors a session is waiting for. Returns False if
+   the session has nothing more to do. */
+static Boolean
+SetupWatch(SessionType * S, SercdWatch * W)
+{
+    W->DeviceIn = NULL;
+    W->DeviceOut = NULL;
+    W->Modemstate = NULL;
+    W->SocketOut = NULL;
+    W->SocketIn = NULL;
+    W->SocketConnect = S->LSocketFd;
+    W->PortJobs = NULL;
+    W->PortClose = NULL;
+    timerclear(&W->Deadline);
+    CheckFrameEnd(S, &W->Deadline);
+    CheckLineState(S, &W->Deadline);
+
+    /* While port changes are being done, device output and further
+       requests wait for them */
+    if (S->DeviceFd && PortJobsPending(*S->DeviceFd) > 0)
+	W->PortJobs = S->DeviceFd;
+
+    /* A new client waits for the previous one's close of the device */
+    if (S->InSocketFd && !S->DeviceFd && PortClosing(S->DeviceName))
+	W->PortClose = S->DeviceName;
+
+    /* A device kept open without a client only fills the backlog */
+    if (!S->InSocketFd) {
+	W->DeviceIn = S->DeviceFd;
+	return W->DeviceIn || W->SocketConnect || W->PortJobs;
+    }
+
+    /* The device is read again once the replay has been sent */
+    if (S->Raw) {
+	if (S->DeviceFd && !ReplayPending(S) && RawRoomLeft(&S->ToNetPipe, &S->ToNetBuf) > 0)
+	    W->DeviceIn = S->DeviceFd;
+	if (S->DeviceFd && !W->PortJobs && RawQueued(&S->ToDevPipe, &S->ToDevBuf) > 0)
+	    W->DeviceOut = S->DeviceFd;
+	if (S->OutSocketFd &&
+	    NetOutputDue(S, RawQueued(&S->ToNetPipe, &S->ToNetBuf) - FrameHeld(S), &W->Deadline))
+	    W->SocketOut = S->OutSocketFd;
+	if (S->DeviceFd && S->InSocketFd && RawRoomLeft(&S->ToDevPipe, &S->ToDevBuf) > 0)
+	    W->SocketIn = S->InSocketFd;
+	return W->DeviceIn || W->DeviceOut || W->SocketOut || W->SocketIn || W->SocketConnect ||
+	    W->PortJobs || W->PortClose || timerisset(&W->Deadline);
+    }
+
+    if (S->DeviceFd && !ReplayPending(S) && NetRoomLeft(S) >= EscWriteChar_bytes &&
+	S->InputFlow) {
+	W->DeviceIn = S->DeviceFd;
+    }
+    if (S->DeviceFd && !W->PortJobs && !IsBufferEmpty(&S->ToDevBuf)) {
+	W->DeviceOut = S->DeviceFd;
+    }
+    if (S->DeviceFd && S->PortControlEnable && S->InputFlow &&
+	NetRoomLeft(S) >= SendCPCByteCommand_bytes) {
+	W->Modemstate = S->DeviceFd;
+    }
+    if (S->OutSocketFd &&
+	NetOutputDue(S, BufferLength(&S->ToNetBuf) - FrameHeld(S), &W->Deadline)) {
+	W->SocketOut = S->OutSocketFd;
+    }
+    if (S->DeviceFd && !W->PortJobs && !S->NetHeld &&
+	BufferHasRoomFor(&S->ToDevBuf, EscRedirectChar_bytes_DevB) && S->InSocketFd &&
+	NetReadLimit(S) > 0) {
+	W->SocketIn = S->InSocketFd;
+    }
+
+    return W->DeviceIn || W->DeviceOut || W->SocketOut || W->SocketIn || W->SocketConnect ||
+	W->PortJobs || W->PortClose || timerisset(&W->Deadline);
+}
+
+/* Forward data of a Telnet session. Returns False if the session was
+   closed. */
+static Boolean
+HandleTelnetIO(SessionType * S, int Events)
+{
+    /* Chars read */
+    unsigned char readbuf[512];
+
+    /* Handle buffers in the following order:
+       Serial input
+       Serial output
+       Network output
+       Network input
+
+       Motivation: Needs to read away data from the serial
+       port to prevent buffer overruns. Needs to drain our
+       buffers as fast as possible, to reduce latency and make
+       room for more. This order should be used in function
+       signatures etc as well.
+     */
+    ssize_t iobytes;
+    unsigned int trybytes, limit, queued;
+    struct iovec iov[2];
+    int iovcnt;
+    unsigned char *p;
+    Boolean direct;
+
+    if ((Events & SERCD_EV_PORTDONE) && S->DeviceFd) {
+	/* Port changes done, send the replies held back and go on with
+	   the requests after them */
+	CommitCPCCommands(S);
+	ResumeNetInput(S);
+    }
+
+    if (Events & SERCD_EV_DEVICEIN) {
+	/* Read from serial port. Each serial port byte might
+	   produce EscWriteChar_bytes of network data. Read straight
+	   into the network buffer unless only a sliver of it is
+	   contiguous. */
+	p = GetBufferSpace(&S->ToNetBuf, &trybytes);
+	trybytes = MIN(trybytes, NetRoomLeft(S)) / EscWriteChar_bytes;
+	direct = trybytes >= MIN(sizeof(readbuf), NetRoomLeft(S) / EscWriteChar_bytes);
+	if (!direct) {
+	    p = readbuf;
+	    trybytes = MIN(sizeof(readbuf), NetRoomLeft(S) / EscWriteChar_bytes);
+	}
+	iobytes = ReadFromDev(*S->DeviceFd, p, MIN(trybytes, FrameRoom(S)));
+	CountIO(S, &S->Stats.DevIn, iobytes, 0);
+	if (IOResultError(iobytes, "Error reading from device", "EOF from device")) {
+	    CloseSession(S);
+	    return False;
+	}
+	else if (iobytes > 0) {
+	    NoteDeviceInput(S, iobytes);
+	    AddHistory(S, p, iobytes);
+	}
+	queued = BufferLength(&S->ToNetBuf);
+	if (iobytes > 0 && direct) {
+	    EscWriteInPlace(S, p, iobytes);
+	}
+	else if (iobytes > 0) {
+	    EscWriteBuffer(S, readbuf, iobytes);
+	}
+	if (iobytes > 0) {
+	    FanOutQueued(S, BufferLength(&S->ToNetBuf) - queued);
+	    MarkQueued(&S->ToNetMarks, S->Stats.NetOut, BufferLength(&S->ToNetBuf));
+	}
+	NoteHighWater(&S->Stats.NetBufHigh, BufferLength(&S->ToNetBuf));
+    }
+
+    if (Events & SERCD_EV_DEVICEOUT) {
+	/* Write to serial port, both buffer segments at once */
+	iovcnt = GetBufferIovec(&S->ToDevBuf, iov, BufferLength(&S->ToDevBuf));
+	iobytes = WriteToDevV(*S->DeviceFd, iov, iovcnt);
+	CountIO(S, &S->Stats.DevOut, iobytes, BufferLength(&S->ToDevBuf));
+	MarkWritten(&S->ToDevMarks, &S->Stats.ToDevLatency, S->Stats.DevOut);
+	if (IOResultError(iobytes, "Error writing to device.", "EOF to device")) {
+	    CloseSession(S);
+	    return False;
+	}
+	else if (iobytes > 0) {
+	    BufferPopBytes(&S->ToDevBuf, iobytes);
+	}
+    }
+
+    if (Events & SERCD_EV_SOCKETOUT) {
+	/* Write to network, both buffer segments at once */
+	iovcnt = GetBufferIovec(&S->ToNetBuf, iov,
+				    BufferLength(&S->ToNetBuf) - FrameHeld(S));
+	iobytes = WriteToNetV(*S->OutSocketFd, iov, iovcnt, S->NetMore);
+	CountIO(S, &S->Stats.NetOut, iobytes, BufferLength(&S->ToNetBuf) - FrameHeld(S));
+	MarkWritten(&S->ToNetMarks, &S->Stats.ToNetLatency, S->Stats.NetOut);
+	if (IOResultError(iobytes, "Error writing to network", "EOF to network")) {
+	    CloseClient(S);
+	    return False;
+	}
+	else if (iobytes > 0) {
+	    BufferPopBytes(&S->ToNetBuf, iobytes);
+	}
+    }
+
+    /* Read from network. Each network byte might produce
+       EscRedirectChar_bytes_DevB of device data, and replies as
+       bounded by NetReadLimit. Serial input above may have used up the
+       room, in which case reading must wait. */
+    limit = NetReadLimit(S);
+    limit = MIN(limit, BufferRoomLeft(&S->ToDevBuf) / EscRedirectChar_bytes_DevB);
+    if ((Events & SERCD_EV_SOCKETIN) && limit > 0) {
+	/* Decoding only shrinks the data, so it can be read straight
+	   into the device buffer and decoded in place, unless only a
+	   sliver of it is contiguous. */
+	p = GetBufferSpace(&S->ToDevBuf, &trybytes);
+	trybytes = MIN(trybytes / EscRedirectChar_bytes_DevB, limit);
+	if (trybytes < MIN(sizeof(readbuf), limit)) {
+	    p = readbuf;
+	    trybytes = MIN(sizeof(readbuf), limit);
+	}
+	iobytes = ReadFromNet(*S->InSocketFd, p, trybytes);
+	CountIO(S, &S->Stats.NetIn, iobytes, 0);
+	if (IOResultError(iobytes, "Error readbuf from network.", "EOF from network")) {
+	    CloseClient(S);
+	    return False;
+	}
+	else if (iobytes > 0) {
+	    DecodeNetInput(S, p, iobytes);
+	    MarkQueued(&S->ToDevMarks, S->Stats.DevOut, BufferLength(&S->ToDevBuf));
+	    NoteHighWater(&S->Stats.DevBufHigh, BufferLength(&S->ToDevBuf));
+	}
+    }
+
+    return True;
+}
+
+/* Forward data of a raw mode session, without any Telnet processing.
+   Data moves through kernel pipes with splice while the descriptors
+   support it, and through the buffers otherwise. Returns False if the
+   session was closed. */
+static Boolean
+HandleRawIO(SessionType * S, int Events)
+{
+    ssize_t iobytes;
+    unsigned int trybytes;
+    struct iovec iov[2];
+    int iovcnt;
+    unsigned char *p = NULL;
+
+    if (Events & SERCD_EV_DEVICEIN) {
+	/* Read from serial port */
+	iobytes = -1;
+	if (S->ToNetPipe.Open) {
+	    trybytes = RawRoomLeft(&S->ToNetPipe, &S->ToNetBuf);
+	    iobytes = SpliceFromDev(*S->DeviceFd, &S->ToNetPipe, MIN(trybytes, FrameRoom(S)));
+	    if (iobytes < 0 && errno == EINVAL) {
+		RawPipeFallback(&S->ToNetPipe, &S->ToNetBuf);
+		EndFrame(S);
+	    }
+	}
+	if (!S->ToNetPipe.Open) {
+	    p = GetBufferSpace(&S->ToNetBuf, &trybytes);
+	    iobytes = ReadFromDev(*S->DeviceFd, p, MIN(trybytes, FrameRoom(S)));
+	}
+	CountIO(S, &S->Stats.DevIn, iobytes, 0);
+	if (IOResultError(iobytes, "Error reading from device", "EOF from device")) {
+	    CloseSession(S);
+	    return False;
+	}
+	else if (iobytes > 0) {
+	    NoteDeviceInput(S, iobytes);
+	}
+	if (iobytes > 0 && !S->ToNetPipe.Open) {
+	    AddHistory(S, p, iobytes);
+	    AddFanOut(S, p, iobytes);
+	    BufferCommitBytes(&S->ToNetBuf, iobytes);
+	}
+	if (iobytes > 0)
+	    MarkQueued(&S->ToNetMarks, S->Stats.NetOut,
+		       RawQueued(&S->ToNetPipe, &S->ToNetBuf));
+	NoteHighWater(&S->Stats.NetBufHigh, RawQueued(&S->ToNetPipe, &S->ToNetBuf));
+    }
+
+    if (Events & SERCD_EV_DEVICEOUT) {
+	/* Write to serial port */
+	iobytes = -1;
+	if (S->ToDevPipe.Open) {
+	    iobytes = SpliceToDev(*S->DeviceFd, &S->ToDevPipe, S->ToDevPipe.Len);
+	    if (iobytes < 0 && errno == EINVAL)
+		RawPipeFallback(&S->ToDevPipe, &S->ToDevBuf);
+	}
+	if (!S->ToDevPipe.Open) {
+	    iovcnt = GetBufferIovec(&S->ToDevBuf, iov, BufferLength(&S->ToDevBuf));
+	    iobytes = WriteToDevV(*S->DeviceFd, iov, iovcnt);
+	}
+	CountIO(S, &S->Stats.DevOut, iobytes, RawQueued(&S->ToDevPipe, &S->ToDevBuf));
+	MarkWritten(&S->ToDevMarks, &S->Stats.ToDevLatency, S->Stats.DevOut);
+	if (IOResultError(iobytes, "Error writing to device.", "EOF to device")) {
+	    CloseSession(S);
+	    return False;
+	}
+	else if (iobytes > 0 && !S->ToDevPipe.Open) {
+	    BufferPopBytes(&S->ToDevBuf, iobytes);
+	}
+    }
+
+    if (Events & SERCD_EV_SOCKETOUT) {
+	/* Write to network */
+	iobytes = -1;
+	if (S->ToNetPipe.Open) {
+	    iobytes = SpliceToNet(*S->OutSocketFd, &S->ToNetPipe,
+				  S->ToNetPipe.Len - FrameHeld(S), S->NetMore);
+	    if (iobytes < 0 && errno == EINVAL) {
+		RawPipeFallback(&S->ToNetPipe, &S->ToNetBuf);
+		EndFrame(S);
+	    }
+	}
+	if (!S->ToNetPipe.Open) {
+	    iovcnt = GetBufferIovec(&S->ToNetBuf, iov,
+				    BufferLength(&S->ToNetBuf) - FrameHeld(S));
+	    iobytes = WriteToNetV(*S->OutSocketFd, iov, iovcnt, S->NetMore);
+	}
+	CountIO(S, &S->Stats.NetOut, iobytes, RawQueued(&S->ToNetPipe, &S->ToNetBuf) - FrameHeld(S));
+	MarkWritten(&S->ToNetMarks, &S->Stats.ToNetLatency, S->Stats.NetOut);
+	if (IOResultError(iobytes, "Error writing to network", "EOF to network")) {
+	    CloseClient(S);
+	    return False;
+	}
+	else if (iobytes > 0 && !S->ToNetPipe.Open) {
+	    BufferPopBytes(&S->ToNetBuf, iobytes);
+	}
+    }
+
+    if (Events & SERCD_EV_SOCKETIN) {
+	/* Read from network */
+	iobytes = -1;
+	if (S->ToDevPipe.Open) {
+	    trybytes = RawRoomLeft(&S->ToDevPipe, &S->ToDevBuf);
+	    iobytes = SpliceFromNet(*S->InSocketFd, &S->ToDevPipe, trybytes);
+	    if (iobytes < 0 && errno == EINVAL)
+		RawPipeFallback(&S->ToDevPipe, &S->ToDevBuf);
+	}
+	if (!S->ToDevPipe.Open) {
+	    p = GetBufferSpace(&S->ToDevBuf, &trybytes);
+	    iobytes = ReadFromNet(*S->InSocketFd, p, trybytes);
+	}
+	CountIO(S, &S->Stats.NetIn, iobytes, 0);
+	if (IOResultError(iobytes, "Error reading from network.", "EOF from network")) {
+	    CloseClient(S);
+	    return False;
+	}
+	else if (iobytes > 0 && !S->ToDevPipe.Open) {
+	    BufferCommitBytes(&S->ToDevBuf, iobytes);
+	}
+	if (iobytes > 0)
+	    MarkQueued(&S->ToDevMarks, S->Stats.DevOut,
+		       RawQueued(&S->ToDevPipe, &S->ToDevBuf));
+	NoteHighWater(&S->Stats.DevBufHigh, RawQueued(&S->ToDevPipe, &S->ToDevBuf));
+    }
+
+    return True;
+}
+
+/* Handle the events reported for a session */
+static void
+HandleSessionEvents(SessionType * S, int Events)
+{
+    S->Unpublished = True;
+    S->Stats.Wakeups++;
+    if (!S->InSocketFd) {
+	if (S->DeviceFd && !ReadBacklog(S, Events))
+	    return;
+    }
+    else if (!(S->Raw ? HandleRawIO(S, Events) : HandleTelnetIO(S, Events)))
+	return;
+
+    /* accept new connections */
+    if (Events & SERCD_EV_SOCKETCONNECT) {
+	struct sockaddr addr;
+	socklen_t addrlen = sizeof(addr);
+	int csock;
+
+	/* FIXME: Might be a good idea to log the client addr */
+	LogMsg(LOG_NOTICE, "New connection on port %u (%s)", S->ListenPort, S->DeviceName);
+	csock = accept(*S->LSocketFd, &addr, &addrlen);
+	if (csock < 0) {
+	    /* FIXME: Log what kind of error. */
+	    LogMsg(LOG_ERR, "Error accepting socket");
+	}
+	else if (S->InSocketFd && S->OutSocketFd) {
+	    /* Further clients may only watch the device output */
+	    if (AddObserver(S, csock)) {
+		LogMsg(LOG_INFO, "Client is observing port %u read-only.", S->ListenPort);
+	    }
+	    else {
+		/* We can only handle one connection at a time. */
+		LogMsg(LOG_ERR, "Another client connected, dropping new connection");
+		closesocket(csock);
+	    }
+	}
+	else {
+	    /* Set up networking */
+#ifndef WIN32
+	    /* Some systems let the new socket inherit the non-blocking
+	       listener mode */
+	    int SockParmDisable = 0;
+	    ioctl(csock, FIONBIO, &SockParmDisable);
+#endif
+	    S->insocket = csock;
+	    S->OutSocketFd = S->InSocketFd = &S->insocket;
+	    StartSession(S);
+	    StartReplay(S);
+	    if (S->DeviceFd) {
+		/* Kept open; start the new client from the defaults */
+		ApplyPortDefaults(S);
+		StartLineState(S);
+	    }
+	}
+    }
+
+    /* Open serial port if not yet open, once the previous client's
+       close of it is done */
+    if (S->InSocketFd && S->OutSocketFd && !S->DeviceFd && !PortClosing(S->DeviceName) &&
+	!OpenDevice(S)) {
+	LogMsg(LOG_ERR, "Unable to open device %s. Exiting.", S->DeviceName);
+	/* Emulate the inetd behaviour: Close the connection. */
+	CloseSession(S);
+	return;
+    }
+
+    if (S->InSocketFd && ReplayPending(S))
+	SendReplay(S);
+
+    /* Check the port state and notify the client if it's changed */
+    if (Events & SERCD_EV_MODEMSTATE) {
+	unsigned char newstate;
+	ModemStateNotified();
+	newstate = GetModemState(*S->DeviceFd, S->ModemState);
+	S->ModemLines = newstate;
+	S->ModemLinesKnown = True;
+	/* Don't send update if only delta changes */
+	if ((newstate & S->ModemStateMask & TNCOM_MODMASK_NODELTA)
+	    != (S->ModemState & S->ModemStateMask & TNCOM_MODMASK_NODELTA)) {
+	    S->ModemState = newstate;
+	    SendCPCByteCommand(S, TNASC_NOTIFY_MODEMSTATE, (S->ModemState & S->ModemStateMask));
+	    LogMsg(LOG_DEBUG, "Sent modem state: %u",
+		   (unsigned int) (S->ModemState & S->ModemStateMask));
+	}
+    }
+}
+
+/* Names of the COM-PORT-OPTION commands in the statistics */
+static const char *CPCCommandNames[CPCCommandTypes] = {
+    "signature", "set_baudrate", "set_datasize", "set_parity", "set_stopsize",
+    "set_control", "notify_linestate", "notify_modemstate", "flowcontrol_suspend",
+    "flowcontrol_resume", "set_linestate_mask", "set_modemstate_mask", "purge_data"
+};
+
+/* Append to the report being prepared */
+static void
+ReportPrintf(ReportType * R, const char *Format, ...)
+{
+    va_list ap;
+    int n;
+    char *p;
+    size_t Size;
+
+    while (True) {
+	if (R->OutSize > R->OutLen) {
+	    va_start(ap, Format);
+	    n = vsnprintf(R->Out + R->OutLen, R->OutSize - R->OutLen, Format, ap);
+	    va_end(ap);
+	    if (n < 0)
+		return;
+	    if (R->OutLen + n < R->OutSize) {
+		R->OutLen += n;
+		return;
+	    }
+	}
+	Size = MAX(2 * R->OutSize, 4096);
+	p = realloc(R->Out, Size);
+	if (!p)
+	    return;
+	R->Out = p;
+	R->OutSize = Size;
+    }
+}
+
+/* Append Str to the report, escaping double quotes, backslashes and
+   control characters. JSON escapes the latter as \u00XX, OpenMetrics
+   only has \n. */
+static void
+ReportPrintString(ReportType * R, const char *Str, Boolean Json)
+{
+    for (; *Str; Str++) {
+	if (*Str == '"' || *Str == '\\')
+	    ReportPrintf(R, "\\%c", *Str);
+	else if (*Str == '\n' && !Json)
+	    ReportPrintf(R, "\\n");
+	else if ((unsigned char) *Str < 0x20 && Json)
+	    ReportPrintf(R, "\\u%04x", (unsigned int) (unsigned char) *Str);
+	else
+	    ReportPrintf(R, "%c", *Str);
+    }
+}
+
+/* Time InputFlow has been off, in microseconds */
+static unsigned long long
+FlowOffUs(SessionReportType * P, const struct timeval *Now)
+{
+    unsigned long long Us = P->Stats.FlowOffUs;
+
+    if (!P->InputFlow && timerisset(&P->Stats.FlowOffSince))
+	Us += (Now->tv_sec - P->Stats.FlowOffSince.tv_sec) * 1000000LL +
+	    (Now->tv_usec - P->Stats.FlowOffSince.tv_usec);
+    return Us;
+}
+
+/* Modem line state of the device of a session, known without asking
+   the driver, which may take a USB round trip: from the notifier, or
+   as last read for the client. Returns False if unknown. */
+static Boolean
+KnownModemState(SessionType * S, unsigned char *State)
+{
+    if (!S->DeviceFd)
+	return False;
+    if (GetKnownModemState(*S->DeviceFd, State))
+	return True;
+    *State = S->ModemLines;
+    return S->ModemLinesKnown;
+}
+
+/* Publish what the reports show of the sessions of a reactor that
+   changed since last time */
+static void
+PublishSessions(ReactorType * R)
+{
+    SessionType *S;
+    SessionReportType *P;
+    int i;
+
+    TakeLock(R->PublishLock);
+    for (i = R->First; i < SessionCount; i += R->Step) {
+	S = &Sessions[i];
+	if (!S->Unpublished)
+	    continue;
+	S->Unpublished = False;
+	P = &S->Published;
+	memcpy(&P->Stats, &S->Stats,
+	       LatencyTiming ? sizeof(StatsType) : offsetof(StatsType, ToNetLatency));
+	P->LineErrors = S->LineErrors;
+	P->Connected = S->InSocketFd != NULL;
+	P->DeviceOpen = S->DeviceFd != NULL;
+	P->InputFlow = S->InputFlow;
+	P->ModemKnown = KnownModemState(S, &P->ModemState);
+	P->Backlog = BufferLength(&S->Backlog);
+	P->HistoryTotal = S->History.Header ? S->History.Header->Total : 0;
+	P->ObserverCount = S->ObserverCount;
+	P->FanOutSegments = S->FanOutSegments;
+    }
+    ReleaseLock(R->PublishLock);
+}
+
+/* Read what all sessions published into Snapshots, for a report */
+static void
+ReadSnapshots(void)
+{
+    int i;
+
+    for (i = 0; i < SessionCount; i++) {
+	TakeLock(Sessions[i].PublishLock);
+	Snapshots[i] = Sessions[i].Published;
+	ReleaseLock(Sessions[i].PublishLock);
+    }
+}
+
+/* Format a latency histogram as a JSON object */
+static void
+DumpLatency(ReportType * R, const char *Name, LatencyType * L)
+{
+    ReportPrintf(R, "\"%s\":{\"count\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,"
+		 "\"p999_us\":%llu,\"max_us\":%llu}", Name, L->Total,
+		 LatencyPercentile(L, 5000), LatencyPercentile(L, 9900),
+		 LatencyPercentile(L, 9990), L->MaxUs);
+}
+
+/* Log the percentiles of a latency histogram */
+static void
+LogLatency(SessionType * S, const char *Direction, LatencyType * L)
+{
+    LogMsg(LOG_NOTICE, "Port %u latency %s: %llu samples, p50 %llu us, "
+	   "p99 %llu us, p99.9 %llu us, max %llu us", S->ListenPort, Direction, L->Total,
+	   LatencyPercentile(L, 5000), LatencyPercentile(L, 9900),
+	   LatencyPercentile(L, 9990), L->MaxUs);
+}
+
+/* Log the latency histograms of all ports */
+static void
+LogAllLatency(void)
+{
+    int i;
+
+    if (!LatencyTiming) {
+	LogMsg(LOG_NOTICE, "Latency timing is not enabled.");
+	return;
+    }
+    ReadSnapshots();
+    for (i = 0; i < SessionCount; i++) {
+	LogLatency(&Sessions[i], "to network", &Snapshots[i].Stats.ToNetLatency);
+	LogLatency(&Sessions[i], "to device", &Snapshots[i].Stats.ToDevLatency);
+    }
+}
+
+/* Format the statistics of all ports as one line of JSON */
+static void
+DumpStats(ReportType * R)
+{
+    struct timeval now;
+    int i, j;
+
+    gettimeofday(&now, NULL);
+    ReadSnapshots();
+    ReportPrintf(R, "{\"sessions\":[");
+    for (i = 0; i < SessionCount; i++) {
+	SessionType *S = &Sessions[i];
+	SessionReportType *P = &Snapshots[i];
+	StatsType *T = &P->Stats;
+
+	ReportPrintf(R, "%s{\"port\":%u,\"device\":\"", i ? "," : "", S->ListenPort);
+	ReportPrintString(R, S->DeviceName, True);
+	ReportPrintf(R, "\",\"raw\":%s,\"connected\":%s,\"connections\":%lu,"
+		     "\"lock_failures\":%lu,"
+		     "\"net_in\":%llu,\"net_out\":%llu,\"dev_in\":%llu,\"dev_out\":%llu,"
+		     "\"iac_escapes\":%lu,\"wakeups\":%lu,\"short_writes\":%lu,"
+		     "\"would_block\":%lu,\"buf_size\":%u,\"net_buf_high\":%u,"
+		     "\"dev_buf_high\":%u,\"flow_off_ms\":%llu,",
+		     S->Raw ? "true" : "false", P->Connected ? "true" : "false", T->Connections,
+		     T->LockFailures, T->NetIn, T->NetOut, T->DevIn, T->DevOut, T->IACEscapes,
+		     T->Wakeups, T->ShortWrites, T->WouldBlock, S->ToNetBuf.Mask + 1,
+		     T->NetBufHigh, T->DevBufHigh, FlowOffUs(P, &now) / 1000);
+	if (S->KeepOpen)
+	    ReportPrintf(R, "\"device_open\":%s,\"backlog\":%u,\"backlog_dropped\":%llu,",
+			 P->DeviceOpen ? "true" : "false", P->Backlog, T->BacklogDropped);
+	if (S->History.Header)
+	    ReportPrintf(R, "\"history_size\":%u,\"history_total\":%llu,", S->History.Size,
+			 P->HistoryTotal);
+	if (S->MaxObservers)
+	    ReportPrintf(R, "\"observers\":%u,\"observer_connections\":%lu,"
+			 "\"observers_dropped\":%lu,\"observer_skipped\":%llu,"
+			 "\"fanout_segments\":%u,", P->ObserverCount, T->Observers,
+			 T->ObserversDropped, T->ObserverSkipped, P->FanOutSegments);
+	ReportPrintf(R, "\"line_errors\":{\"overrun\":%lu,\"buffer_overrun\":%lu,"
+		     "\"parity\":%lu,\"framing\":%lu,\"break\":%lu},",
+		     P->LineErrors.Overrun, P->LineErrors.BufOverrun, P->LineErrors.Parity,
+		     P->LineErrors.Frame, P->LineErrors.Break);
+	if (LatencyTiming) {
+	    ReportPrintf(R, "\"latency\":{");
+	    DumpLatency(R, "to_network", &T->ToNetLatency);
+	    ReportPrintf(R, ",");
+	    DumpLatency(R, "to_device", &T->ToDevLatency);
+	    ReportPrintf(R, "},");
+	}
+	ReportPrintf(R, "\"cpc\":{");
+	for (j = 0; j < CPCCommandTypes; j++)
+	    ReportPrintf(R, "%s\"%s\":%lu", j ? "," : "", CPCCommandNames[j], T->CPCCommands[j]);
+	ReportPrintf(R, "}}");
+    }
+    ReportPrintf(R, "],\"log_dropped\":%lu}\n", LogDroppedCount());
+}
+
+/* Append the labels identifying a port to a metrics sample */
+static void
+MetricsLabels(ReportType * R, SessionType * S)
+{
+    ReportPrintf(R, "port=\"%u\",device=\"", S->ListenPort);
+    ReportPrintString(R, S->DeviceName, False);
+    ReportPrintf(R, "\"");
+}
+
+/* Append a metric family header */
+static void
+MetricsFamily(ReportType * R, const char *Name, const char *Type, const char *Help)
+{
+    ReportPrintf(R, "# TYPE sercd_%s %s\n# HELP sercd_%s %s\n", Name, Type, Name, Help);
+}
+
+/* Values sampled per port */
+#define MetricNetIn 0
+#define MetricNetOut 1
+#define MetricDevIn 2
+#define MetricDevOut 3
+#define MetricConnected 4
+#define MetricConnections 5
+#define MetricLockFailures 6
+#define MetricDCD 7
+#define MetricRI 8
+#define MetricDSR 9
+#define MetricCTS 10
+#define MetricOverrun 11
+#define MetricParity 12
+#define MetricFrame 13
+#define MetricBreak 14
+#define MetricBacklogDropped 15
+#define MetricObservers 16
+
+/* Value Which of a port, from what it published as P. Returns False
+   if it has none, as the modem lines of a closed device. */
+static Boolean
+MetricValue(SessionType * S, SessionReportType * P, int Which, unsigned long long *V)
+{
+    StatsType *T = &P->Stats;
+    unsigned char ModemMask = 0;
+
+    switch (Which) {
+    case MetricNetIn:
+	*V = T->NetIn;
+	break;
+    case MetricNetOut:
+	*V = T->NetOut;
+	break;
+    case MetricDevIn:
+	*V = T->DevIn;
+	break;
+    case MetricDevOut:
+	*V = T->DevOut;
+	break;
+    case MetricConnected:
+	*V = P->Connected;
+	break;
+    case MetricConnections:
+	*V = T->Connections;
+	break;
+    case MetricLockFailures:
+	*V = T->LockFailures;
+	break;
+    case MetricDCD:
+	ModemMask = TNCOM_MODMASK_RLSD;
+	break;
+    case MetricRI:
+	ModemMask = TNCOM_MODMASK_RING;
+	break;
+    case MetricDSR:
+	ModemMask = TNCOM_MODMASK_DSR;
+	break;
+    case MetricCTS:
+	ModemMask = TNCOM_MODMASK_CTS;
+	break;
+    case MetricOverrun:
+	*V = P->LineErrors.Overrun + P->LineErrors.BufOverrun;
+	break;
+    case MetricParity:
+	*V = P->LineErrors.Parity;
+	break;
+    case MetricFrame:
+	*V = P->LineErrors.Frame;
+	break;
+    case MetricBreak:
+	*V = P->LineErrors.Break;
+	break;
+    case MetricObservers:
+	if (!S->MaxObservers)
+	    return False;
+	*V = P->ObserverCount;
+	break;
+    case MetricBacklogDropped:
+	if (!S->KeepOpen)
+	    return False;
+	*V = T->BacklogDropped;
+	break;
+    default:
+	return False;
+    }
+
+    if (ModemMask) {
+	if (!P->ModemKnown)
+	    return False;
+	*V = (P->ModemState & ModemMask) != 0;
+    }
+    return True;
+}
+
+/* Append a counter or gauge sample of every port, with an extra Label
+   if not NULL */
+static void
+MetricsSamples(ReportType * R, const char *Name, const char *Label, int Which)
+{
+    unsigned long long V;
+    int i;
+
+    for (i = 0; i < SessionCount; i++) {
+	if (!MetricValue(&Sessions[i], &Snapshots[i], Which, &V))
+	    continue;
+	ReportPrintf(R, "sercd_%s{", Name);
+	MetricsLabels(R, &Sessions[i]);
+	ReportPrintf(R, "%s%s} %llu\n", Label ? "," : "", Label ? Label : "", V);
+    }
+}
+
+/* Append the forwarding latency histogram of one direction of every
+   port, with buckets at the powers of two from 16 us to 4 s */
+static void
+MetricsLatency(ReportType * R, const char *Direction, int Which)
+{
+    unsigned long long Sum;
+    unsigned int b, j;
+    int i;
+
+    for (i = 0; i < SessionCount; i++) {
+	LatencyType *L = Which ? &Snapshots[i].Stats.ToDevLatency :
+	    &Snapshots[i].Stats.ToNetLatency;
+
+	Sum = 0;
+	j = 0;
+	for (b = 4; b <= 22; b++) {
+	    while (j < LatencyBuckets && LatencyLimit(j) <= (1ULL << b))
+		Sum += L->Count[j++];
+	    ReportPrintf(R, "sercd_forward_latency_seconds_bucket{");
+	    MetricsLabels(R, &Sessions[i]);
+	    ReportPrintf(R, ",direction=\"%s\",le=\"%.6f\"} %llu\n", Direction,
+			 (double) (1UL << b) / 1000000.0, Sum);
 	}
-	LSocketFd = &lsocket;
-	NewListener(*LSocketFd);
+	ReportPrintf(R, "sercd_forward_latency_seconds_bucket{");
+	MetricsLabels(R, &Sessions[i]);
+	ReportPrintf(R, ",direction=\"%s\",le=\"+Inf\"} %llu\n", Direction, L->Total);
+	ReportPrintf(R, "sercd_forward_latency_seconds_count{");
+	MetricsLabels(R, &Sessions[i]);
+	ReportPrintf(R, ",direction=\"%s\"} %llu\n", Direction, L->Total);
+	ReportPrintf(R, "sercd_forward_latency_seconds_sum{");
+	MetricsLabels(R, &Sessions[i]);
+	ReportPrintf(R, ",direction=\"%s\"} %.6f\n", Direction,
+		     (double) L->SumUs / 1000000.0);
     }
+}
 
-    /* Main loop with fd's control. General note: We basically have
-       three states:
+/* Format the metrics of all ports in the OpenMetrics text format */
+static void
+DumpMetrics(ReportType * R)
+{
+    ReportPrintf(R, "HTTP/1.0 200 OK\r\n"
+		 "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		 "Connection: close\r\n\r\n");
+
+    ReadSnapshots();
+    MetricsFamily(R, "network_bytes", "counter", "Bytes read from and written to the network.");
+    MetricsSamples(R, "network_bytes_total", "direction=\"in\"", MetricNetIn);
+    MetricsSamples(R, "network_bytes_total", "direction=\"out\"", MetricNetOut);
+    MetricsFamily(R, "device_bytes", "counter", "Bytes read from and written to the device.");
+    MetricsSamples(R, "device_bytes_total", "direction=\"in\"", MetricDevIn);
+    MetricsSamples(R, "device_bytes_total", "direction=\"out\"", MetricDevOut);
+    MetricsFamily(R, "connected", "gauge", "Whether a client is connected.");
+    MetricsSamples(R, "connected", NULL, MetricConnected);
+    MetricsFamily(R, "connections", "counter", "Client connections accepted.");
+    MetricsSamples(R, "connections_total", NULL, MetricConnections);
+    MetricsFamily(R, "observers", "gauge", "Read-only observers connected.");
+    MetricsSamples(R, "observers", NULL, MetricObservers);
+    MetricsFamily(R, "lock_failures", "counter", "Device opens failing on the lock file.");
+    MetricsSamples(R, "lock_failures_total", NULL, MetricLockFailures);
+    MetricsFamily(R, "modem_line", "gauge", "Modem line state of open devices.");
+    MetricsSamples(R, "modem_line", "line=\"dcd\"", MetricDCD);
+    MetricsSamples(R, "modem_line", "line=\"ri\"", MetricRI);
+    MetricsSamples(R, "modem_line", "line=\"dsr\"", MetricDSR);
+    MetricsSamples(R, "modem_line", "line=\"cts\"", MetricCTS);
+    MetricsFamily(R, "line_errors", "counter", "Line errors counted by the driver.");
+    MetricsSamples(R, "line_errors_total", "type=\"overrun\"", MetricOverrun);
+    MetricsSamples(R, "line_errors_total", "type=\"parity\"", MetricParity);
+    MetricsSamples(R, "line_errors_total", "type=\"framing\"", MetricFrame);
+    MetricsSamples(R, "line_errors_total", "type=\"break\"", MetricBreak);
+    MetricsFamily(R, "backlog_dropped", "counter",
+		  "Device bytes dropped while no client was connected.");
+    MetricsSamples(R, "backlog_dropped_total", NULL, MetricBacklogDropped);
+    if (LatencyTiming) {
+	MetricsFamily(R, "forward_latency_seconds", "histogram",
+		      "Time from reading data to writing it out at the other side.");
+	MetricsLatency(R, "to_network", 0);
+	MetricsLatency(R, "to_device", 1);
+    }
+    MetricsFamily(R, "log_dropped", "counter", "Log messages dropped by a stalled log.");
+    ReportPrintf(R, "sercd_log_dropped_total %lu\n", LogDroppedCount());
+    ReportPrintf(R, "# EOF\n");
+}
 
-       1) No client connection, no open port
-       2) Client connected, port not yet open
-       3) Client connected, port open
+/* Create the control socket at Path */
+static void
+OpenControl(char *Path)
+{
+    Control.lsocket = OpenControlSocket(Path);
+    if (Control.lsocket < 0) {
+	perror("control socket");
+	fprintf(stderr, "Couldn't create control socket %s\n", Path);
+	exit(Error);
+    }
+    ControlPath = Path;
+    Control.LSocketFd = &Control.lsocket;
+    NewListener(*Control.LSocketFd);
+}
 
-       This means that if DeviceFd is set, InSocketFd and OutSocketFd
-       should be set as well. */
-    while (True) {
-	int selret;
+/* Create the metrics listener */
+static void
+OpenMetrics(struct in_addr BindAddr, unsigned int Port)
+{
+    Metrics.lsocket = OpenTcpListener(BindAddr, Port);
+    Metrics.LSocketFd = &Metrics.lsocket;
+    Metrics.Http = True;
+    NewListener(*Metrics.LSocketFd);
+}
 
-	PORTHANDLE *DeviceIn = NULL;
-	PORTHANDLE *DeviceOut = NULL;
-	PORTHANDLE *Modemstate = NULL;
-	SERCD_SOCKET *SocketOut = NULL;
-	SERCD_SOCKET *SocketIn = NULL;
+/* Fill in the descriptors a report listener is waiting for: a new
+   client, its request or the room to send it the report */
+static void
+SetupReportWatch(ReportType * R, SercdWatch * W)
+{
+    memset(W, 0, sizeof(*W));
+    if (!R->SocketFd)
+	W->SocketConnect = R->LSocketFd;
+    else if (R->Http && R->OutLen == 0)
+	W->SocketIn = R->SocketFd;
+    else
+	W->SocketOut = R->SocketFd;
+    if (R->SocketFd)
+	W->Deadline = R->Due;
+}
 
-	if (DeviceFd && BufferHasRoomFor(&ToNetBuf, EscWriteChar_bytes) && InputFlow) {
-	    DeviceIn = DeviceFd;
-	}
-	if (DeviceFd && !IsBufferEmpty(&ToDevBuf)) {
-	    DeviceOut = DeviceFd;
+static void
+CloseReportClient(ReportType * R)
+{
+    if (R->SocketFd) {
+	DropConnection(NULL, R->SocketFd, NULL, NULL);
+	R->SocketFd = NULL;
+    }
+}
+
+/* Prepare the report once the client has asked for it */
+static void
+PrepareReport(ReportType * R)
+{
+    R->OutLen = R->OutPos = 0;
+    if (!R->Http)
+	DumpStats(R);
+    else if (strncmp(R->Request, "GET ", 4) == 0)
+	DumpMetrics(R);
+    else
+	ReportPrintf(R, "HTTP/1.0 405 Method Not Allowed\r\nConnection: close\r\n\r\n");
+}
+
+/* Serve the client of a report listener */
+static void
+HandleReportEvents(ReportType * R, int Events)
+{
+    ssize_t iobytes;
+    int SockParmEnable = 1;
+    SERCD_SOCKET csock;
+
+    if (Events & SERCD_EV_TIMEOUT) {
+	CloseReportClient(R);
+	return;
+    }
+
+    if (Events & SERCD_EV_SOCKETCONNECT) {
+	csock = accept(*R->LSocketFd, NULL, NULL);
+	if (csock < 0)
+	    return;
+	ioctl(csock, FIONBIO, &SockParmEnable);
+	R->socket = csock;
+	R->SocketFd = &R->socket;
+	R->RequestLen = R->OutLen = R->OutPos = 0;
+	gettimeofday(&R->Due, NULL);
+	R->Due.tv_sec += ReportTimeout;
+	if (!R->Http) {
+	    PrepareReport(R);
+	    Events |= SERCD_EV_SOCKETOUT;
 	}
-	if (DeviceFd && PortControlEnable && InputFlow &&
-	    BufferHasRoomFor(&ToNetBuf, SendCPCByteCommand_bytes)) {
-	    Modemstate = DeviceFd;
+    }
+
+    if ((Events & SERCD_EV_SOCKETIN) && R->SocketFd) {
+	/* Read the request up to the empty line ending it */
+	iobytes = ReadFromNet(*R->SocketFd, R->Request + R->RequestLen,
+			      sizeof(R->Request) - 1 - R->RequestLen);
+	if (iobytes == 0 || (iobytes < 0 && errno != EWOULDBLOCK)) {
+	    CloseReportClient(R);
+	    return;
 	}
-	if (OutSocketFd && !IsBufferEmpty(&ToNetBuf)) {
-	    SocketOut = OutSocketFd;
+	if (iobytes > 0)
+	    R->RequestLen += iobytes;
+	R->Request[R->RequestLen] = '\0';
+	if (strstr(R->Request, "\r\n\r\n") || strstr(R->Request, "\n\n") ||
+	    R->RequestLen == sizeof(R->Request) - 1) {
+	    PrepareReport(R);
+	    Events |= SERCD_EV_SOCKETOUT;
 	}
-	if (DeviceFd && BufferHasRoomFor(&ToDevBuf, EscRedirectChar_bytes_DevB) &&
-	    InSocketFd && BufferHasRoomFor(&ToNetBuf, EscRedirectChar_bytes_SockB)) {
-	    SocketIn = InSocketFd;
+    }
+
+    if ((Events & SERCD_EV_SOCKETOUT) && R->SocketFd && R->OutLen > 0) {
+	iobytes = WriteToNet(*R->SocketFd, R->Out + R->OutPos, R->OutLen - R->OutPos);
+	if (iobytes > 0)
+	    R->OutPos += iobytes;
+	if ((iobytes < 0 && errno != EWOULDBLOCK) || R->OutPos >= R->OutLen)
+	    CloseReportClient(R);
+    }
+}
+
+/* Run the event loop of a reactor. Returns when none of its sessions
+   is active any more, or when sercd is asked to stop. */
+static void *
+RunReactor(void *Arg)
+{
+    ReactorType *R = Arg;
+    SercdWatch *Watches = R->Watches;
+    int i, n, selret, WatchCount;
+    Boolean Active;
+
+    if (R->Cpu >= 0 && !BindThreadToCpu(R->Cpu))
+	LogMsg(LOG_WARNING, "Unable to bind event loop to CPU %d.", R->Cpu);
+
+    while (!StopRequested) {
+	Active = False;
+	for (i = R->First, n = 0; i < SessionCount; i += R->Step, n++) {
+	    if (SetupWatch(&Sessions[i], &Watches[n]))
+		Active = True;
 	}
 
-	if (!DeviceIn && !DeviceOut && !SocketOut && !SocketIn && !LSocketFd) {
+	if (!Active) {
 	    /* Nothing more to do */
-	    exit(NoError);
+	    break;
 	}
 
-	selret = SercdSelect(DeviceIn, DeviceOut, Modemstate, SocketOut, SocketIn,
-			     LSocketFd, PollInterval);
+	WatchCount = n;
+	if (R->First == 0 && Control.LSocketFd)
+	    SetupReportWatch(&Control, &Watches[WatchCount++]);
+	if (R->First == 0 && Metrics.LSocketFd)
+	    SetupReportWatch(&Metrics, &Watches[WatchCount++]);
+	WatchCount = SetupObserverWatches(R, WatchCount);
+
+	PublishSessions(R);
+	selret = SercdSelectMany(Watches, WatchCount, R->PollInterval);
+	if (StopRequested)
+	    break;
+	/* Signals are only delivered to the main thread */
+	if (R->First == 0 && LatencyDumpRequested) {
+	    if (selret < 0 && errno == EINTR)
+		selret = 0;
+	    LatencyDumpRequested = 0;
+	    LogAllLatency();
+	}
 	if (selret < 0) {
-	    snprintf(LogStr, sizeof(LogStr), "select error: %d", errno);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_ERR, LogStr);
-	    exit(Error);
+	    LogMsg(LOG_ERR, "select error: %d", errno);
+	    ExitStatus = Error;
+	    StopRequested = 1;
+	    break;
 	}
 	else if (selret > 0) {
-	    /* Handle buffers in the following order:
-	       Serial input
-	       Serial output
-	       Network output
-	       Network input
-
-	       Motivation: Needs to read away data from the serial
-	       port to prevent buffer overruns. Needs to drain our
-	       buffers as fast as possible, to reduce latency and make
-	       room for more. This order should be used in function
-	       signatures etc as well.
-	     */
-	    ssize_t iobytes;
-	    unsigned int i, trybytes;
-	    unsigned char *p;
-
-	    if (selret & SERCD_EV_DEVICEIN) {
-		/* Read from serial port. Each serial port byte might
-		   produce EscWriteChar_bytes of network data. */
-		trybytes = MIN(sizeof(readbuf), BufferRoomLeft(&ToNetBuf) / EscWriteChar_bytes);
-		iobytes = ReadFromDev(*DeviceFd, &readbuf, trybytes);
-		if (IOResultError(iobytes, "Error reading from device", "EOF from device")) {
-		    DropConnection(DeviceFd, InSocketFd, OutSocketFd, LockFileName);
-		    InSocketFd = OutSocketFd = NULL;
-		    DeviceFd = NULL;
-		    continue;
-		}
-		else {
-		    for (i = 0; i < iobytes; i++) {
-			EscWriteChar(&ToNetBuf, readbuf[i]);
-		    }
-		}
+	    for (i = R->First, n = 0; i < SessionCount; i += R->Step, n++) {
+		if (Watches[n].Events)
+		    HandleSessionEvents(&Sessions[i], Watches[n].Events);
 	    }
+	    if (R->First == 0 && Control.LSocketFd && Watches[n++].Events)
+		HandleReportEvents(&Control, Watches[n - 1].Events);
+	    if (R->First == 0 && Metrics.LSocketFd && Watches[n++].Events)
+		HandleReportEvents(&Metrics, Watches[n - 1].Events);
+	    HandleObserverWatches(R);
+	}
+    }
 
-	    if (selret & SERCD_EV_DEVICEOUT) {
-		/* Write to serial port */
-		p = GetBufferString(&ToDevBuf, &trybytes);
-		iobytes = WriteToDev(*DeviceFd, p, trybytes);
-		if (IOResultError(iobytes, "Error writing to device.", "EOF to device")) {
-		    DropConnection(DeviceFd, InSocketFd, OutSocketFd, LockFileName);
-		    InSocketFd = OutSocketFd = NULL;
-		    DeviceFd = NULL;
-		    continue;
-		}
-		else {
-		    BufferPopBytes(&ToDevBuf, iobytes);
-		}
-	    }
+    /* The others stop with the first one */
+    if (R->First == 0)
+	StopRequested = 1;
+    if (StopRequested)
+	WakeEventLoops();
+    CloseSessions(R->First, R->Step);
+    return NULL;
+}
 
-	    if (selret & SERCD_EV_SOCKETOUT) {
-		/* Write to network */
-		p = GetBufferString(&ToNetBuf, &trybytes);
-		iobytes = WriteToNet(*OutSocketFd, p, trybytes);
-		if (IOResultError(iobytes, "Error writing to network", "EOF to network")) {
-		    DropConnection(DeviceFd, InSocketFd, OutSocketFd, LockFileName);
-		    InSocketFd = OutSocketFd = NULL;
-		    DeviceFd = NULL;
-		    continue;
-		}
-		else {
-		    BufferPopBytes(&ToNetBuf, iobytes);
-		}
-	    }
+/* Main function */
+int
+main(int argc, char **argv)
+{
+    /* Poll interval and timer */
+    long PollInterval;
 
-	    if (selret & SERCD_EV_SOCKETIN) {
-		/* Read from network. Each network byte might produce
-		   EscRedirectChar_bytes_DevB or or up to
-		   EscRedirectChar_bytes_SockB network data. */
-		trybytes = sizeof(readbuf);
-		trybytes = MIN(trybytes, BufferRoomLeft(&ToNetBuf) / EscRedirectChar_bytes_SockB);
-		trybytes = MIN(trybytes, BufferRoomLeft(&ToDevBuf) / EscRedirectChar_bytes_DevB);
-		iobytes = ReadFromNet(*InSocketFd, readbuf, trybytes);
-		if (IOResultError(iobytes, "Error readbuf from network.", "EOF from network")) {
-		    DropConnection(DeviceFd, InSocketFd, OutSocketFd, LockFileName);
-		    InSocketFd = OutSocketFd = NULL;
-		    DeviceFd = NULL;
-		    continue;
-		}
-		else {
-		    for (i = 0; i < iobytes; i++) {
-			EscRedirectChar(&ToNetBuf, &ToDevBuf, *DeviceFd, readbuf[i]);
-		    }
+    int opt = 0;
+    char *optstring = "iestup:l:c:b:k:H:R:O:C:F:S:M:T:";
+    unsigned int opt_port = 7000;
+    Boolean inetd_mode = True;
+    char *opt_port_table = NULL;
+    char *opt_control = NULL;
+    unsigned int opt_metrics_port = 0;
+    struct in_addr opt_metrics_addr;
+    Boolean opt_metrics_bind = False;
+    struct in_addr opt_bind_addr;
+    unsigned int opt_threads = 1;
+    Boolean opt_pin = False;
+    ReactorType *Reactors;
+    int i, WatchCount;
+    unsigned int k;
+
+    opt_bind_addr.s_addr = INADDR_ANY;
+    opt_metrics_addr.s_addr = INADDR_ANY;
+
+    while (opt != -1) {
+	opt = getopt(argc, argv, optstring);
+	switch (opt) {
+	    /* Cisco IOS compatibility */
+	case 'i':
+	    CiscoIOSCompatible = True;
+	    break;
+	case 'e':
+	    StdErrLogging = True;
+	    break;
+	case 's':
+	    ForceSelect = True;
+	    break;
+	case 'u':
+	    UseUring = True;
+	    break;
+	case 't':
+	    LatencyTiming = True;
+	    break;
+	case 'p':
+	    opt_port = strtol(optarg, NULL, 10);
+	    if (opt_port == 0) {
+		fprintf(stderr, "Invalid port\n");
+		exit(Error);
+	    }
+	    break;
+	case 'l':
+	    if (*optarg) {
+		opt_bind_addr.s_addr = inet_addr(optarg);
+		if (opt_bind_addr.s_addr == (unsigned) -1) {
+		    fprintf(stderr, "Invalid bind address\n");
+		    exit(Error);
 		}
 	    }
-
-	    /* accept new connections */
-	    if (selret & SERCD_EV_SOCKETCONNECT) {
-		struct sockaddr addr;
-		socklen_t addrlen = sizeof(addr);
-		int csock;
-
-		/* FIXME: Might be a good idea to log the client addr */
-		LogMsg(LOG_NOTICE, "New connection");
-		csock = accept(*LSocketFd, &addr, &addrlen);
-		if (csock < 0) {
-		    /* FIXME: Log what kind of error. */
-		    LogMsg(LOG_ERR, "Error accepting socket");
+	    inetd_mode = False;
+	    break;
+	case 'b':
+	    {
+		unsigned long Size = strtoul(optarg, NULL, 10);
+		if (Size < MinBufferSize || Size > MaxBufferSize) {
+		    fprintf(stderr, "Invalid buffer size, must be %d to %d\n", MinBufferSize,
+			    MaxBufferSize);
+		    exit(Error);
 		}
-		else if (InSocketFd && OutSocketFd) {
-		    /* We can only handle one connection at a time. */
-		    LogMsg(LOG_ERR, "Another client connected, dropping new connection");
-		    closesocket(csock);
+		/* Round up to a power of two */
+		for (BufferSize = MinBufferSize; BufferSize < Size; BufferSize <<= 1);
+	    }
+	    break;
+	case 'k':
+	    if (!ParseBacklog(optarg, &DefaultBacklog)) {
+		fprintf(stderr, "Invalid backlog size, must be 0 to %d\n", MaxBufferSize);
+		exit(Error);
+	    }
+	    DefaultKeepOpen = True;
+	    break;
+	case 'H':
+	    if (!ParseHistory(optarg, &DefaultHistorySize, &DefaultHistoryFile)) {
+		fprintf(stderr, "Invalid history, size must be 1 to %d\n", MaxHistorySize);
+		exit(Error);
+	    }
+	    break;
+	case 'R':
+	    if (!ParseReplay(optarg, &DefaultReplay)) {
+		fprintf(stderr, "Invalid replay limit\n");
+		exit(Error);
+	    }
+	    break;
+	case 'O':
+	    if (!ParseObservers(optarg, &DefaultMaxObservers, &DefaultSkipObservers)) {
+		fprintf(stderr, "Invalid observers, must be 0 to %d\n", MaxObserverLimit);
+		exit(Error);
+	    }
+	    break;
+	case 'T':
+	    if (!ParseThreads(optarg, &opt_threads, &opt_pin)) {
+		fprintf(stderr, "Invalid threads, must be 0 to %d\n", MaxReactors);
+		exit(Error);
+	    }
+	    break;
+	case 'C':
+	    if (!ParseCoalesce(optarg, &DefaultCoalesce)) {
+		fprintf(stderr, "Invalid coalescing policy\n");
+		exit(Error);
+	    }
+	    break;
+	case 'F':
+	    if (!ParseFraming(optarg, &DefaultFraming)) {
+		fprintf(stderr, "Invalid framing\n");
+		exit(Error);
+	    }
+	    break;
+	case 'c':
+#ifdef WIN32
+	    fprintf(stderr, "Multi-port mode is not supported on this platform\n");
+	    exit(Error);
+#endif
+	    opt_port_table = optarg;
+	    inetd_mode = False;
+	    break;
+	case 'S':
+#ifdef WIN32
+	    fprintf(stderr, "Control socket is not supported on this platform\n");
+	    exit(Error);
+#endif
+	    opt_control = optarg;
+	    break;
+	case 'M':
+	    {
+		char *Port = strrchr(optarg, ':');
+		if (Port) {
+		    *Port++ = '\0';
+		    opt_metrics_addr.s_addr = *optarg ? inet_addr(optarg) : INADDR_ANY;
+		    if (opt_metrics_addr.s_addr == (unsigned) -1) {
+			fprintf(stderr, "Invalid metrics address\n");
+			exit(Error);
+		    }
+		    opt_metrics_bind = True;
 		}
-		else {
-		    /* Set up networking */
-		    insocket = csock;
-		    OutSocketFd = InSocketFd = &insocket;
-		    SetSocketOptions(*InSocketFd, *OutSocketFd);
-		    InitBuffer(&ToNetBuf);
-		    InitTelnetStateMachine();
-		    SendTelnetInitialOptions(&ToNetBuf);
+		opt_metrics_port = strtol(Port ? Port : optarg, NULL, 10);
+		if (opt_metrics_port == 0) {
+		    fprintf(stderr, "Invalid metrics port\n");
+		    exit(Error);
 		}
+		/* The metrics include the forwarding latency */
+		LatencyTiming = True;
 	    }
+	    break;
+	}
+    }
 
-	    /* Open serial port if not yet open */
-	    if (InSocketFd && OutSocketFd && !DeviceFd) {
-		DeviceFd = &devicefd;
-		if (OpenPort(DeviceName, LockFileName, DeviceFd) == Error) {
-		    /* Open failed */
-		    snprintf(LogStr, sizeof(LogStr), "Unable to open device %s. Exiting.",
-			     DeviceName);
-		    LogStr[sizeof(LogStr) - 1] = '\0';
-		    LogMsg(LOG_ERR, LogStr);
-		    /* Emulate the inetd behaviour: Close the connection. */
-		    DropConnection(NULL, InSocketFd, OutSocketFd, LockFileName);
-		    InSocketFd = OutSocketFd = NULL;
-		    DeviceFd = NULL;
-		    continue;
-		}
-		else {
-		    /* Successfully opened port */
-		    InitBuffer(&ToDevBuf);
-		}
+    if (DefaultMaxObservers && inetd_mode) {
+	fprintf(stderr, "Observers are only accepted in standalone mode\n");
+	exit(Error);
+    }
+    if (opt_threads > 1 && inetd_mode) {
+	fprintf(stderr, "Threads are only used in standalone mode\n");
+	exit(Error);
+    }
+    if (opt_metrics_port && inetd_mode) {
+	fprintf(stderr, "Metrics are only served in standalone mode\n");
+	exit(Error);
+    }
+    if ((DefaultKeepOpen || DefaultHistorySize) && inetd_mode) {
+	fprintf(stderr, "Devices are only kept open in standalone mode\n");
+	exit(Error);
+    }
+    if (DefaultHistoryFile && opt_port_table) {
+	fprintf(stderr, "History files are given per port in the port table\n");
+	exit(Error);
+    }
+
+    /* Check the command line argument count */
+    if (opt_port_table) {
+	if (argc - optind < 1 || argc - optind > 2) {
+	    Usage();
+	    exit(Error);
+	}
+    }
+    else if (argc - optind < 3 || argc - optind > 4) {
+	Usage();
+	exit(Error);
+    }
+
+    /* Sets the log level */
+    MaxLogLevel = atoi(argv[optind++]);
+
+    /* Gets device and lock file names */
+    if (opt_port_table) {
+	ReadPortTable(opt_port_table);
+    }
+    else {
+	char *DeviceName = argv[optind++];
+	char *LockFileName = argv[optind++];
+	NewSession(DeviceName, LockFileName, opt_port);
+    }
+
+    /* Retrieve the polling interval */
+    if (optind < argc) {
+	char *endptr;
+	PollInterval = strtol(argv[optind++], &endptr, 0);
+	if (!endptr || *endptr || PollInterval < 0) {
+	    fprintf(stderr, "Invalid polling interval\n");
+	    exit(Error);
+	}
+    }
+    else {
+	PollInterval = DEFAULT_POLL_INTERVAL;
+    }
+
+    for (i = 0; i < SessionCount; i++) {
+	SessionType *S = &Sessions[i];
+	if (S->MaxObservers) {
+	    S->Observers = calloc(S->MaxObservers, sizeof(ObserverType));
+	    if (!S->Observers) {
+		fprintf(stderr, "Out of memory\n");
+		exit(Error);
 	    }
+	}
+    }
+
+    /* Ports are dealt out to the event loops in turn. Each has one
+       watch per session and per observer, the first one also for the
+       control socket and the metrics listener. */
+    opt_threads = MIN(opt_threads, (unsigned int) SessionCount);
+    Reactors = calloc(opt_threads, sizeof(ReactorType));
+    if (!Reactors) {
+	fprintf(stderr, "Out of memory\n");
+	exit(Error);
+    }
+    for (k = 0; k < opt_threads; k++) {
+	ReactorType *R = &Reactors[k];
+	R->First = k;
+	R->Step = opt_threads;
+	R->Cpu = opt_pin ? (int) k % CpuCount() : -1;
+	R->PollInterval = PollInterval;
+	WatchCount = k == 0 ? 2 : 0;
+	for (i = k; i < SessionCount; i += opt_threads)
+	    WatchCount += 1 + Sessions[i].MaxObservers;
+	R->Watches = calloc(WatchCount, sizeof(SercdWatch));
+	if (!R->Watches) {
+	    fprintf(stderr, "Out of memory\n");
+	    exit(Error);
+	}
+	/* Without threads, nothing needs locking */
+	if (opt_threads > 1 && !(R->PublishLock = CreateLock())) {
+	    fprintf(stderr, "Unable to create event loop lock\n");
+	    exit(Error);
+	}
+	for (i = k; i < SessionCount; i += opt_threads)
+	    Sessions[i].PublishLock = R->PublishLock;
+    }
+    Snapshots = calloc(SessionCount, sizeof(SessionReportType));
+    if (!Snapshots) {
+	fprintf(stderr, "Out of memory\n");
+	exit(Error);
+    }
+
+    PlatformInit();
+
+    if (opt_control)
+	OpenControl(opt_control);
+
+    /* Logs sercd start */
+    LogMsg(LOG_NOTICE, "sercd started.");
+
+    /* Logs sercd log level */
+    LogMsg(LOG_INFO, "Log level: %i", MaxLogLevel);
+
+    /* Logs the polling interval */
+    LogMsg(LOG_INFO, "Polling interval (ms): %ld", PollInterval);
 
-	    /* Check the port state and notify the client if it's changed */
-	    if (selret & SERCD_EV_MODEMSTATE) {
-		unsigned char newstate;
-		ModemStateNotified();
-		newstate = GetModemState(*DeviceFd, ModemState);
-		/* Don't send update if only delta changes */
-		if ((newstate & ModemStateMask & TNCOM_MODMASK_NODELTA)
-		    != (ModemState & ModemStateMask & TNCOM_MODMASK_NODELTA)) {
-		    ModemState = newstate;
-		    SendCPCByteCommand(&ToNetBuf, TNASC_NOTIFY_MODEMSTATE,
-				       (ModemState & ModemStateMask));
-		    snprintf(LogStr, sizeof(LogStr), "Sent modem state: %u",
-			     (unsigned int) (ModemState & ModemStateMask));
-		    LogStr[sizeof(LogStr) - 1] = '\0';
-		    LogMsg(LOG_DEBUG, LogStr);
+    if (inetd_mode) {
+	/* inetd mode */
+	SessionType *S = &Sessions[0];
+	S->insocket = STDIN_FILENO;
+	S->outsocket = STDOUT_FILENO;
+	S->InSocketFd = &S->insocket;
+	S->OutSocketFd = &S->outsocket;
+	StartSession(S);
+    }
+    else {
+	/* Standalone mode */
+	for (i = 0; i < SessionCount; i++) {
+	    SessionType *S = &Sessions[i];
+	    OpenListener(S, opt_bind_addr);
+	    if (S->HistorySize) {
+		/* The history is kept whether a client is connected or not */
+		OpenHistory(S);
+		S->KeepOpen = True;
+	    }
+	    if (S->KeepOpen) {
+		unsigned int Size;
+
+		/* The backlog buffer is a power of two, filled up to
+		   BacklogSize */
+		if (S->BacklogSize) {
+		    for (Size = 1; Size < S->BacklogSize; Size <<= 1);
+		    AllocBuffer(&S->Backlog, Size);
 		}
+		if (!OpenDevice(S))
+		    LogMsg(LOG_ERR, "Unable to open device %s, retrying when a client connects.",
+			   S->DeviceName);
 	    }
 	}
+	if (opt_metrics_port)
+	    OpenMetrics(opt_metrics_bind ? opt_metrics_addr : opt_bind_addr, opt_metrics_port);
+	if (SessionCount > 1) {
+	    LogMsg(LOG_INFO, "Serving %d ports.", SessionCount);
+	}
+    }
+
+    /* Main loop with fd's control. General note: We basically have
+       three states per session:
+
+       1) No client connection, no open port
+       2) Client connected, port not yet open
+       3) Client connected, port open
+       4) No client connection, port kept open (-k or keep)
+
+       This means that if DeviceFd is set, InSocketFd and OutSocketFd
+       should be set as well, unless the port is kept open. Each session
+       belongs to one event loop; all but the first run in threads of
+       their own (-T). */
+    ReactorsRunning = opt_threads > 1;
+    for (k = 1; k < opt_threads; k++) {
+	if (!StartThread(RunReactor, &Reactors[k])) {
+	    LogMsg(LOG_ERR, "Unable to start event loop thread.");
+	    StopRequested = 1;
+	    WakeEventLoops();
+	    JoinThreads();
+	    ReactorsRunning = False;
+	    exit(Error);
+	}
     }
+    if (opt_threads > 1)
+	LogMsg(LOG_INFO, "Serving ports in %u threads.", opt_threads);
+
+    RunReactor(&Reactors[0]);
+    JoinThreads();
+    ReactorsRunning = False;
+    exit(ExitStatus);
 }
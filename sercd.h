@@ -23,6 +23,8 @@ Boolean;
 #define NoError 0
 #define Error 1
 #define OpenError -1
+/* OpenPort: the device is locked by another process */
+#define LockError 2
 
 /* Base Telnet protocol constants (STD 8) */
 #define TNSE ((unsigned char) 240)
@@ -134,9 +136,28 @@ Boolean;
 #define TNCOM_PURGE_TX ((unsigned char) 2)
 #define TNCOM_PURGE_BOTH ((unsigned char) 3)
 
+/* Log level in effect: messages above it are dropped */
+extern int MaxLogLevel;
+
 /* Generic log function with log level control. Uses the same log levels
-of the syslog(3) system call */
-void LogMsg(int LogLevel, const char *const Msg);
+of the syslog(3) system call. The message is a printf format; its
+arguments are only evaluated and formatted if the level is enabled. */
+#define LogMsg(LogLevel, ...) \
+    do { \
+	if ((LogLevel) <= MaxLogLevel) \
+	    LogFormat((LogLevel), __VA_ARGS__); \
+    } while (0)
+
+/* Number of log messages dropped because they could not be written
+   fast enough */
+unsigned long LogDroppedCount(void);
+
+/* Format and write a message that passed the LogMsg level check */
+void LogFormat(int LogLevel, const char *Fmt, ...)
+#ifdef __GNUC__
+    __attribute__ ((format(printf, 2, 3)))
+#endif
+    ;
 
 /* Function executed when the program exits */
 void ExitFunction(void);
@@ -144,16 +165,74 @@ void ExitFunction(void);
 /* Function called on break signal */
 void BreakFunction(int unused);
 
-/* Abstract platform-independent select function */
-int SercdSelect(PORTHANDLE *DeviceIn, PORTHANDLE *DeviceOut, PORTHANDLE *Modemstate,
-		SERCD_SOCKET *SocketOut, SERCD_SOCKET *SocketIn,
-		SERCD_SOCKET *SocketConnect, long PollInterval);
+/* Wake up the event loops waiting for I/O, so that they notice a stop
+   request. Safe to call from a signal handler. */
+void WakeEventLoops(void);
+
+/* Function called on the signal asking for the latency histograms */
+void LatencyDumpFunction(int unused);
+
+/* Line error counters of a port, as kept by the driver */
+typedef struct
+{
+    unsigned long Overrun;
+    unsigned long BufOverrun;
+    unsigned long Parity;
+    unsigned long Frame;
+    unsigned long Break;
+}
+LineCountType;
+
+/* Descriptors of one session to wait for. A NULL pointer means no
+interest in the corresponding event. */
+typedef struct
+{
+    PORTHANDLE *DeviceIn;
+    PORTHANDLE *DeviceOut;
+    PORTHANDLE *Modemstate;
+    SERCD_SOCKET *SocketOut;
+    SERCD_SOCKET *SocketIn;
+    SERCD_SOCKET *SocketConnect;
+    /* Device whose port jobs are awaited, reporting SERCD_EV_PORTDONE
+       once all have finished */
+    PORTHANDLE *PortJobs;
+    /* Device whose close by the port workers is awaited, reporting
+       SERCD_EV_PORTDONE once it is closed */
+    const char *PortClose;
+    /* SERCD_EV_* events ready, filled in by SercdSelectMany */
+    int Events;
+    /* Time of the last modem state poll */
+    struct timeval LastPoll;
+    /* Wake up at this time, if set, reporting SERCD_EV_TIMEOUT */
+    struct timeval Deadline;
+}
+SercdWatch;
+
+/* Abstract platform-independent select function, waiting for the
+events of Count sessions at once. Returns the number of sessions with
+events, or -1 on error. */
+int SercdSelectMany(SercdWatch *Watches, int Count, long PollInterval);
 #define SERCD_EV_DEVICEIN 1
 #define SERCD_EV_DEVICEOUT 2
 #define SERCD_EV_SOCKETOUT 4
 #define SERCD_EV_SOCKETIN 8
 #define SERCD_EV_SOCKETCONNECT 16
 #define SERCD_EV_MODEMSTATE 32
+#define SERCD_EV_TIMEOUT 64
+#define SERCD_EV_PORTDONE 128
+
+/* Milliseconds from Now to Then, rounded up; negative if Then has passed */
+long TimevalDiffMs(const struct timeval *Then, const struct timeval *Now);
+
+/* Microseconds on a clock that is not set, for measuring delays */
+unsigned long long MonotonicUs(void);
+
+/* Earliest deadline of the watches, as a timeout in milliseconds from
+   Now to combine with Timeout (-1 for none) */
+long WatchTimeout(SercdWatch *Watches, int Count, const struct timeval *Now, long Timeout);
+
+/* Flag SERCD_EV_TIMEOUT on the watches whose deadline has passed */
+int WatchDeadlines(SercdWatch *Watches, int Count);
 
 /* macros */
 #ifndef MAX
@@ -164,14 +243,53 @@ int SercdSelect(PORTHANDLE *DeviceIn, PORTHANDLE *DeviceOut, PORTHANDLE *Modemst
 #endif
 
 void NewListener(SERCD_SOCKET LSocketFd);
+SERCD_SOCKET OpenControlSocket(const char *Path);
+void CloseControlSocket(SERCD_SOCKET LSocketFd, const char *Path);
 void DropConnection(PORTHANDLE * DeviceFd, SERCD_SOCKET * InSocketFd, SERCD_SOCKET * OutSocketFd, 
 		    const char *LockFileName);
 
 ssize_t WriteToDev(PORTHANDLE port, const void *buf, size_t count);
 ssize_t ReadFromDev(PORTHANDLE port, void *buf, size_t count);
 ssize_t WriteToNet(SERCD_SOCKET sock, const void *buf, size_t count);
+ssize_t WriteToDevV(PORTHANDLE port, const struct iovec *iov, int iovcnt);
+ssize_t WriteToNetV(SERCD_SOCKET sock, const struct iovec *iov, int iovcnt, Boolean More);
 ssize_t ReadFromNet(SERCD_SOCKET sock,  void *buf, size_t count);
 void ModemStateNotified();
+void *MapMirrorBuffer(unsigned int *Size);
+void *MapHistoryFile(const char *Path, size_t Len);
+
+/* Threads running event loops */
+int CpuCount(void);
+Boolean StartThread(void *(*Run) (void *), void *Arg);
+void JoinThreads(void);
+
+/* Locks between event loop threads. CreateLock returns NULL without
+   threads; taking a NULL lock does nothing. */
+void *CreateLock(void);
+void TakeLock(void *Lock);
+void ReleaseLock(void *Lock);
+Boolean BindThreadToCpu(int Cpu);
+
+/* Kernel pipe used to forward raw mode data without copying it to user
+space */
+typedef struct
+{
+    int Fd[2];
+    Boolean Open;
+    /* Bytes held, and the most it may hold */
+    unsigned int Len;
+    unsigned int Size;
+}
+RawPipeType;
+
+Boolean OpenRawPipe(RawPipeType *P, unsigned int Size);
+void CloseRawPipe(RawPipeType *P);
+ssize_t ReadFromRawPipe(RawPipeType *P, void *buf, size_t count);
+ssize_t WriteToRawPipe(RawPipeType *P, const void *buf, size_t count);
+ssize_t SpliceFromDev(PORTHANDLE port, RawPipeType *P, size_t count);
+ssize_t SpliceToDev(PORTHANDLE port, RawPipeType *P, size_t count);
+ssize_t SpliceFromNet(SERCD_SOCKET sock, RawPipeType *P, size_t count);
+ssize_t SpliceToNet(SERCD_SOCKET sock, RawPipeType *P, size_t count, Boolean More);
 void LogPortSettings(unsigned long speed, unsigned char datasize, unsigned char parity,
 		     unsigned char stopsize, unsigned char outflow, unsigned char inflow);
 #endif /* SERCD_H */
@@ -0,0 +1,40 @@
+/*
+ * sercd arbitrary port speeds
+ * Copyright 2008 Peter Åstrand <astrand@cendio.se> for Cendio AB
+ * see file COPYING for license details
+ */
+
+#include "termios2.h"
+
+#ifdef HAVE_TERMIOS2
+#include <asm/termbits.h>
+#include <asm/ioctls.h>
+#include <sys/ioctl.h>
+
+int
+Termios2SetSpeed(int Fd, unsigned long Speed)
+{
+    struct termios2 Settings;
+
+    if (ioctl(Fd, TCGETS2, &Settings) != 0)
+	return -1;
+
+    /* BOTHER takes the speed from c_ospeed, no CIBAUD means the input
+       speed follows it */
+    Settings.c_cflag &= ~(CBAUD | CIBAUD);
+    Settings.c_cflag |= BOTHER;
+    Settings.c_ispeed = Speed;
+    Settings.c_ospeed = Speed;
+    return ioctl(Fd, TCSETSW2, &Settings);
+}
+
+unsigned long
+Termios2GetSpeed(int Fd)
+{
+    struct termios2 Settings;
+
+    if (ioctl(Fd, TCGETS2, &Settings) != 0)
+	return 0;
+    return Settings.c_ospeed;
+}
+#endif /* HAVE_TERMIOS2 */
@@ -0,0 +1,24 @@
+/*
+ * sercd arbitrary port speeds
+ * Copyright 2008 Peter Åstrand <astrand@cendio.se> for Cendio AB
+ * see file COPYING for license details
+ */
+
+#ifndef SERCD_TERMIOS2_H
+#define SERCD_TERMIOS2_H
+
+/* The Linux termios2 interface takes the speed as a plain number. Its
+   structure clashes with the one in <termios.h>, so it is kept in a
+   file of its own. */
+#if defined(__linux__) && defined(HAVE_ASM_TERMBITS_H)
+#define HAVE_TERMIOS2 1
+
+/* Set the input and output speed of Fd to Speed, after the output has
+   drained. Returns 0 on success, -1 with errno set otherwise. */
+int Termios2SetSpeed(int Fd, unsigned long Speed);
+
+/* Actual output speed of Fd, 0 if unknown */
+unsigned long Termios2GetSpeed(int Fd);
+#endif
+
+#endif /* SERCD_TERMIOS2_H */
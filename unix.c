@@ -7,6 +7,7 @@
 #ifndef WIN32
 #include "sercd.h"
 #include "unix.h"
+#include "termios2.h"
 
 #include <termios.h>
 #include <termio.h>
@@ -16,11 +17,58 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>		/* gettimeofday */
+#include <time.h>		/* clock_gettime */
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
+#include <stdarg.h>		/* va_list */
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/un.h>		/* struct sockaddr_un */
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_EPOLL_H)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <endian.h>
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#ifdef HAVE_LINUX_SERIAL_H
+#include <linux/serial.h>	/* struct serial_icounter_struct */
+#endif
+/* Speeds without a Bxxx constant are kept in the termios shadow as
+   CBAUDEX in c_cflag and the rate itself in c_ospeed */
+#if defined(HAVE_TERMIOS2) && defined(CBAUDEX) && defined(_HAVE_STRUCT_TERMIOS_C_OSPEED)
+#define HAVE_CUSTOM_SPEED 1
+#define CustomSpeed CBAUDEX
+#endif
+#ifdef HAVE_LIBPTHREAD
+#define HAVE_PORT_JOBS 1
+#include <pthread.h>
+#include <poll.h>
+#endif
+#if defined(HAVE_LIBPTHREAD) && defined(__GNUC__)
+#define HAVE_LOG_THREAD 1
+#define HAVE_REACTOR_THREADS 1
+/* State of the event loop running in a thread */
+#define ThreadLocal __thread
+#else
+#define ThreadLocal
+#endif
+#if defined(HAVE_REACTOR_THREADS) && defined(HAVE_SYS_EVENTFD_H) && defined(TIOCMIWAIT)
+#define HAVE_MODEM_WAIT 1
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#endif
 
 /* timeval macros */
 #ifndef timerisset
@@ -38,17 +86,173 @@
         ((tvp)->tv_sec = (tvp)->tv_usec = 0)
 #endif
 
-extern Boolean BreakSignaled;
-
 extern Boolean StdErrLogging;
 
-extern int MaxLogLevel;
+extern Boolean ForceSelect;
+extern Boolean UseUring;
+
+/* Backend of SercdSelectMany. Each event loop thread picks it from the
+   options with its first wait, and falls back on its own: the others
+   keep theirs, with the data their rings have read. */
+#define BackendNone 0
+#define BackendSelect 1
+#define BackendEpoll 2
+#define BackendUring 3
+static ThreadLocal int Backend = BackendNone;
+
+/* Descriptor interest and readiness, shared by the select, epoll and
+   io_uring backends of SercdSelectMany */
+typedef struct
+{
+    int Fd;
+    Boolean In;
+    Boolean Out;
+    Boolean Readable;
+    Boolean Writable;
+}
+PollEntry;
+
+#ifdef HAVE_IO_URING
+/* Read kept outstanding in the io_uring on a descriptor read through
+   ReadFromDev() or ReadFromNet(). Its data is handed out by the
+   following reads. */
+#define UringReadSize 4096
+#define UringIdle 0		/* No read outstanding */
+#define UringPending 1		/* Read submitted */
+#define UringReady 2		/* Result not yet handed out */
+typedef struct
+{
+    int Fd;			/* -1 once the descriptor is closed */
+    int State;
+    Boolean NeedPoll;		/* Reads of Fd do not wait for data */
+    int Result;			/* Bytes read, or -errno */
+    int Pos;			/* Bytes already handed out */
+    unsigned char Data[UringReadSize];
+}
+UringReadType;
+#endif
+
+/* Per-descriptor poller state, indexed by fd */
+typedef struct
+{
+    unsigned int Round;		/* Last SercdSelectMany round using this fd */
+    int Index;			/* Position in that round's poll set */
+    unsigned int EpollMask;	/* Registered epoll events, 0 if not registered */
+#ifdef HAVE_IO_URING
+    unsigned int UringPoll;	/* Events of the poll armed, 0 if none */
+    unsigned int UringGen;	/* Tells completions of earlier polls apart */
+    UringReadType *UringRead;	/* NULL if Fd is not read through the ring */
+#endif
+}
+PollSlot;
+
+/* Each event loop thread polls its own descriptors */
+static ThreadLocal PollSlot *PollSlots = NULL;
+static ThreadLocal int PollSlotsSize = 0;
+static ThreadLocal unsigned int PollRound = 0;
+
+/* Poll set of the current round */
+static ThreadLocal PollEntry *PollSet = NULL;
+static ThreadLocal int PollSetSize = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Persistent epoll instance, -1 if not yet created */
+static ThreadLocal int EpollFd = -1;
+
+/* Descriptors currently registered */
+static ThreadLocal int *EpollActive = NULL;
+static ThreadLocal int EpollActiveCount = 0;
+#endif
+
+#ifdef HAVE_IO_URING
+#define UringSqEntries 256
+#define UringCqEntries 4096
+
+/* The io_uring of the thread, mapped. Fd is -1 if not yet created. */
+typedef struct
+{
+    int Fd;
+    unsigned int *SqHead, *SqTail, *SqMask, *SqArray;
+    unsigned int *CqHead, *CqTail, *CqMask;
+    struct io_uring_sqe *Sqes;
+    struct io_uring_cqe *Cqes;
+}
+UringType;
+
+static ThreadLocal UringType Uring = { .Fd = -1 };
+
+/* The rings of all threads, whose requests are cancelled at exit */
+#define UringMaxRings 256
+static int UringRings[UringMaxRings];
+static int UringRingCount = 0;
+#endif
+
+#ifdef HAVE_MODEM_WAIT
+/* Modem line change notifier. A helper thread blocks in TIOCMIWAIT and
+   makes EventFd readable whenever DCD, RI, DSR or CTS change. This
+   costs a thread per open port, with a small stack, asleep in the
+   driver nearly all the time. */
+typedef struct
+{
+    int PortFd;
+    int EventFd;
+    pthread_t Thread;
+    int Stop;			/* Asks the thread to exit, atomic */
+    int Failed;			/* TIOCMIWAIT failed, poll instead, atomic */
+    int Lines;			/* Last TIOCMGET reading, -1 if none, atomic */
+}
+ModemWaitType;
+#endif
+
+/* Per-port state, indexed by device fd */
+typedef struct
+{
+    Boolean Open;
+    /* Initial serial port settings, restored on close */
+    struct termios InitialSettings;
+    /* Shadow of the current settings, refreshed after each change. It
+       already includes changes still being applied by port jobs. */
+    struct termios Settings;
+    /* Port jobs submitted and not yet collected, and the number of
+       times the port was closed: jobs submitted before a close no
+       longer count when they finish. Atomic, as the number may be
+       reused by another thread once a worker closes the port. */
+    int Jobs;
+    unsigned int Closes;
+    /* Device the port was opened from, the caller's */
+    const char *DeviceName;
+    /* Changes staged to be applied together, when Staged is set */
+    Boolean Staged;
+    struct termios Pending;
+#ifdef HAVE_MODEM_WAIT
+    /* Modem line notifier, NULL when polling */
+    ModemWaitType *ModemWait;
+#endif
+}
+UnixPortType;
+
+/* Per-port state is kept in chunks that never move, so that event
+   loop threads can use their ports while another adds a chunk */
+#define UnixPortChunkSize 256
+#define UnixPortChunks 4096
+static UnixPortType *UnixPorts[UnixPortChunks];
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t UnixPortsLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-static struct timeval LastPoll = { 0, 0 };
+static void PollForget(int Fd);
+static UnixPortType *GetUnixPort(PORTHANDLE PortFd);
+#ifdef HAVE_MODEM_WAIT
+static void StopModemWait(UnixPortType * Port);
+#endif
 
-/* Initial serial port settings */
-static struct termios *InitialPortSettings;
-static struct termios initialportsettings;
+/* Port changes that may block, run by worker threads if possible */
+#define PortJobSettings 0
+#define PortJobBreak 1
+#define PortJobFlush 2
+#define PortJobModem 3
+#define PortJobClose 4
+static Boolean SubmitPortJob(PORTHANDLE PortFd, int Kind, int Arg, const struct termios *Settings);
 
 /* Locking constants */
 #define LockOk 0
@@ -59,19 +263,10 @@ static struct termios initialportsettings;
 #define LockFileMode 0644
 #define HDBHeaderLen 11
 
-/* Convert termios speed to tncom speed */
+/* Convert a termios speed constant to bits per second, 0 if unknown */
 static unsigned long int
-Termios2TncomSpeed(struct termios *ti)
+TermiosSpeedRate(speed_t ospeed)
 {
-    speed_t ispeed, ospeed;
-
-    ispeed = cfgetispeed(ti);
-    ospeed = cfgetospeed(ti);
-
-    if (ispeed != ospeed) {
-	LogMsg(LOG_WARNING, "warning: different input and output speed, using output speed");
-    }
-
     switch (ospeed) {
     case B50:
 	return (50UL);
@@ -116,9 +311,66 @@ Termios2TncomSpeed(struct termios *ti)
     }
 }
 
+/* Convert termios speed to tncom speed */
+static unsigned long int
+Termios2TncomSpeed(const struct termios *ti)
+{
+    speed_t ispeed, ospeed;
+
+    ispeed = cfgetispeed(ti);
+    ospeed = cfgetospeed(ti);
+
+    if (ispeed != ospeed) {
+	LogMsg(LOG_WARNING, "warning: different input and output speed, using output speed");
+    }
+
+#ifdef HAVE_CUSTOM_SPEED
+    if (ospeed == CustomSpeed)
+	return ti->c_ospeed;
+#endif
+    return TermiosSpeedRate(ospeed);
+}
+
+/* Read the port settings, with any speed the constants cannot express
+   filled in from the driver */
+static int
+PortGetAttr(PORTHANDLE PortFd, struct termios *ti)
+{
+#ifdef HAVE_CUSTOM_SPEED
+    unsigned long Rate;
+#endif
+
+    if (tcgetattr(PortFd, ti) != 0)
+	return -1;
+#ifdef HAVE_CUSTOM_SPEED
+    if (cfgetospeed(ti) == CustomSpeed || TermiosSpeedRate(cfgetospeed(ti)) == 0) {
+	Rate = Termios2GetSpeed(PortFd);
+	if (Rate != 0) {
+	    ti->c_cflag = (ti->c_cflag & ~CBAUD) | CustomSpeed;
+	    ti->c_ispeed = ti->c_ospeed = Rate;
+	}
+    }
+#endif
+    return 0;
+}
+
+/* Write the port settings. A custom speed is applied afterwards through
+   termios2, which the plain interface cannot carry. */
+static int
+PortSetAttr(PORTHANDLE PortFd, int When, const struct termios *ti)
+{
+    if (tcsetattr(PortFd, When, ti) != 0)
+	return -1;
+#ifdef HAVE_CUSTOM_SPEED
+    if (cfgetospeed(ti) == CustomSpeed)
+	return Termios2SetSpeed(PortFd, ti->c_ospeed);
+#endif
+    return 0;
+}
+
 /* Convert termios data size to tncom size */
 static unsigned char
-Termios2TncomDataSize(struct termios *ti)
+Termios2TncomDataSize(const struct termios *ti)
 {
     tcflag_t DataSize;
     DataSize = ti->c_cflag & CSIZE;
@@ -139,7 +391,7 @@ Termios2TncomDataSize(struct termios *ti)
 
 /* Convert termios parity to tncom parity */
 static unsigned char
-Termios2TncomParity(struct termios *ti)
+Termios2TncomParity(const struct termios *ti)
 {
     if ((ti->c_cflag & PARENB) == 0)
 	return TNCOM_NOPARITY;
@@ -152,7 +404,7 @@ Termios2TncomParity(struct termios *ti)
 
 /* Convert termios stop size to tncom size */
 static unsigned char
-Termios2TncomStopSize(struct termios *ti)
+Termios2TncomStopSize(const struct termios *ti)
 {
     if ((ti->c_cflag & CSTOPB) == 0)
 	return TNCOM_ONESTOPBIT;
@@ -162,7 +414,7 @@ Termios2TncomStopSize(struct termios *ti)
 
 /* Convert termios output flow control to tncom flow */
 static unsigned char
-Termios2TncomOutFlow(struct termios *ti)
+Termios2TncomOutFlow(const struct termios *ti)
 {
     if (ti->c_iflag & IXON)
 	return TNCOM_CMD_FLOW_XONXOFF;
@@ -173,7 +425,7 @@ Termios2TncomOutFlow(struct termios *ti)
 
 /* Convert termios input flow control to tncom flow */
 static unsigned char
-Termios2TncomInFlow(struct termios *ti)
+Termios2TncomInFlow(const struct termios *ti)
 {
     if (ti->c_iflag & IXOFF)
 	return TNCOM_CMD_INFLOW_XONXOFF;
@@ -183,7 +435,7 @@ Termios2TncomInFlow(struct termios *ti)
 }
 
 static void
-UnixLogPortSettings(struct termios *ti)
+UnixLogPortSettings(const struct termios *ti)
 {
     unsigned long speed;
     unsigned char datasize;
@@ -201,14 +453,83 @@ UnixLogPortSettings(struct termios *ti)
     LogPortSettings(speed, datasize, parity, stopsize, outflow, inflow);
 }
 
+/* Current settings of a port. Open ports are answered from the shadow
+   copy, anything else from the device into Tmp. */
+static const struct termios *
+PortTermios(PORTHANDLE PortFd, struct termios *Tmp)
+{
+    UnixPortType *Port = GetUnixPort(PortFd);
+
+    if (Port && Port->Open)
+	return Port->Staged ? &Port->Pending : &Port->Settings;
+    PortGetAttr(PortFd, Tmp);
+    return Tmp;
+}
+
+/* Reload the shadow copy of the port settings from the device */
+static void
+ResyncPortTermios(PORTHANDLE PortFd)
+{
+    UnixPortType *Port = GetUnixPort(PortFd);
+
+    if (Port && Port->Open && PortGetAttr(PortFd, &Port->Settings) != 0)
+	Port->Settings = Port->InitialSettings;
+}
+
+/* Write new port settings, or stage them. TCSADRAIN waits for the
+   output to drain, so a worker does it if possible. The shadow copy is
+   read back, since the driver may not accept all of them. */
+static void
+SetPortTermios(PORTHANDLE PortFd, struct termios *PortSettings)
+{
+    UnixPortType *Port = GetUnixPort(PortFd);
+
+    if (Port && Port->Open && Port->Staged) {
+	Port->Pending = *PortSettings;
+	return;
+    }
+    if (Port && Port->Open && SubmitPortJob(PortFd, PortJobSettings, 0, PortSettings)) {
+	Port->Settings = *PortSettings;
+	return;
+    }
+    PortSetAttr(PortFd, TCSADRAIN, PortSettings);
+    ResyncPortTermios(PortFd);
+    UnixLogPortSettings(PortTermios(PortFd, PortSettings));
+}
+
+/* Stage the following port setting changes instead of applying them,
+   so that a series of them costs a single tcsetattr() */
+void
+StagePortSettings(PORTHANDLE PortFd)
+{
+    UnixPortType *Port = GetUnixPort(PortFd);
+
+    if (Port && Port->Open && !Port->Staged) {
+	Port->Pending = Port->Settings;
+	Port->Staged = True;
+    }
+}
+
+/* Apply the staged port setting changes, if they change anything */
+void
+CommitPortSettings(PORTHANDLE PortFd)
+{
+    UnixPortType *Port = GetUnixPort(PortFd);
+
+    if (!Port || !Port->Open || !Port->Staged)
+	return;
+    Port->Staged = False;
+    if (memcmp(&Port->Pending, &Port->Settings, sizeof(Port->Settings)) != 0)
+	SetPortTermios(PortFd, &Port->Pending);
+}
+
 /* Retrieves the port speed from PortFd */
 unsigned long int
 GetPortSpeed(PORTHANDLE PortFd)
 {
     struct termios PortSettings;
 
-    tcgetattr(PortFd, &PortSettings);
-    return Termios2TncomSpeed(&PortSettings);
+    return Termios2TncomSpeed(PortTermios(PortFd, &PortSettings));
 }
 
 /* Retrieves the data size from PortFd */
@@ -217,8 +538,7 @@ GetPortDataSize(PORTHANDLE PortFd)
 {
     struct termios PortSettings;
 
-    tcgetattr(PortFd, &PortSettings);
-    return Termios2TncomDataSize(&PortSettings);
+    return Termios2TncomDataSize(PortTermios(PortFd, &PortSettings));
 }
 
 /* Retrieves the parity settings from PortFd */
@@ -227,8 +547,7 @@ GetPortParity(PORTHANDLE PortFd)
 {
     struct termios PortSettings;
 
-    tcgetattr(PortFd, &PortSettings);
-    return Termios2TncomParity(&PortSettings);
+    return Termios2TncomParity(PortTermios(PortFd, &PortSettings));
 }
 
 /* Retrieves the stop bits size from PortFd */
@@ -237,8 +556,7 @@ GetPortStopSize(PORTHANDLE PortFd)
 {
     struct termios PortSettings;
 
-    tcgetattr(PortFd, &PortSettings);
-    return Termios2TncomStopSize(&PortSettings);
+    return Termios2TncomStopSize(PortTermios(PortFd, &PortSettings));
 }
 
 /* Retrieves the flow control status, including DTR and RTS status,
@@ -247,16 +565,14 @@ unsigned char
 GetPortFlowControl(PORTHANDLE PortFd, unsigned char Which)
 {
     struct termios PortSettings;
-    int MLines;
-
-    /* Gets the basic informations from the port */
-    tcgetattr(PortFd, &PortSettings);
-    ioctl(PortFd, TIOCMGET, &MLines);
+    int MLines = 0;
 
-    /* Check wich kind of information is requested */
+    /* Check wich kind of information is requested. The modem lines
+       are inputs, so they are read from the device every time. */
     switch (Which) {
 	/* DTR Signal State */
     case TNCOM_CMD_DTR_REQ:
+	ioctl(PortFd, TIOCMGET, &MLines);
 	/* See comment below. */
 	if (MLines & TIOCM_DSR)
 	    return TNCOM_CMD_DTR_ON;
@@ -266,6 +582,7 @@ GetPortFlowControl(PORTHANDLE PortFd, unsigned char Which)
 
 	/* RTS Signal State */
     case TNCOM_CMD_RTS_REQ:
+	ioctl(PortFd, TIOCMGET, &MLines);
 	/* Note: RFC2217 mentions RTS but never CTS. Since RTS is an
 	   output signal, it doesn't make sense to return it's status,
 	   especially if this means we cannot return the CTS
@@ -279,26 +596,24 @@ GetPortFlowControl(PORTHANDLE PortFd, unsigned char Which)
 
 	/* Com Port Flow Control Setting (inbound) */
     case TNCOM_CMD_INFLOW_REQ:
-	return Termios2TncomInFlow(&PortSettings);
+	return Termios2TncomInFlow(PortTermios(PortFd, &PortSettings));
 	break;
 
 	/* Com Port Flow Control Setting (outbound/both) */
     case TNCOM_CMD_FLOW_REQ:
     default:
-	return Termios2TncomOutFlow(&PortSettings);
+	return Termios2TncomOutFlow(PortTermios(PortFd, &PortSettings));
 	break;
     }
 }
 
-/* Return the status of the modem control lines (DCD, CTS, DSR, RNG) */
-unsigned char
-GetModemState(PORTHANDLE PortFd, unsigned char PMState)
+/* Convert TIOCMGET modem lines to tncom modem state, with the changes
+   from PMState */
+static unsigned char
+ModemLinesState(int MLines, unsigned char PMState)
 {
-    int MLines;
     unsigned char MState = (unsigned char) 0;
 
-    ioctl(PortFd, TIOCMGET, &MLines);
-
     if ((MLines & TIOCM_CAR) != 0)
 	MState += TNCOM_MODMASK_RLSD;
     if ((MLines & TIOCM_RNG) != 0)
@@ -319,6 +634,37 @@ GetModemState(PORTHANDLE PortFd, unsigned char PMState)
     return (MState);
 }
 
+/* Return the status of the modem control lines (DCD, CTS, DSR, RNG) */
+unsigned char
+GetModemState(PORTHANDLE PortFd, unsigned char PMState)
+{
+    int MLines = 0;
+
+    ioctl(PortFd, TIOCMGET, &MLines);
+    return ModemLinesState(MLines, PMState);
+}
+
+/* Read the line error counters of the driver. Returns False if it
+   keeps none. */
+Boolean
+GetLineCounts(PORTHANDLE PortFd, LineCountType * Counts)
+{
+#if defined(HAVE_LINUX_SERIAL_H) && defined(TIOCGICOUNT)
+    struct serial_icounter_struct Icount;
+
+    if (ioctl(PortFd, TIOCGICOUNT, &Icount) != 0)
+	return False;
+    Counts->Overrun = Icount.overrun;
+    Counts->BufOverrun = Icount.buf_overrun;
+    Counts->Parity = Icount.parity;
+    Counts->Frame = Icount.frame;
+    Counts->Break = Icount.brk;
+    return True;
+#else
+    return False;
+#endif
+}
+
 /* Set the serial port data size */
 void
 SetPortDataSize(PORTHANDLE PortFd, unsigned char DataSize)
@@ -344,11 +690,10 @@ SetPortDataSize(PORTHANDLE PortFd, unsigned char DataSize)
 	break;
     }
 
-    tcgetattr(PortFd, &PortSettings);
+    PortSettings = *PortTermios(PortFd, &PortSettings);
     PortSettings.c_cflag &= ~CSIZE;
     PortSettings.c_cflag |= PDataSize & CSIZE;
-    tcsetattr(PortFd, TCSADRAIN, &PortSettings);
-    UnixLogPortSettings(&PortSettings);
+    SetPortTermios(PortFd, &PortSettings);
 }
 
 /* Set the serial port parity */
@@ -357,7 +702,7 @@ SetPortParity(PORTHANDLE PortFd, unsigned char Parity)
 {
     struct termios PortSettings;
 
-    tcgetattr(PortFd, &PortSettings);
+    PortSettings = *PortTermios(PortFd, &PortSettings);
 
     switch (Parity) {
     case TNCOM_NOPARITY:
@@ -376,8 +721,7 @@ SetPortParity(PORTHANDLE PortFd, unsigned char Parity)
 	break;
     }
 
-    tcsetattr(PortFd, TCSADRAIN, &PortSettings);
-    UnixLogPortSettings(&PortSettings);
+    SetPortTermios(PortFd, &PortSettings);
 }
 
 /* Set the serial port stop bits size */
@@ -386,7 +730,7 @@ SetPortStopSize(PORTHANDLE PortFd, unsigned char StopSize)
 {
     struct termios PortSettings;
 
-    tcgetattr(PortFd, &PortSettings);
+    PortSettings = *PortTermios(PortFd, &PortSettings);
 
     switch (StopSize) {
     case TNCOM_ONESTOPBIT:
@@ -404,8 +748,7 @@ SetPortStopSize(PORTHANDLE PortFd, unsigned char StopSize)
 	break;
     }
 
-    tcsetattr(PortFd, TCSADRAIN, &PortSettings);
-    UnixLogPortSettings(&PortSettings);
+    SetPortTermios(PortFd, &PortSettings);
 }
 
 /* Set the port flow control and DTR and RTS status */
@@ -413,11 +756,10 @@ void
 SetPortFlowControl(PORTHANDLE PortFd, unsigned char How)
 {
     struct termios PortSettings;
-    int MLines;
+    int MSet = 0, MClear = 0;
 
     /* Gets the base status from the port */
-    tcgetattr(PortFd, &PortSettings);
-    ioctl(PortFd, TIOCMGET, &MLines);
+    PortSettings = *PortTermios(PortFd, &PortSettings);
 
     /* Check which settings to change */
     switch (How) {
@@ -441,19 +783,19 @@ SetPortFlowControl(PORTHANDLE PortFd, unsigned char How)
 	break;
 	/* DTR Signal State ON */
     case TNCOM_CMD_DTR_ON:
-	MLines = MLines | TIOCM_DTR;
+	MSet = TIOCM_DTR;
 	break;
 	/* DTR Signal State OFF */
     case TNCOM_CMD_DTR_OFF:
-	MLines = MLines & ~TIOCM_DTR;
+	MClear = TIOCM_DTR;
 	break;
 	/* RTS Signal State ON */
     case TNCOM_CMD_RTS_ON:
-	MLines = MLines | TIOCM_RTS;
+	MSet = TIOCM_RTS;
 	break;
 	/* RTS Signal State OFF */
     case TNCOM_CMD_RTS_OFF:
-	MLines = MLines & ~TIOCM_RTS;
+	MClear = TIOCM_RTS;
 	break;
 
 	/* INBOUND FLOW CONTROL is ignored */
@@ -480,9 +822,19 @@ SetPortFlowControl(PORTHANDLE PortFd, unsigned char How)
 	break;
     }
 
-    tcsetattr(PortFd, TCSADRAIN, &PortSettings);
-    ioctl(PortFd, TIOCMSET, &MLines);
-    UnixLogPortSettings(&PortSettings);
+    /* Only the lines being changed are touched, without reading the
+       others first. This goes through the port jobs too, so that it
+       happens after any settings change still being applied. */
+    if (MSet) {
+	if (!SubmitPortJob(PortFd, PortJobModem, MSet, NULL))
+	    ioctl(PortFd, TIOCMBIS, &MSet);
+    }
+    else if (MClear) {
+	if (!SubmitPortJob(PortFd, PortJobModem, -MClear, NULL))
+	    ioctl(PortFd, TIOCMBIC, &MClear);
+    }
+    else
+	SetPortTermios(PortFd, &PortSettings);
 }
 
 /* Set the serial port speed */
@@ -551,22 +903,29 @@ SetPortSpeed(PORTHANDLE PortFd, unsigned long BaudRate)
 	Speed = B460800;
 	break;
     default:
+#ifdef HAVE_CUSTOM_SPEED
+	Speed = CustomSpeed;
+#else
 	LogMsg(LOG_WARNING, "Unknwon baud rate requested, setting to 9600.");
 	Speed = B9600;
+#endif
 	break;
     }
 
-    tcgetattr(PortFd, &PortSettings);
+    PortSettings = *PortTermios(PortFd, &PortSettings);
     cfsetospeed(&PortSettings, Speed);
     cfsetispeed(&PortSettings, Speed);
-    tcsetattr(PortFd, TCSADRAIN, &PortSettings);
-    UnixLogPortSettings(&PortSettings);
+#ifdef HAVE_CUSTOM_SPEED
+    if (Speed == CustomSpeed)
+	PortSettings.c_ispeed = PortSettings.c_ospeed = BaudRate;
+#endif
+    SetPortTermios(PortFd, &PortSettings);
 }
 
 void
 SetBreak(PORTHANDLE PortFd, Boolean on)
 {
-    if (on) {
+    if (on && !SubmitPortJob(PortFd, PortJobBreak, 0, NULL)) {
 	tcsendbreak(PortFd, 0);
     }
 }
@@ -574,20 +933,28 @@ SetBreak(PORTHANDLE PortFd, Boolean on)
 void
 SetFlush(PORTHANDLE PortFd, int selector)
 {
+    int Queue;
+
     switch (selector) {
 	/* Inbound flush */
     case TNCOM_PURGE_RX:
-	tcflush(PortFd, TCIFLUSH);
+	Queue = TCIFLUSH;
 	break;
 	/* Outbound flush */
     case TNCOM_PURGE_TX:
-	tcflush(PortFd, TCOFLUSH);
+	Queue = TCOFLUSH;
 	break;
 	/* Inbound/outbound flush */
     case TNCOM_PURGE_BOTH:
-	tcflush(PortFd, TCIOFLUSH);
+	Queue = TCIOFLUSH;
 	break;
+    default:
+	return;
     }
+
+    /* Queued behind any other change of the port */
+    if (!SubmitPortJob(PortFd, PortJobFlush, Queue, NULL))
+	tcflush(PortFd, Queue);
 }
 
 /* Try to lock the file given in LockFile as pid LockPid using the classical
@@ -599,7 +966,6 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
     int FileDes;
     int N;
     char HDBBuffer[HDBHeaderLen + 1];
-    char LogStr[TmpStrLen];
 
     /* Try to create the lock file */
     while ((FileDes = open(LockFile, O_CREAT | O_WRONLY | O_EXCL, LockFileMode)) == OpenError) {
@@ -614,9 +980,7 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
 	    if (N <= 0) {
 		/* Emtpy lock file or error: may be another application
 		   was writing its pid in it */
-		snprintf(LogStr, sizeof(LogStr), "Can't read pid from lock file %s.", LockFile);
-		LogStr[sizeof(LogStr) - 1] = '\0';
-		LogMsg(LOG_NOTICE, LogStr);
+		LogMsg(LOG_NOTICE, "Can't read pid from lock file %s.", LockFile);
 
 		/* Lock process failed */
 		return (LockKo);
@@ -629,9 +993,7 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
 	    /* Check if it is our pid */
 	    if (Pid == LockPid) {
 		/* File already locked by us */
-		snprintf(LogStr, sizeof(LogStr), "Read our pid from lock %s.", LockFile);
-		LogStr[sizeof(LogStr) - 1] = '\0';
-		LogMsg(LOG_DEBUG, LogStr);
+		LogMsg(LOG_DEBUG, "Read our pid from lock %s.", LockFile);
 
 		/* Lock process succeded */
 		return (LockOk);
@@ -642,23 +1004,15 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
 	    if ((Pid == 0) || ((kill(Pid, 0) != 0) && (errno == ESRCH)))
 		/* Invalid lock, remove it */
 		if (unlink(LockFile) == NoError) {
-		    snprintf(LogStr, sizeof(LogStr),
-			     "Removed stale lock %s (pid %d).", LockFile, Pid);
-		    LogStr[sizeof(LogStr) - 1] = '\0';
-		    LogMsg(LOG_NOTICE, LogStr);
+		    LogMsg(LOG_NOTICE, "Removed stale lock %s (pid %d).", LockFile, Pid);
 		}
 		else {
-		    snprintf(LogStr, sizeof(LogStr),
-			     "Couldn't remove stale lock %s (pid %d).", LockFile, Pid);
-		    LogStr[sizeof(LogStr) - 1] = '\0';
-		    LogMsg(LOG_ERR, LogStr);
+		    LogMsg(LOG_ERR, "Couldn't remove stale lock %s (pid %d).", LockFile, Pid);
 		    return (LockKo);
 		}
 	    else {
 		/* The lock file is owned by another valid process */
-		snprintf(LogStr, sizeof(LogStr), "Lock %s is owned by pid %d.", LockFile, Pid);
-		LogStr[sizeof(LogStr) - 1] = '\0';
-		LogMsg(LOG_INFO, LogStr);
+		LogMsg(LOG_INFO, "Lock %s is owned by pid %d.", LockFile, Pid);
 
 		/* Lock process failed */
 		return (Locked);
@@ -666,9 +1020,7 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
 	}
 	else {
 	    /* Lock file creation problem */
-	    snprintf(LogStr, sizeof(LogStr), "Can't create lock file %s.", LockFile);
-	    LogStr[sizeof(LogStr) - 1] = '\0';
-	    LogMsg(LOG_ERR, LogStr);
+	    LogMsg(LOG_ERR, "Can't create lock file %s.", LockFile);
 
 	    /* Lock process failed */
 	    return (LockKo);
@@ -677,15 +1029,13 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
 
     /* Prepare the HDB buffer with our pid */
     snprintf(HDBBuffer, sizeof(HDBBuffer), "%10d\n", (int) LockPid);
-    LogStr[sizeof(HDBBuffer) - 1] = '\0';
+    HDBBuffer[sizeof(HDBBuffer) - 1] = '\0';
 
     /* Fill the lock file with the HDB buffer */
     if (write(FileDes, HDBBuffer, HDBHeaderLen) != HDBHeaderLen) {
 	/* Lock file creation problem, remove it */
 	close(FileDes);
-	snprintf(LogStr, sizeof(LogStr), "Can't write HDB header to lock file %s.", LockFile);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_ERR, LogStr);
+	LogMsg(LOG_ERR, "Can't write HDB header to lock file %s.", LockFile);
 	unlink(LockFile);
 
 	/* Lock process failed */
@@ -703,213 +1053,1859 @@ HDBLockFile(const char *LockFile, pid_t LockPid)
 static void
 HDBUnlockFile(const char *LockFile, pid_t LockPid)
 {
-    char LogStr[TmpStrLen];
-
     /* Check if the lock file is still owned by us */
     if (HDBLockFile(LockFile, LockPid) == LockOk) {
 	/* Remove the lock file */
 	unlink(LockFile);
-	snprintf(LogStr, sizeof(LogStr), "Unlocked lock file %s.", LockFile);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_NOTICE, LogStr);
+	LogMsg(LOG_NOTICE, "Unlocked lock file %s.", LockFile);
     }
 }
 
-int
-OpenPort(const char *DeviceName, const char *LockFileName, PORTHANDLE * PortFd)
+/* Return the per-port state for PortFd, growing the table as needed */
+static UnixPortType *
+GetUnixPort(PORTHANDLE PortFd)
 {
-    char LogStr[TmpStrLen];
-    /* Actual port settings */
-    struct termios PortSettings;
+    UnixPortType *Chunk;
+    int i = PortFd / UnixPortChunkSize;
+
+    if (PortFd < 0 || i >= UnixPortChunks)
+	return NULL;
+
+#ifdef HAVE_LIBPTHREAD
+    Chunk = __atomic_load_n(&UnixPorts[i], __ATOMIC_ACQUIRE);
+    if (!Chunk) {
+	pthread_mutex_lock(&UnixPortsLock);
+	Chunk = UnixPorts[i];
+	if (!Chunk && (Chunk = calloc(UnixPortChunkSize, sizeof(*Chunk))))
+	    __atomic_store_n(&UnixPorts[i], Chunk, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&UnixPortsLock);
+    }
+#else
+    Chunk = UnixPorts[i];
+    if (!Chunk)
+	Chunk = UnixPorts[i] = calloc(UnixPortChunkSize, sizeof(*Chunk));
+#endif
+    return Chunk ? &Chunk[PortFd % UnixPortChunkSize] : NULL;
+}
 
-    /* Try to lock the device */
-    if (HDBLockFile(LockFileName, getpid()) != LockOk) {
-	/* Lock failed */
-	snprintf(LogStr, sizeof(LogStr), "Unable to lock %s. Exiting.", LockFileName);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_NOTICE, LogStr);
-	return (Error);
+#ifdef HAVE_MODEM_WAIT
+/* Stack of a notifier thread, which only waits in the driver */
+#define ModemWaitStackSize (64 * 1024)
+
+/* Where a notifier thread goes when asked to stop, and whether it may
+   go there: only from around TIOCMIWAIT, which holds no locks */
+static ThreadLocal sigjmp_buf ModemWaitStop;
+static ThreadLocal volatile sig_atomic_t ModemWaiting = 0;
+
+/* Sent by StopModemWait to get the notifier out of TIOCMIWAIT */
+static void
+ModemWaitSignal(int unused)
+{
+    unused = unused;
+    if (ModemWaiting) {
+	ModemWaiting = 0;
+	siglongjmp(ModemWaitStop, 1);
     }
-    else {
-	/* Lock succeeded */
-	snprintf(LogStr, sizeof(LogStr), "Device %s locked.", DeviceName);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_INFO, LogStr);
+}
+
+static void *
+ModemWaitThread(void *Arg)
+{
+    ModemWaitType *M = Arg;
+    uint64_t One = 1;
+    sigset_t Set;
+    int ret, Lines;
+
+    if (sigsetjmp(ModemWaitStop, 1))
+	return NULL;
+
+    sigemptyset(&Set);
+    sigaddset(&Set, SIGUSR2);
+    pthread_sigmask(SIG_UNBLOCK, &Set, NULL);
+
+    while (True) {
+	/* Kept for the metrics, so that they need not ask the driver */
+	if (ioctl(M->PortFd, TIOCMGET, &Lines) == 0)
+	    __atomic_store_n(&M->Lines, Lines, __ATOMIC_RELAXED);
+
+	/* The signal of StopModemWait either finds ModemWaiting set, or
+	   comes before it and Stop is seen here */
+	ModemWaiting = 1;
+	if (__atomic_load_n(&M->Stop, __ATOMIC_SEQ_CST))
+	    break;
+	ret = ioctl(M->PortFd, TIOCMIWAIT, TIOCM_CAR | TIOCM_RNG | TIOCM_DSR | TIOCM_CTS);
+	ModemWaiting = 0;
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    /* Not supported by the driver, let the main loop poll */
+	    __atomic_store_n(&M->Failed, 1, __ATOMIC_RELEASE);
+	}
+	if (write(M->EventFd, &One, sizeof(One)) < 0 || ret < 0)
+	    break;
     }
 
-    /* Open the device */
-    if ((*PortFd = open(DeviceName, O_RDWR | O_NOCTTY | O_NONBLOCK, 0)) == OpenError) {
-	return (Error);
+    ModemWaiting = 0;
+    return NULL;
+}
+
+/* Start the modem line notifier of an open port. Returns False if
+   modem lines must be polled instead. */
+static Boolean
+StartModemWait(UnixPortType * Port, PORTHANDLE PortFd)
+{
+    ModemWaitType *M;
+    pthread_attr_t Attr;
+    sigset_t All, Old;
+    uint64_t One = 1;
+    int ret;
+
+    M = calloc(1, sizeof(*M));
+    if (!M)
+	return False;
+    M->PortFd = PortFd;
+    M->Lines = -1;
+    M->EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (M->EventFd < 0) {
+	free(M);
+	return False;
     }
 
-    /* Get the actual port settings */
-    InitialPortSettings = &initialportsettings;
-    tcgetattr(*PortFd, InitialPortSettings);
-    tcgetattr(*PortFd, &PortSettings);
-    UnixLogPortSettings(&PortSettings);
+    /* Signals are left to the main thread */
+    pthread_attr_init(&Attr);
+    pthread_attr_setstacksize(&Attr, ModemWaitStackSize);
+    sigfillset(&All);
+    pthread_sigmask(SIG_BLOCK, &All, &Old);
+    ret = pthread_create(&M->Thread, &Attr, ModemWaitThread, M);
+    pthread_sigmask(SIG_SETMASK, &Old, NULL);
+    pthread_attr_destroy(&Attr);
+    if (ret != 0) {
+	close(M->EventFd);
+	free(M);
+	return False;
+    }
 
-    /* Set the serial port to raw mode */
-    cfmakeraw(&PortSettings);
+    /* Report the initial modem state right away. A new eventfd has
+       room for it, so failing means it cannot be used at all. */
+    Port->ModemWait = M;
+    if (write(M->EventFd, &One, sizeof(One)) < 0) {
+	StopModemWait(Port);
+	return False;
+    }
+    return True;
+}
 
-    /* Enable HANGUP on close and disable modem control line handling */
-    PortSettings.c_cflag = (PortSettings.c_cflag | HUPCL) | CLOCAL;
+/* Stop the modem line notifier of a port, if any */
+static void
+StopModemWait(UnixPortType * Port)
+{
+    ModemWaitType *M = Port->ModemWait;
 
-    /* Enable break handling */
-    PortSettings.c_iflag = (PortSettings.c_iflag & ~IGNBRK) | BRKINT;
+    if (!M)
+	return;
 
-    /* Write the port settings to device */
-    tcsetattr(*PortFd, TCSANOW, &PortSettings);
+    __atomic_store_n(&M->Stop, 1, __ATOMIC_SEQ_CST);
+    pthread_kill(M->Thread, SIGUSR2);
+    pthread_join(M->Thread, NULL);
 
-    return NoError;
+    PollForget(M->EventFd);
+    close(M->EventFd);
+    free(M);
+    Port->ModemWait = NULL;
 }
+#endif /* HAVE_MODEM_WAIT */
 
-void
-ClosePort(PORTHANDLE PortFd, const char *LockFileName)
-{
-    /* Restores initial port settings */
-    if (InitialPortSettings)
-	tcsetattr(PortFd, TCSANOW, InitialPortSettings);
+#ifdef HAVE_PORT_JOBS
+/* Number of worker threads for port jobs */
+#define PortWorkers 4
 
-    /* Closes the device */
-    close(PortFd);
+/* Finished jobs of the event loop thread that submitted them */
+typedef struct
+{
+    struct PortJobStruct *Done;	/* Protected by PortJobLock */
+    int Pipe[2];		/* Made readable when jobs finish, -1 until first used */
+    int Outstanding;		/* Jobs submitted and not yet collected */
+}
+PortJobSinkType;
 
-    /* Removes the lock file */
-    HDBUnlockFile(LockFileName, getpid());
+/* A device being closed by a worker. It is not opened again until
+   then, so the close cannot reset or unlock the new session's port. */
+typedef struct PortCloseStruct
+{
+    struct PortCloseStruct *Next;
+    char *DeviceName;
+}
+PortCloseType;
 
-    /* Closes the log */
-    if (!StdErrLogging) {
-	closelog();
-    }
+/* A port change run by a worker thread */
+typedef struct PortJobStruct
+{
+    struct PortJobStruct *Next;
+    PortJobSinkType *Sink;
+    int PortFd;
+    unsigned int Closes;	/* Closes of the port when submitted */
+    int Kind;
+    int Arg;			/* Flush queue, or modem lines to set (negative: clear) */
+    struct termios Settings;	/* Settings to apply, then those in effect */
+    char *LockFileName;		/* Lock removed once closed */
+    PortCloseType *Close;	/* Record of the close, removed once done */
 }
+PortJobType;
 
-/* Function called on many signals */
+/* Jobs waiting and finished, oldest first, protected by PortJobLock.
+   Jobs of one port run one at a time, in order. */
+static pthread_mutex_t PortJobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t PortJobReady = PTHREAD_COND_INITIALIZER;
+static PortJobType *PortJobQueue = NULL;
+static PortCloseType *PortCloses = NULL;
+static int PortJobRunning[PortWorkers];
+
+/* Jobs finished for this thread */
+static ThreadLocal PortJobSinkType PortJobSink = { NULL, {-1, -1}, 0 };
+
+/* Append a job to a list */
 static void
-SignalFunction(int unused)
+AppendPortJob(PortJobType ** List, PortJobType * J)
 {
-    /* Just to avoid compilation warnings */
-    /* There's no performance penalty in doing this 
-       because this function is almost never called */
-    unused = unused;
-
-    /* Same as the exit function */
-    ExitFunction();
+    while (*List)
+	List = &(*List)->Next;
+    J->Next = NULL;
+    *List = J;
 }
 
-void
-PlatformInit()
+static void
+RunPortJob(PortJobType * J)
 {
-    if (!StdErrLogging) {
-	openlog("sercd", LOG_PID, LOG_USER);
-    }
-
-    /* Register exit and signal handler functions */
-    atexit(ExitFunction);
-    signal(SIGHUP, SignalFunction);
-    signal(SIGQUIT, SignalFunction);
-    signal(SIGABRT, SignalFunction);
-    signal(SIGTERM, SignalFunction);
+    int Lines;
 
-    /* Register the function to be called on break condition */
-    signal(SIGINT, BreakFunction);
+    switch (J->Kind) {
+    case PortJobSettings:
+	PortSetAttr(J->PortFd, TCSADRAIN, &J->Settings);
+	PortGetAttr(J->PortFd, &J->Settings);
+	break;
+    case PortJobBreak:
+	tcsendbreak(J->PortFd, 0);
+	break;
+    case PortJobFlush:
+	tcflush(J->PortFd, J->Arg);
+	break;
+    case PortJobModem:
+	Lines = abs(J->Arg);
+	ioctl(J->PortFd, J->Arg > 0 ? TIOCMBIS : TIOCMBIC, &Lines);
+	break;
+    case PortJobClose:
+	/* Closing waits for the output to drain */
+	PortSetAttr(J->PortFd, TCSANOW, &J->Settings);
+	close(J->PortFd);
+	HDBUnlockFile(J->LockFileName, getpid());
+	break;
+    }
 }
 
-/* Generic log function with log level control. Uses the same log levels
-of the syslog(3) system call */
-void
-LogMsg(int LogLevel, const char *const Msg)
+static void *
+PortWorkerThread(void *Arg)
 {
-    if (LogLevel <= MaxLogLevel) {
-	if (StdErrLogging) {
-	    fprintf(stderr, "%s\n", Msg);
+    int Slot = (int) (long) Arg;
+    PortJobType *J, **Link;
+    PortCloseType **Close;
+    int i;
+    char One = 1;
+
+    pthread_mutex_lock(&PortJobLock);
+    while (True) {
+	/* The oldest job of a port no other worker is busy with */
+	for (Link = &PortJobQueue; (J = *Link); Link = &J->Next) {
+	    for (i = 0; i < PortWorkers && PortJobRunning[i] != J->PortFd; i++);
+	    if (i == PortWorkers)
+		break;
 	}
-	else {
-	    syslog(LogLevel, "%s", Msg);
+	if (!J) {
+	    pthread_cond_wait(&PortJobReady, &PortJobLock);
+	    continue;
+	}
+	*Link = J->Next;
+	PortJobRunning[Slot] = J->PortFd;
+	pthread_mutex_unlock(&PortJobLock);
+
+	RunPortJob(J);
+
+	pthread_mutex_lock(&PortJobLock);
+	PortJobRunning[Slot] = -1;
+	if (J->Close) {
+	    for (Close = &PortCloses; *Close != J->Close; Close = &(*Close)->Next);
+	    *Close = J->Close->Next;
+	    free(J->Close->DeviceName);
+	    free(J->Close);
+	    J->Close = NULL;
 	}
+	AppendPortJob(&J->Sink->Done, J);
+	if (write(J->Sink->Pipe[1], &One, 1) < 0 && errno != EAGAIN)
+	    LogMsg(LOG_ERR, "Unable to signal a finished port job: %s.", strerror(errno));
+	/* Another job of this port may be waiting */
+	pthread_cond_broadcast(&PortJobReady);
     }
+    return NULL;
 }
 
+/* Number of workers started, -1 before the first attempt */
+static int PortWorkersStarted = -1;
 
-int
-SercdSelect(PORTHANDLE * DeviceIn, PORTHANDLE * DeviceOut, PORTHANDLE * Modemstate,
-	    SERCD_SOCKET * SocketOut, SERCD_SOCKET * SocketIn,
-	    SERCD_SOCKET * SocketConnect, long PollInterval)
+/* Start the worker threads, if not yet done, and the pipe of this
+   thread's sink. Returns False if port jobs must be run by the caller
+   instead. */
+static Boolean
+StartPortWorkers(void)
 {
-    fd_set InFdSet;
-    fd_set OutFdSet;
-    int highest_fd = -1, selret;
-    struct timeval BTimeout;
-    struct timeval newpoll;
-    int ret = 0;
-
-    FD_ZERO(&InFdSet);
-    FD_ZERO(&OutFdSet);
-
-    if (DeviceIn) {
-	FD_SET(*DeviceIn, &InFdSet);
-	highest_fd = MAX(highest_fd, *DeviceIn);
+    static ThreadLocal Boolean Failed = False;
+    pthread_t Thread;
+    sigset_t All, Old;
+    int i, Started;
+
+    if (PortJobSink.Pipe[0] >= 0 || Failed)
+	return !Failed;
+
+    pthread_mutex_lock(&PortJobLock);
+    if (PortWorkersStarted < 0) {
+	PortWorkersStarted = 0;
+	/* Signals are left to the main thread */
+	sigfillset(&All);
+	pthread_sigmask(SIG_BLOCK, &All, &Old);
+	for (i = 0; i < PortWorkers; i++) {
+	    PortJobRunning[i] = -1;
+	    if (pthread_create(&Thread, NULL, PortWorkerThread, (void *) (long) i) == 0) {
+		pthread_detach(Thread);
+		PortWorkersStarted++;
+	    }
+	}
+	pthread_sigmask(SIG_SETMASK, &Old, NULL);
+	if (PortWorkersStarted == 0)
+	    LogMsg(LOG_INFO, "Unable to start port workers, changing ports synchronously.");
     }
-    if (DeviceOut) {
-	FD_SET(*DeviceOut, &OutFdSet);
-	highest_fd = MAX(highest_fd, *DeviceOut);
+    Started = PortWorkersStarted;
+    pthread_mutex_unlock(&PortJobLock);
+
+    if (Started == 0 || pipe(PortJobSink.Pipe) < 0) {
+	PortJobSink.Pipe[0] = PortJobSink.Pipe[1] = -1;
+	Failed = True;
+	return False;
     }
-    if (SocketOut) {
-	FD_SET(*SocketOut, &OutFdSet);
-	highest_fd = MAX(highest_fd, *SocketOut);
+    fcntl(PortJobSink.Pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(PortJobSink.Pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(PortJobSink.Pipe[1], F_SETFD, FD_CLOEXEC);
+    return True;
+}
+
+/* Hand a port change to the workers, with the lock file to remove
+   and the device name to record as closing for a close. Returns False
+   if it must be done by the caller instead. */
+static Boolean
+QueuePortJob(PORTHANDLE PortFd, int Kind, int Arg, const struct termios *Settings,
+	     const char *LockFileName, const char *DeviceName)
+{
+    UnixPortType *Port = GetUnixPort(PortFd);
+    PortJobType *J;
+
+    if (!Port || !Port->Open || !StartPortWorkers())
+	return False;
+    J = malloc(sizeof(*J));
+    if (!J)
+	return False;
+    J->LockFileName = NULL;
+    if (LockFileName && !(J->LockFileName = strdup(LockFileName))) {
+	free(J);
+	return False;
     }
-    if (SocketIn) {
-	FD_SET(*SocketIn, &InFdSet);
-	highest_fd = MAX(highest_fd, *SocketIn);
+    J->Close = NULL;
+    if (DeviceName && (!(J->Close = malloc(sizeof(*J->Close))) ||
+		       !(J->Close->DeviceName = strdup(DeviceName)))) {
+	free(J->Close);
+	free(J->LockFileName);
+	free(J);
+	return False;
     }
-    if (SocketConnect) {
-	FD_SET(*SocketConnect, &InFdSet);
-	highest_fd = MAX(highest_fd, *SocketConnect);
+
+    J->Sink = &PortJobSink;
+    J->PortFd = PortFd;
+    J->Closes = __atomic_load_n(&Port->Closes, __ATOMIC_ACQUIRE);
+    J->Kind = Kind;
+    J->Arg = Arg;
+    if (Settings)
+	J->Settings = *Settings;
+
+    pthread_mutex_lock(&PortJobLock);
+    if (J->Close) {
+	J->Close->Next = PortCloses;
+	PortCloses = J->Close;
     }
+    AppendPortJob(&PortJobQueue, J);
+    pthread_cond_signal(&PortJobReady);
+    pthread_mutex_unlock(&PortJobLock);
+    Port->Jobs++;
+    PortJobSink.Outstanding++;
+    return True;
+}
 
-    BTimeout.tv_sec = PollInterval / 1000;
-    BTimeout.tv_usec = (PollInterval % 1000) * 1000;
+static Boolean
+SubmitPortJob(PORTHANDLE PortFd, int Kind, int Arg, const struct termios *Settings)
+{
+    return QueuePortJob(PortFd, Kind, Arg, Settings, NULL, NULL);
+}
 
-    selret = select(highest_fd + 1, &InFdSet, &OutFdSet, NULL, &BTimeout);
+/* Hand closing a port to the workers, after its other jobs. The port
+   settings are restored first, and the lock removed afterwards. The
+   device counts as closing until then, see PortClosing(). Returns
+   False if the caller must close it instead. */
+static Boolean
+SubmitPortClose(PORTHANDLE PortFd, const struct termios *Settings, const char *LockFileName)
+{
+    UnixPortType *Port = GetUnixPort(PortFd);
 
-    if (selret < 0)
-	return selret;
+    if (!QueuePortJob(PortFd, PortJobClose, 0, Settings, LockFileName, Port->DeviceName))
+	return False;
 
-    if (DeviceIn && FD_ISSET(*DeviceIn, &InFdSet)) {
-	ret |= SERCD_EV_DEVICEIN;
-    }
-    if (DeviceOut && FD_ISSET(*DeviceOut, &OutFdSet)) {
-	ret |= SERCD_EV_DEVICEOUT;
-    }
-    if (SocketOut && FD_ISSET(*SocketOut, &OutFdSet)) {
-	ret |= SERCD_EV_SOCKETOUT;
-    }
-    if (SocketIn && FD_ISSET(*SocketIn, &InFdSet)) {
-	ret |= SERCD_EV_SOCKETIN;
+    /* Jobs of the port now finish unnoticed */
+    __atomic_add_fetch(&Port->Closes, 1, __ATOMIC_RELEASE);
+    Port->Jobs = 0;
+    return True;
+}
+
+/* Collect the finished port jobs */
+static void
+CollectPortJobs(void)
+{
+    PortJobType *J, *Next;
+    UnixPortType *Port;
+    char Drain[64];
+
+    while (read(PortJobSink.Pipe[0], Drain, sizeof(Drain)) > 0);
+
+    pthread_mutex_lock(&PortJobLock);
+    J = PortJobSink.Done;
+    PortJobSink.Done = NULL;
+    pthread_mutex_unlock(&PortJobLock);
+
+    for (; J; J = Next) {
+	Next = J->Next;
+	PortJobSink.Outstanding--;
+	Port = GetUnixPort(J->PortFd);
+	if (J->Closes != __atomic_load_n(&Port->Closes, __ATOMIC_ACQUIRE)) {
+	    /* The port was closed since */
+	    free(J->LockFileName);
+	    free(J);
+	    continue;
+	}
+	Port->Jobs--;
+	/* Only the last settings change tells what is in effect */
+	if (J->Kind == PortJobSettings && Port->Jobs == 0) {
+	    Port->Settings = J->Settings;
+	    UnixLogPortSettings(&Port->Settings);
+	}
+	free(J);
+    }
+}
+
+/* Number of port jobs of PortFd not yet finished and collected */
+int
+PortJobsPending(PORTHANDLE PortFd)
+{
+    UnixPortType *Port = GetUnixPort(PortFd);
+
+    return Port ? Port->Jobs : 0;
+}
+
+/* Whether the workers have yet to close DeviceName. It must not be
+   opened until then. */
+Boolean
+PortClosing(const char *DeviceName)
+{
+    PortCloseType *C;
+
+    pthread_mutex_lock(&PortJobLock);
+    for (C = PortCloses; C && strcmp(C->DeviceName, DeviceName) != 0; C = C->Next);
+    pthread_mutex_unlock(&PortJobLock);
+    return C != NULL;
+}
+
+/* Wait until all jobs submitted by this thread have finished, port
+   closes included. The sink pipe may be beyond FD_SETSIZE, so it is
+   waited for with poll(). */
+void
+FinishPortJobs(void)
+{
+    struct pollfd Pfd;
+
+    /* No jobs were ever submitted from this thread */
+    if (PortJobSink.Pipe[0] < 0)
+	return;
+
+    Pfd.fd = PortJobSink.Pipe[0];
+    Pfd.events = POLLIN;
+    while (PortJobSink.Outstanding > 0) {
+	poll(&Pfd, 1, -1);
+	CollectPortJobs();
+    }
+}
+#else /* HAVE_PORT_JOBS */
+static Boolean
+SubmitPortJob(PORTHANDLE PortFd, int Kind, int Arg, const struct termios *Settings)
+{
+    return False;
+}
+
+static Boolean
+SubmitPortClose(PORTHANDLE PortFd, const struct termios *Settings, const char *LockFileName)
+{
+    return False;
+}
+
+int
+PortJobsPending(PORTHANDLE PortFd)
+{
+    return 0;
+}
+
+Boolean
+PortClosing(const char *DeviceName)
+{
+    return False;
+}
+
+void
+FinishPortJobs(void)
+{
+}
+#endif /* HAVE_PORT_JOBS */
+
+/* Number of CPUs online, at least one */
+int
+CpuCount(void)
+{
+    long Count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return Count > 0 ? Count : 1;
+}
+
+#ifdef HAVE_REACTOR_THREADS
+/* Event loop threads started, to be joined */
+static pthread_t *Threads = NULL;
+static int ThreadCount = 0;
+#endif
+
+/* Start a thread running an event loop. Returns False if threads are
+   not available. */
+Boolean
+StartThread(void *(*Run) (void *), void *Arg)
+{
+#ifdef HAVE_REACTOR_THREADS
+    pthread_t *Grown;
+    sigset_t All, Old;
+    int Err;
+
+    Grown = realloc(Threads, (ThreadCount + 1) * sizeof(pthread_t));
+    if (!Grown)
+	return False;
+    Threads = Grown;
+
+    /* Signals are left to the main thread */
+    sigfillset(&All);
+    pthread_sigmask(SIG_BLOCK, &All, &Old);
+    Err = pthread_create(&Threads[ThreadCount], NULL, Run, Arg);
+    pthread_sigmask(SIG_SETMASK, &Old, NULL);
+    if (Err)
+	return False;
+    ThreadCount++;
+    return True;
+#else
+    return False;
+#endif
+}
+
+void *
+CreateLock(void)
+{
+#ifdef HAVE_REACTOR_THREADS
+    pthread_mutex_t *Lock = malloc(sizeof(pthread_mutex_t));
+
+    if (Lock && pthread_mutex_init(Lock, NULL) != 0) {
+	free(Lock);
+	Lock = NULL;
+    }
+    return Lock;
+#else
+    return NULL;
+#endif
+}
+
+void
+TakeLock(void *Lock)
+{
+#ifdef HAVE_REACTOR_THREADS
+    if (Lock)
+	pthread_mutex_lock(Lock);
+#endif
+}
+
+void
+ReleaseLock(void *Lock)
+{
+#ifdef HAVE_REACTOR_THREADS
+    if (Lock)
+	pthread_mutex_unlock(Lock);
+#endif
+}
+
+/* Wait for the threads started to return */
+void
+JoinThreads(void)
+{
+#ifdef HAVE_REACTOR_THREADS
+    int i;
+
+    for (i = 0; i < ThreadCount; i++)
+	pthread_join(Threads[i], NULL);
+    free(Threads);
+    Threads = NULL;
+    ThreadCount = 0;
+#endif
+}
+
+/* Run the calling thread on one CPU only */
+Boolean
+BindThreadToCpu(int Cpu)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t Set;
+
+    CPU_ZERO(&Set);
+    CPU_SET(Cpu, &Set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(Set), &Set) == 0;
+#else
+    return False;
+#endif
+}
+
+int
+OpenPort(const char *DeviceName, const char *LockFileName, PORTHANDLE * PortFd)
+{
+    /* Actual port settings */
+    struct termios PortSettings;
+    UnixPortType *Port;
+
+    /* Try to lock the device */
+    if (HDBLockFile(LockFileName, getpid()) != LockOk) {
+	/* Lock failed */
+	LogMsg(LOG_NOTICE, "Unable to lock %s. Exiting.", LockFileName);
+	return (LockError);
+    }
+    else {
+	/* Lock succeeded */
+	LogMsg(LOG_INFO, "Device %s locked.", DeviceName);
+    }
+
+    /* Open the device */
+    if ((*PortFd = open(DeviceName, O_RDWR | O_NOCTTY | O_NONBLOCK, 0)) == OpenError) {
+	return (Error);
+    }
+
+    /* Get the actual port settings */
+    Port = GetUnixPort(*PortFd);
+    if (!Port) {
+	close(*PortFd);
+	HDBUnlockFile(LockFileName, getpid());
+	return (Error);
+    }
+    PortGetAttr(*PortFd, &Port->InitialSettings);
+    Port->Open = True;
+    Port->DeviceName = DeviceName;
+    Port->Staged = False;
+    Port->Jobs = 0;
+    PortSettings = Port->InitialSettings;
+    UnixLogPortSettings(&PortSettings);
+
+    /* Set the serial port to raw mode */
+    cfmakeraw(&PortSettings);
+
+    /* Enable HANGUP on close and disable modem control line handling */
+    PortSettings.c_cflag = (PortSettings.c_cflag | HUPCL) | CLOCAL;
+
+    /* Enable break handling */
+    PortSettings.c_iflag = (PortSettings.c_iflag & ~IGNBRK) | BRKINT;
+
+    /* Write the port settings to device */
+    PortSetAttr(*PortFd, TCSANOW, &PortSettings);
+    ResyncPortTermios(*PortFd);
+
+#ifdef HAVE_MODEM_WAIT
+    if (!StartModemWait(Port, *PortFd))
+	LogMsg(LOG_INFO, "Unable to start modem line notifier, polling instead.");
+#endif
+
+    return NoError;
+}
+
+void
+ClosePort(PORTHANDLE PortFd, const char *LockFileName)
+{
+    UnixPortType *Port = GetUnixPort(PortFd);
+
+#ifdef HAVE_MODEM_WAIT
+    if (Port)
+	StopModemWait(Port);
+#endif
+    PollForget(PortFd);
+
+    /* Restoring the settings and closing may wait for the output to
+       drain, which is left to the workers */
+    if (Port && Port->Open && SubmitPortClose(PortFd, &Port->InitialSettings, LockFileName)) {
+	Port->Open = False;
+	return;
+    }
+
+    /* Workers must be done with the descriptor */
+    FinishPortJobs();
+
+    /* Restores initial port settings */
+    if (Port && Port->Open) {
+	PortSetAttr(PortFd, TCSANOW, &Port->InitialSettings);
+	Port->Open = False;
+    }
+
+    /* Closes the device */
+    close(PortFd);
+
+    /* Removes the lock file */
+    HDBUnlockFile(LockFileName, getpid());
+}
+
+/* Write a log message to its destination. Port workers log too, so
+the stream is locked for the whole line. */
+static void
+WriteLog(int LogLevel, const char *Fmt, va_list Args)
+{
+    if (StdErrLogging) {
+	flockfile(stderr);
+	vfprintf(stderr, Fmt, Args);
+	putc_unlocked('\n', stderr);
+	funlockfile(stderr);
+    }
+    else {
+	vsyslog(LogLevel, Fmt, Args);
+    }
+}
+
+/* WriteLog with the arguments inline */
+static void
+WriteLogF(int LogLevel, const char *Fmt, ...)
+{
+    va_list Args;
+
+    va_start(Args, Fmt);
+    WriteLog(LogLevel, Fmt, Args);
+    va_end(Args);
+}
+
+#ifdef HAVE_LOG_THREAD
+/* Log records waiting for the log thread, so that a stalled syslog or
+   stderr never holds up forwarding. Any thread may add records without
+   locking: a slot whose sequence number equals a write position is
+   free for the writer claiming that position, and is handed to the
+   log thread by setting it to the position plus one. Records that
+   find the ring full are counted and dropped. */
+#define LogSlots 256
+#define LogRecordLen 256
+typedef struct
+{
+    unsigned long Seq;
+    int Level;
+    char Msg[LogRecordLen];
+}
+LogSlotType;
+
+static LogSlotType LogRing[LogSlots];
+static unsigned long LogHead;	/* Next position to claim */
+static unsigned long LogTail;	/* Next position to write out */
+static unsigned long LogDropped;	/* Records lost to a full ring */
+static int LogWaiting;		/* The log thread is going to sleep */
+static int LogRunning;		/* Records go through the ring */
+static int LogStop;		/* Asks the log thread to exit */
+static int LogWakePipe[2] = { -1, -1 };
+static pthread_t LogThreadId;
+
+/* Write out the records ready in the ring, and report drops */
+static void
+DrainLogRing(void)
+{
+    static unsigned long Reported = 0;
+    LogSlotType *Slot;
+    unsigned long Dropped;
+
+    for (;;) {
+	Slot = &LogRing[LogTail % LogSlots];
+	if (__atomic_load_n(&Slot->Seq, __ATOMIC_ACQUIRE) != LogTail + 1)
+	    break;
+	WriteLogF(Slot->Level, "%s", Slot->Msg);
+	__atomic_store_n(&Slot->Seq, LogTail + LogSlots, __ATOMIC_RELEASE);
+	LogTail++;
+    }
+
+    Dropped = __atomic_load_n(&LogDropped, __ATOMIC_RELAXED);
+    if (Dropped != Reported) {
+	WriteLogF(LOG_WARNING, "%lu log messages dropped.", Dropped - Reported);
+	Reported = Dropped;
+    }
+}
+
+static void *
+LogThread(void *Arg)
+{
+    char Buf[64];
+    LogSlotType *Slot;
+
+    Arg = Arg;
+    for (;;) {
+	DrainLogRing();
+	if (__atomic_load_n(&LogStop, __ATOMIC_ACQUIRE))
+	    break;
+
+	/* Announce the sleep before the last look, so that a record
+	   added meanwhile wakes us up */
+	__atomic_store_n(&LogWaiting, 1, __ATOMIC_SEQ_CST);
+	Slot = &LogRing[LogTail % LogSlots];
+	if (__atomic_load_n(&Slot->Seq, __ATOMIC_SEQ_CST) == LogTail + 1 ||
+	    __atomic_load_n(&LogStop, __ATOMIC_SEQ_CST)) {
+	    __atomic_store_n(&LogWaiting, 0, __ATOMIC_SEQ_CST);
+	    continue;
+	}
+	if (read(LogWakePipe[0], Buf, sizeof(Buf)) < 0 && errno != EINTR)
+	    break;
+    }
+    return NULL;
+}
+
+/* Wake the log thread if it sleeps */
+static void
+WakeLogThread(void)
+{
+    if (__atomic_exchange_n(&LogWaiting, 0, __ATOMIC_SEQ_CST)) {
+	if (write(LogWakePipe[1], "", 1) < 0) {
+	    /* Pipe full: the thread has a wakeup pending anyway */
+	}
+    }
+}
+
+/* Add a record to the ring. Returns False if the log thread is not
+   running, and the caller must write the message itself. */
+static Boolean
+QueueLog(int LogLevel, const char *Fmt, va_list Args)
+{
+    LogSlotType *Slot;
+    unsigned long Pos, Seq;
+
+    if (!__atomic_load_n(&LogRunning, __ATOMIC_ACQUIRE))
+	return False;
+
+    Pos = __atomic_load_n(&LogHead, __ATOMIC_RELAXED);
+    for (;;) {
+	Slot = &LogRing[Pos % LogSlots];
+	Seq = __atomic_load_n(&Slot->Seq, __ATOMIC_ACQUIRE);
+	if (Seq == Pos) {
+	    if (__atomic_compare_exchange_n(&LogHead, &Pos, Pos + 1, False,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	}
+	else if ((long) (Seq - Pos) < 0) {
+	    /* Full */
+	    __atomic_add_fetch(&LogDropped, 1, __ATOMIC_RELAXED);
+	    return True;
+	}
+	else
+	    Pos = __atomic_load_n(&LogHead, __ATOMIC_RELAXED);
+    }
+
+    Slot->Level = LogLevel;
+    vsnprintf(Slot->Msg, sizeof(Slot->Msg), Fmt, Args);
+    __atomic_store_n(&Slot->Seq, Pos + 1, __ATOMIC_SEQ_CST);
+    WakeLogThread();
+    return True;
+}
+
+/* Start writing log messages from a thread of their own. Without it
+   they are written synchronously. */
+static void
+StartLogThread(void)
+{
+    sigset_t All, Old;
+    int i, ret;
+
+    for (i = 0; i < LogSlots; i++)
+	LogRing[i].Seq = i;
+    if (pipe(LogWakePipe) < 0)
+	return;
+    fcntl(LogWakePipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(LogWakePipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(LogWakePipe[1], F_SETFD, FD_CLOEXEC);
+
+    /* Signals are left to the main thread */
+    sigfillset(&All);
+    pthread_sigmask(SIG_BLOCK, &All, &Old);
+    ret = pthread_create(&LogThreadId, NULL, LogThread, NULL);
+    pthread_sigmask(SIG_SETMASK, &Old, NULL);
+    if (ret != 0) {
+	close(LogWakePipe[0]);
+	close(LogWakePipe[1]);
+	LogWakePipe[0] = LogWakePipe[1] = -1;
+	return;
+    }
+    __atomic_store_n(&LogRunning, 1, __ATOMIC_RELEASE);
+}
+
+/* Write out the remaining records and stop the log thread; runs at
+   exit, after ExitFunction */
+static void
+StopLogThread(void)
+{
+    if (!__atomic_load_n(&LogRunning, __ATOMIC_ACQUIRE))
+	return;
+    __atomic_store_n(&LogRunning, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&LogStop, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&LogWaiting, 1, __ATOMIC_SEQ_CST);
+    WakeLogThread();
+    pthread_join(LogThreadId, NULL);
+    DrainLogRing();
+}
+#endif /* HAVE_LOG_THREAD */
+
+/* Number of log messages dropped because the log thread fell behind */
+unsigned long
+LogDroppedCount(void)
+{
+#ifdef HAVE_LOG_THREAD
+    return __atomic_load_n(&LogDropped, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+/* Write a message that passed the LogMsg level check, through the log
+   thread where there is one */
+void
+LogFormat(int LogLevel, const char *Fmt, ...)
+{
+    va_list Args;
+
+    va_start(Args, Fmt);
+#ifdef HAVE_LOG_THREAD
+    if (!QueueLog(LogLevel, Fmt, Args))
+#endif
+	WriteLog(LogLevel, Fmt, Args);
+    va_end(Args);
+}
+
+/* Written to on a stop request, and never read: it stays readable
+   for every event loop */
+static int StopPipe[2] = { -1, -1 };
+
+void
+WakeEventLoops(void)
+{
+    int Saved = errno;
+
+    if (StopPipe[1] >= 0 && write(StopPipe[1], "", 1) < 0) {
+	/* Pipe full: the event loops have a wakeup pending anyway */
+    }
+    errno = Saved;
+}
+
+/* Function called on many signals */
+static void
+SignalFunction(int unused)
+{
+    /* Same as the break signal */
+    BreakFunction(unused);
+}
+
+void
+PlatformInit()
+{
+    if (!StdErrLogging) {
+	openlog("sercd", LOG_PID, LOG_USER);
+    }
+
+#ifdef HAVE_LOG_THREAD
+    /* Registered first, so that it runs after ExitFunction */
+    StartLogThread();
+    atexit(StopLogThread);
+#endif
+
+    /* The event loops wait for this to be readable, so that a stop
+       request arriving while they are busy is not missed */
+    if (pipe(StopPipe) == 0) {
+	fcntl(StopPipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(StopPipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(StopPipe[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    /* Register exit and signal handler functions */
+    atexit(ExitFunction);
+    signal(SIGHUP, SignalFunction);
+    signal(SIGQUIT, SignalFunction);
+    signal(SIGABRT, SignalFunction);
+    signal(SIGTERM, SignalFunction);
+
+    /* Clients going away are noticed through EPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Register the function to be called on break condition */
+    signal(SIGINT, BreakFunction);
+
+    /* Latency histograms are logged on request */
+    signal(SIGUSR1, LatencyDumpFunction);
+
+#ifdef HAVE_MODEM_WAIT
+    {
+	struct sigaction Action;
+
+	/* No SA_RESTART: the signal must interrupt TIOCMIWAIT */
+	memset(&Action, 0, sizeof(Action));
+	Action.sa_handler = ModemWaitSignal;
+	sigemptyset(&Action.sa_mask);
+	sigaction(SIGUSR2, &Action, NULL);
+    }
+#endif
+}
+
+
+/* Return the poller slot for Fd, growing the tables as needed */
+static PollSlot *
+GetPollSlot(int Fd)
+{
+    if (Fd >= PollSlotsSize) {
+	int NewSize = MAX(Fd + 1, 2 * PollSlotsSize);
+	PollSlot *NewSlots = realloc(PollSlots, NewSize * sizeof(*PollSlots));
+	if (!NewSlots)
+	    return NULL;
+	memset(NewSlots + PollSlotsSize, 0, (NewSize - PollSlotsSize) * sizeof(*PollSlots));
+	PollSlots = NewSlots;
+	PollSlotsSize = NewSize;
+#ifdef HAVE_SYS_EPOLL_H
+	{
+	    int *NewActive = realloc(EpollActive, NewSize * sizeof(*EpollActive));
+	    if (!NewActive)
+		return NULL;
+	    EpollActive = NewActive;
+	}
+#endif
+    }
+    return &PollSlots[Fd];
+}
+
+/* Add interest for Fd to the poll set of the current round, merging
+   duplicate descriptors. Returns -1 if out of memory. */
+static int
+AddPollEntry(int *Count, int Fd, Boolean In, Boolean Out)
+{
+    PollSlot *Slot;
+    PollEntry *Entry;
+
+    Slot = GetPollSlot(Fd);
+    if (!Slot)
+	return -1;
+
+    if (Slot->Round == PollRound) {
+	Entry = &PollSet[Slot->Index];
+	Entry->In |= In;
+	Entry->Out |= Out;
+	return 0;
+    }
+
+    if (*Count >= PollSetSize) {
+	int NewSize = MAX(16, 2 * PollSetSize);
+	PollEntry *NewSet = realloc(PollSet, NewSize * sizeof(*PollSet));
+	if (!NewSet)
+	    return -1;
+	PollSet = NewSet;
+	PollSetSize = NewSize;
+    }
+
+    Slot->Round = PollRound;
+    Slot->Index = *Count;
+    Entry = &PollSet[*Count];
+    Entry->Fd = Fd;
+    Entry->In = In;
+    Entry->Out = Out;
+    Entry->Readable = False;
+    Entry->Writable = False;
+    (*Count)++;
+    return 0;
+}
+
+/* Look up the poll set entry of Fd in the current round */
+static PollEntry *
+FindPollEntry(int Fd)
+{
+    if (Fd < 0 || Fd >= PollSlotsSize || PollSlots[Fd].Round != PollRound)
+	return NULL;
+    return &PollSet[PollSlots[Fd].Index];
+}
+
+/* Wait for events using select(). Timeout is in milliseconds, -1 for
+   no timeout. */
+static int
+SelectWait(int Count, long Timeout)
+{
+    fd_set InFdSet;
+    fd_set OutFdSet;
+    int highest_fd = -1, selret;
+    struct timeval BTimeout;
+    int i;
+
+    FD_ZERO(&InFdSet);
+    FD_ZERO(&OutFdSet);
+
+    for (i = 0; i < Count; i++) {
+	if (PollSet[i].Fd >= FD_SETSIZE) {
+	    LogMsg(LOG_ERR, "Too many descriptors for select().");
+	    errno = EINVAL;
+	    return -1;
+	}
+	if (PollSet[i].In)
+	    FD_SET(PollSet[i].Fd, &InFdSet);
+	if (PollSet[i].Out)
+	    FD_SET(PollSet[i].Fd, &OutFdSet);
+	highest_fd = MAX(highest_fd, PollSet[i].Fd);
+    }
+
+    BTimeout.tv_sec = Timeout / 1000;
+    BTimeout.tv_usec = (Timeout % 1000) * 1000;
+
+    selret = select(highest_fd + 1, &InFdSet, &OutFdSet, NULL, Timeout < 0 ? NULL : &BTimeout);
+
+    if (selret < 0)
+	return selret;
+
+    for (i = 0; i < Count; i++) {
+	PollSet[i].Readable = PollSet[i].In && FD_ISSET(PollSet[i].Fd, &InFdSet);
+	PollSet[i].Writable = PollSet[i].Out && FD_ISSET(PollSet[i].Fd, &OutFdSet);
+    }
+
+    return selret;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Change the registration of Fd in the epoll instance to Events. Returns
+   -1 on failure. */
+static int
+EpollUpdate(int Fd, unsigned int Events)
+{
+    struct epoll_event ev;
+    PollSlot *Slot;
+    int i, ret;
+
+    Slot = GetPollSlot(Fd);
+    if (!Slot)
+	return -1;
+    if (Slot->EpollMask == Events)
+	return 0;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = Events;
+    ev.data.fd = Fd;
+
+    if (Events == 0) {
+	/* Unregister rather than leaving an empty mask, since EPOLLHUP
+	   and EPOLLERR are always reported and would keep waking us up */
+	ret = epoll_ctl(EpollFd, EPOLL_CTL_DEL, Fd, &ev);
+	if (ret < 0 && (errno == ENOENT || errno == EBADF))
+	    ret = 0;
+	for (i = 0; i < EpollActiveCount; i++) {
+	    if (EpollActive[i] == Fd) {
+		EpollActive[i] = EpollActive[--EpollActiveCount];
+		break;
+	    }
+	}
     }
-    if (SocketConnect && FD_ISSET(*SocketConnect, &InFdSet)) {
-	ret |= SERCD_EV_SOCKETCONNECT;
+    else if (Slot->EpollMask == 0) {
+	ret = epoll_ctl(EpollFd, EPOLL_CTL_ADD, Fd, &ev);
+	if (ret < 0 && errno == EEXIST)
+	    ret = epoll_ctl(EpollFd, EPOLL_CTL_MOD, Fd, &ev);
+	if (ret == 0)
+	    EpollActive[EpollActiveCount++] = Fd;
     }
+    else {
+	ret = epoll_ctl(EpollFd, EPOLL_CTL_MOD, Fd, &ev);
+	if (ret < 0 && errno == ENOENT)
+	    ret = epoll_ctl(EpollFd, EPOLL_CTL_ADD, Fd, &ev);
+    }
+
+    if (ret < 0)
+	return ret;
+
+    Slot->EpollMask = Events;
+    return 0;
+}
+
+/* Wait for events using the persistent epoll instance. Descriptors stay
+   registered between calls; only changed interest masks cause
+   epoll_ctl calls. Timeout is in milliseconds, -1 for no timeout. */
+static int
+EpollWait(int Count, long Timeout)
+{
+    static ThreadLocal struct epoll_event *Events = NULL;
+    static ThreadLocal int EventsSize = 0;
+    int i, nev;
+
+    if (EpollFd < 0) {
+	EpollFd = epoll_create(MAX(Count, 1));
+	if (EpollFd < 0) {
+	    LogMsg(LOG_WARNING, "epoll_create failed, falling back to select.");
+	    Backend = BackendSelect;
+	    return SelectWait(Count, Timeout);
+	}
+	fcntl(EpollFd, F_SETFD, FD_CLOEXEC);
+    }
+
+    if (Count > EventsSize) {
+	struct epoll_event *NewEvents = realloc(Events, Count * sizeof(*Events));
+	if (!NewEvents) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	Events = NewEvents;
+	EventsSize = Count;
+    }
+
+    for (i = 0; i < Count; i++) {
+	unsigned int Want = (PollSet[i].In ? EPOLLIN : 0) | (PollSet[i].Out ? EPOLLOUT : 0);
+	if (EpollUpdate(PollSet[i].Fd, Want) < 0) {
+	    /* Descriptors such as regular files cannot be polled with
+	       epoll. */
+	    LogMsg(LOG_WARNING, "epoll_ctl failed for fd %d (errno %d), falling back to select.",
+		   PollSet[i].Fd, errno);
+	    Backend = BackendSelect;
+	    return SelectWait(Count, Timeout);
+	}
+    }
+
+    /* Drop interest in descriptors not part of this round */
+    for (i = EpollActiveCount - 1; i >= 0; i--) {
+	if (PollSlots[EpollActive[i]].Round != PollRound)
+	    EpollUpdate(EpollActive[i], 0);
+    }
+
+    nev = epoll_wait(EpollFd, Events, MAX(Count, 1), Timeout);
+    if (nev < 0)
+	return nev;
+
+    for (i = 0; i < nev; i++) {
+	PollEntry *Entry = FindPollEntry(Events[i].data.fd);
+	if (!Entry)
+	    continue;
+	/* Report errors and hangups as readiness, so that the
+	   following read or write picks up the condition */
+	if (Events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+	    Entry->Readable = Entry->In;
+	if (Events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+	    Entry->Writable = Entry->Out;
+    }
+
+    return nev;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+#ifdef HAVE_IO_URING
+/* Cancel the requests of all rings, and wait for them to end. The
+   kernel tears rings down in the background after the process exits,
+   and until then they hold the files they use, such as the listening
+   sockets a restarted sercd binds again. */
+static void
+UringExit(void)
+{
+    /* IORING_REGISTER_SYNC_CANCEL came with the same headers */
+#ifdef IORING_ASYNC_CANCEL_FD_FIXED
+    struct io_uring_sync_cancel_reg Cancel;
+    int i, Count = MIN(__atomic_load_n(&UringRingCount, __ATOMIC_ACQUIRE), UringMaxRings);
+
+    memset(&Cancel, 0, sizeof(Cancel));
+    Cancel.flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    Cancel.fd = -1;
+    Cancel.timeout.tv_sec = Cancel.timeout.tv_nsec = -1;
+    for (i = 0; i < Count; i++) {
+	if (UringRings[i] > 0)
+	    syscall(__NR_io_uring_register, UringRings[i], IORING_REGISTER_SYNC_CANCEL, &Cancel, 1);
+    }
+#endif
+}
+
+/* Set up the io_uring of the thread. Returns False if the kernel lacks
+   it, or the features used. */
+static Boolean
+UringSetup(void)
+{
+    struct io_uring_params P;
+    size_t Len;
+    char *Ring;
+    void *Sqes;
+    int Fd, i;
+
+    memset(&P, 0, sizeof(P));
+    P.flags = IORING_SETUP_CQSIZE;
+    P.cq_entries = UringCqEntries;
+    Fd = syscall(__NR_io_uring_setup, UringSqEntries, &P);
+    if (Fd < 0)
+	return False;
+    if (!(P.features & IORING_FEAT_SINGLE_MMAP) || !(P.features & IORING_FEAT_NODROP) ||
+	!(P.features & IORING_FEAT_EXT_ARG)) {
+	close(Fd);
+	return False;
+    }
+
+    Len = MAX(P.sq_off.array + P.sq_entries * sizeof(unsigned int),
+	      P.cq_off.cqes + P.cq_entries * sizeof(struct io_uring_cqe));
+    Ring = mmap(NULL, Len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd,
+		IORING_OFF_SQ_RING);
+    Sqes = mmap(NULL, P.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQES);
+    if (Ring == MAP_FAILED || Sqes == MAP_FAILED) {
+	close(Fd);
+	return False;
+    }
+    fcntl(Fd, F_SETFD, FD_CLOEXEC);
+
+    Uring.SqHead = (unsigned int *) (Ring + P.sq_off.head);
+    Uring.SqTail = (unsigned int *) (Ring + P.sq_off.tail);
+    Uring.SqMask = (unsigned int *) (Ring + P.sq_off.ring_mask);
+    Uring.SqArray = (unsigned int *) (Ring + P.sq_off.array);
+    Uring.CqHead = (unsigned int *) (Ring + P.cq_off.head);
+    Uring.CqTail = (unsigned int *) (Ring + P.cq_off.tail);
+    Uring.CqMask = (unsigned int *) (Ring + P.cq_off.ring_mask);
+    Uring.Cqes = (struct io_uring_cqe *) (Ring + P.cq_off.cqes);
+    Uring.Sqes = Sqes;
+    Uring.Fd = Fd;
+
+    i = __atomic_fetch_add(&UringRingCount, 1, __ATOMIC_ACQ_REL);
+    if (i == 0)
+	atexit(UringExit);
+    if (i < UringMaxRings)
+	__atomic_store_n(&UringRings[i], Fd, __ATOMIC_RELEASE);
+    return True;
+}
+
+/* Submit the queued requests, and wait for MinComplete completions or
+   until Timeout ms have passed, -1 for no timeout */
+static int
+UringEnter(unsigned int MinComplete, long Timeout)
+{
+    struct io_uring_getevents_arg Arg;
+    struct __kernel_timespec Ts;
+    unsigned int Queued = *Uring.SqTail - __atomic_load_n(Uring.SqHead, __ATOMIC_ACQUIRE);
+
+    memset(&Arg, 0, sizeof(Arg));
+    if (Timeout >= 0) {
+	Ts.tv_sec = Timeout / 1000;
+	Ts.tv_nsec = (Timeout % 1000) * 1000000;
+	Arg.ts = (unsigned long) &Ts;
+    }
+    return syscall(__NR_io_uring_enter, Uring.Fd, Queued, MinComplete,
+		   IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &Arg, sizeof(Arg));
+}
+
+/* Queue a request, submitting those queued before if the ring is full.
+   Returns NULL on failure. */
+static struct io_uring_sqe *
+UringQueue(int Opcode, int Fd, unsigned long long UserData)
+{
+    struct io_uring_sqe *Sqe;
+    unsigned int Tail = *Uring.SqTail;
+
+    if (Tail - __atomic_load_n(Uring.SqHead, __ATOMIC_ACQUIRE) >= UringSqEntries &&
+	UringEnter(0, 0) < 0 && errno != ETIME)
+	return NULL;
+
+    Sqe = &Uring.Sqes[Tail & *Uring.SqMask];
+    memset(Sqe, 0, sizeof(*Sqe));
+    Sqe->opcode = Opcode;
+    Sqe->fd = Fd;
+    Sqe->user_data = UserData;
+    Uring.SqArray[Tail & *Uring.SqMask] = Tail & *Uring.SqMask;
+    __atomic_store_n(Uring.SqTail, Tail + 1, __ATOMIC_RELEASE);
+    return Sqe;
+}
+
+/* Completions of polls carry the descriptor and the poll generation,
+   those of reads their UringReadType, those of the polls linked in
+   front of reads the same with bit 1 set, and others zero */
+#define UringPollData(Fd, Gen) ((unsigned long long) (Gen) << 32 | (unsigned) (Fd) << 1 | 1)
+#define UringLinkData(R) ((unsigned long) (R) | 2)
+
+/* Poll events are passed as a word-swapped 32 bit value */
+#if __BYTE_ORDER == __BIG_ENDIAN
+#define UringPollEvents(Events) ((Events) << 16 | (Events) >> 16)
+#else
+#define UringPollEvents(Events) (Events)
+#endif
+
+/* Arm a poll for Events on Fd, replacing the one armed. Returns -1 on
+   failure. */
+static int
+UringArmPoll(int Fd, PollSlot * Slot, unsigned int Events)
+{
+    struct io_uring_sqe *Sqe;
+
+    if (Slot->UringPoll) {
+	Sqe = UringQueue(IORING_OP_POLL_REMOVE, -1, 0);
+	if (!Sqe)
+	    return -1;
+	Sqe->addr = UringPollData(Fd, Slot->UringGen);
+	Slot->UringGen++;
+	Slot->UringPoll = 0;
+    }
+    if (Events) {
+	Sqe = UringQueue(IORING_OP_POLL_ADD, Fd, UringPollData(Fd, Slot->UringGen));
+	if (!Sqe)
+	    return -1;
+	Sqe->poll32_events = UringPollEvents(Events);
+	Slot->UringPoll = Events;
+    }
+    return 0;
+}
+
+/* Submit a read into the buffer of R. Descriptors whose reads return
+   EAGAIN instead of waiting get a poll linked in front. Returns -1 on
+   failure. */
+static int
+UringArmRead(UringReadType * R)
+{
+    struct io_uring_sqe *Sqe;
+
+    if (R->NeedPoll) {
+	Sqe = UringQueue(IORING_OP_POLL_ADD, R->Fd, UringLinkData(R));
+	if (!Sqe)
+	    return -1;
+	Sqe->poll32_events = UringPollEvents(POLLIN);
+	Sqe->flags = IOSQE_IO_LINK;
+    }
+    Sqe = UringQueue(IORING_OP_READ, R->Fd, (unsigned long) R);
+    if (!Sqe)
+	return -1;
+    Sqe->addr = (unsigned long) R->Data;
+    Sqe->len = sizeof(R->Data);
+    R->State = UringPending;
+    return 0;
+}
+
+/* Apply the completions to the slots and to the current poll set */
+static void
+UringReap(void)
+{
+    unsigned int Head = *Uring.CqHead;
+    unsigned int Tail = __atomic_load_n(Uring.CqTail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *Cqe;
+    UringReadType *R;
+    PollEntry *Entry;
+    PollSlot *Slot;
+    int Fd;
+
+    for (; Head != Tail; Head++) {
+	Cqe = &Uring.Cqes[Head & *Uring.CqMask];
+	if (Cqe->user_data & 1) {
+	    Fd = (Cqe->user_data >> 1) & 0x7fffffff;
+	    if (Fd >= PollSlotsSize)
+		continue;
+	    Slot = &PollSlots[Fd];
+	    if (Slot->UringGen != Cqe->user_data >> 32 || !Slot->UringPoll)
+		continue;
+	    Slot->UringPoll = 0;
+	    if (Cqe->res < 0 || !(Entry = FindPollEntry(Fd)))
+		continue;
+	    /* As with epoll, errors and hangups count as readiness; those
+	       of descriptors read through the ring come with the read */
+	    if ((Cqe->res & (POLLIN | POLLERR | POLLHUP)) && !Slot->UringRead)
+		Entry->Readable = Entry->In;
+	    if (Cqe->res & (POLLOUT | POLLERR | POLLHUP))
+		Entry->Writable = Entry->Out;
+	}
+	else if (Cqe->user_data & 2) {
+	    /* The read it is linked to completes after it */
+	    continue;
+	}
+	else if (Cqe->user_data) {
+	    R = (UringReadType *) (unsigned long) Cqe->user_data;
+	    if (R->Fd < 0) {
+		free(R);
+		continue;
+	    }
+	    R->State = UringIdle;
+	    if (Cqe->res == -EAGAIN)
+		R->NeedPoll = True;
+	    else if (Cqe->res != -ECANCELED) {
+		R->State = UringReady;
+		R->Result = Cqe->res;
+		R->Pos = 0;
+		if ((Entry = FindPollEntry(R->Fd)))
+		    Entry->Readable = Entry->In;
+	    }
+	}
+    }
+    __atomic_store_n(Uring.CqHead, Head, __ATOMIC_RELEASE);
+}
+
+/* Wait for events using the io_uring of the thread. Descriptors read
+   through ReadFromDev() or ReadFromNet() always have a read
+   outstanding, so that their data is there when they are reported
+   readable; the others, and writes, are waited for with polls. All
+   changes are submitted with the wait, in one system call. Timeout is
+   in milliseconds, -1 for no timeout. */
+static int
+UringWait(int Count, long Timeout)
+{
+    PollEntry *Entry;
+    PollSlot *Slot;
+    UringReadType *R;
+    Boolean Ready = False;
+    unsigned int Want;
+    int i, ret;
+
+    /* Nothing has been read through the ring before it is set up, so
+       there is no data left in it when falling back */
+    if (Uring.Fd < 0 && !UringSetup()) {
+	LogMsg(LOG_WARNING, "io_uring not available, falling back to epoll.");
+	Backend = BackendEpoll;
+	return EpollWait(Count, Timeout);
+    }
+
+    for (i = 0; i < Count; i++) {
+	Entry = &PollSet[i];
+	Slot = &PollSlots[Entry->Fd];
+	R = Entry->In ? Slot->UringRead : NULL;
+	if (R && R->State == UringReady)
+	    Entry->Readable = Ready = True;
+	else if (R && R->State == UringIdle && UringArmRead(R) < 0)
+	    return -1;
+	Want = (Entry->In && !Slot->UringRead ? POLLIN : 0) | (Entry->Out ? POLLOUT : 0);
+	if (Want != Slot->UringPoll && UringArmPoll(Entry->Fd, Slot, Want) < 0)
+	    return -1;
+    }
+
+    /* Data already read is handed out without waiting */
+    ret = UringEnter(Ready ? 0 : 1, Ready ? 0 : Timeout);
+    if (ret < 0 && errno != ETIME)
+	return ret;
+    UringReap();
+
+    for (i = 0, ret = 0; i < Count; i++) {
+	if (PollSet[i].Readable || PollSet[i].Writable)
+	    ret++;
+    }
+    return ret;
+}
+
+/* Read through the outstanding read of Fd, starting to keep one with
+   the next wait */
+static ssize_t
+UringRead(int Fd, void *Buf, size_t Count)
+{
+    PollSlot *Slot = GetPollSlot(Fd);
+    UringReadType *R;
+    ssize_t Len;
+
+    if (!Slot)
+	return read(Fd, Buf, Count);
+    R = Slot->UringRead;
+    if (!R && (R = Slot->UringRead = calloc(1, sizeof(*R))))
+	R->Fd = Fd;
+    if (!R || R->State == UringIdle)
+	return read(Fd, Buf, Count);
+    if (R->State == UringPending) {
+	errno = EWOULDBLOCK;
+	return -1;
+    }
+
+    if (R->Result <= 0) {
+	R->State = UringIdle;
+	if (R->Result == 0)
+	    return 0;
+	errno = -R->Result;
+	return -1;
+    }
+    Len = MIN(Count, (size_t) (R->Result - R->Pos));
+    memcpy(Buf, R->Data + R->Pos, Len);
+    R->Pos += Len;
+    if (R->Pos == R->Result)
+	R->State = UringIdle;
+    return Len;
+}
+
+/* True if Fd is read through the ring, and so cannot be spliced from */
+static Boolean
+UringReading(int Fd)
+{
+    return Fd >= 0 && Fd < PollSlotsSize && PollSlots[Fd].UringRead;
+}
+
+/* Cancel the poll and read outstanding on a descriptor about to be
+   closed. The ring holds a reference to the file until they end. */
+static void
+UringForget(int Fd)
+{
+    PollSlot *Slot = &PollSlots[Fd];
+    UringReadType *R = Slot->UringRead;
+    struct io_uring_sqe *Sqe;
+
+    UringArmPoll(Fd, Slot, 0);
+    if (R && R->State == UringPending) {
+	/* Freed when its completion arrives. A read waiting behind its
+	   linked poll is only cancelled through the poll. */
+	R->Fd = -1;
+	if (R->NeedPoll && (Sqe = UringQueue(IORING_OP_ASYNC_CANCEL, -1, 0)))
+	    Sqe->addr = UringLinkData(R);
+	if ((Sqe = UringQueue(IORING_OP_ASYNC_CANCEL, -1, 0)))
+	    Sqe->addr = (unsigned long) R;
+    }
+    else
+	free(R);
+    Slot->UringRead = NULL;
+    if (*Uring.SqTail != __atomic_load_n(Uring.SqHead, __ATOMIC_ACQUIRE))
+	UringEnter(0, 0);
+}
+#endif /* HAVE_IO_URING */
+
+/* Forget poller state for a descriptor about to be closed */
+static void
+PollForget(int Fd)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (Fd >= 0 && Fd < PollSlotsSize && PollSlots[Fd].EpollMask)
+	EpollUpdate(Fd, 0);
+#endif
+#ifdef HAVE_IO_URING
+    if (Uring.Fd >= 0 && Fd >= 0 && Fd < PollSlotsSize)
+	UringForget(Fd);
+#endif
+}
+
+#ifdef HAVE_MODEM_WAIT
+/* Return the running modem line notifier of a port, NULL if polling */
+static ModemWaitType *
+GetModemWait(PORTHANDLE PortFd)
+{
+    UnixPortType *Port = GetUnixPort(PortFd);
+
+    return Port ? Port->ModemWait : NULL;
+}
+#endif
+
+/* Modem line state as last read by the notifier of the port, without
+   asking the driver. Returns False if there is none. */
+Boolean
+GetKnownModemState(PORTHANDLE PortFd, unsigned char *State)
+{
+#ifdef HAVE_MODEM_WAIT
+    ModemWaitType *M = GetModemWait(PortFd);
+    int Lines;
+
+    if (M && (Lines = __atomic_load_n(&M->Lines, __ATOMIC_RELAXED)) >= 0) {
+	*State = ModemLinesState(Lines, 0);
+	return True;
+    }
+#endif
+    return False;
+}
+
+unsigned long long
+MonotonicUs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/* Check if the modem state poll interval has elapsed since LastPoll,
+   restarting the interval if so */
+static Boolean
+ModemPollDue(struct timeval *LastPoll, long PollInterval)
+{
+    struct timeval now;
+    long elapsed;
+
+    gettimeofday(&now, NULL);
+    if (timercmp(&now, LastPoll, <)) {
+	/* Time moved backwards */
+	timerclear(LastPoll);
+    }
+    elapsed = (now.tv_sec - LastPoll->tv_sec) * 1000 + (now.tv_usec - LastPoll->tv_usec) / 1000;
+    if (!timerisset(LastPoll) || elapsed >= PollInterval) {
+	*LastPoll = now;
+	return True;
+    }
+    return False;
+}
+
+int
+SercdSelectMany(SercdWatch * Watches, int Count, long PollInterval)
+{
+    SercdWatch *W;
+    PollEntry *Entry;
+    int i, Entries = 0, selret;
+    long Timeout;
+    struct timeval now;
+    int ret = 0;
+#ifdef HAVE_MODEM_WAIT
+    ModemWaitType *M;
+#endif
+
+    PollRound++;
+    for (i = 0; i < Count; i++) {
+	W = &Watches[i];
+	W->Events = 0;
+	if ((W->DeviceIn && AddPollEntry(&Entries, *W->DeviceIn, True, False) < 0) ||
+	    (W->DeviceOut && AddPollEntry(&Entries, *W->DeviceOut, False, True) < 0) ||
+	    (W->SocketOut && AddPollEntry(&Entries, *W->SocketOut, False, True) < 0) ||
+	    (W->SocketIn && AddPollEntry(&Entries, *W->SocketIn, True, False) < 0) ||
+	    (W->SocketConnect && AddPollEntry(&Entries, *W->SocketConnect, True, False) < 0)) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+#ifdef HAVE_MODEM_WAIT
+	if (W->Modemstate && (M = GetModemWait(*W->Modemstate)) &&
+	    AddPollEntry(&Entries, M->EventFd, True, False) < 0) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+#endif
+#ifdef HAVE_PORT_JOBS
+	if (((W->PortJobs && PortJobsPending(*W->PortJobs) > 0) ||
+	     (W->PortClose && PortJobSink.Pipe[0] >= 0)) &&
+	    AddPollEntry(&Entries, PortJobSink.Pipe[0], True, False) < 0) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+#endif
+    }
+    if (StopPipe[0] >= 0 && AddPollEntry(&Entries, StopPipe[0], True, False) < 0) {
+	errno = ENOMEM;
+	return -1;
+    }
+
+    /* A zero poll interval disables polling: wait for I/O only */
+    Timeout = PollInterval > 0 ? PollInterval : -1;
+    gettimeofday(&now, NULL);
+    Timeout = WatchTimeout(Watches, Count, &now, Timeout);
+
+    if (Backend == BackendNone)
+	Backend = ForceSelect ? BackendSelect : UseUring ? BackendUring : BackendEpoll;
+#ifdef HAVE_IO_URING
+    if (Backend == BackendUring)
+	selret = UringWait(Entries, Timeout);
+    else
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    if (Backend != BackendSelect)
+	selret = EpollWait(Entries, Timeout);
+    else
+#endif
+	selret = SelectWait(Entries, Timeout);
+
+    if (selret < 0)
+	return selret;
 
-    if (Modemstate) {
-	gettimeofday(&newpoll, NULL);
-	if (timercmp(&newpoll, &LastPoll, <)) {
-	    /* Time moved backwards */
-	    timerclear(&LastPoll);
+    WatchDeadlines(Watches, Count);
+#ifdef HAVE_PORT_JOBS
+    if (PortJobSink.Pipe[0] >= 0 && (Entry = FindPollEntry(PortJobSink.Pipe[0])) && Entry->Readable)
+	CollectPortJobs();
+#endif
+    for (i = 0; i < Count; i++) {
+	W = &Watches[i];
+	if (W->PortJobs && PortJobsPending(*W->PortJobs) == 0) {
+	    W->Events |= SERCD_EV_PORTDONE;
+	}
+	if (W->PortClose && !PortClosing(W->PortClose)) {
+	    W->Events |= SERCD_EV_PORTDONE;
+	}
+	if (W->DeviceIn && (Entry = FindPollEntry(*W->DeviceIn)) && Entry->Readable) {
+	    W->Events |= SERCD_EV_DEVICEIN;
+	}
+	if (W->DeviceOut && (Entry = FindPollEntry(*W->DeviceOut)) && Entry->Writable) {
+	    W->Events |= SERCD_EV_DEVICEOUT;
 	}
-	newpoll.tv_sec -= PollInterval / 1000;
-	newpoll.tv_usec -= PollInterval % 1000;
-	if (timercmp(&LastPoll, &newpoll, <)) {
-	    gettimeofday(&LastPoll, NULL);
-	    ret |= SERCD_EV_MODEMSTATE;
+	if (W->SocketOut && (Entry = FindPollEntry(*W->SocketOut)) && Entry->Writable) {
+	    W->Events |= SERCD_EV_SOCKETOUT;
 	}
+	if (W->SocketIn && (Entry = FindPollEntry(*W->SocketIn)) && Entry->Readable) {
+	    W->Events |= SERCD_EV_SOCKETIN;
+	}
+	if (W->SocketConnect && (Entry = FindPollEntry(*W->SocketConnect)) && Entry->Readable) {
+	    W->Events |= SERCD_EV_SOCKETCONNECT;
+	}
+#ifdef HAVE_MODEM_WAIT
+	if (W->Modemstate && (M = GetModemWait(*W->Modemstate))) {
+	    if ((Entry = FindPollEntry(M->EventFd)) && Entry->Readable) {
+		uint64_t Changes;
+		if (read(M->EventFd, &Changes, sizeof(Changes)) < 0) {
+		    /* Already drained: the state is read again all the same */
+		}
+		if (__atomic_load_n(&M->Failed, __ATOMIC_ACQUIRE)) {
+		    LogMsg(LOG_INFO, "Modem line notification not supported, polling instead.");
+		    StopModemWait(GetUnixPort(*W->Modemstate));
+		}
+		W->Events |= SERCD_EV_MODEMSTATE;
+	    }
+	}
+	else
+#endif
+	if (W->Modemstate && PollInterval > 0 && ModemPollDue(&W->LastPoll, PollInterval)) {
+	    W->Events |= SERCD_EV_MODEMSTATE;
+	}
+	if (W->Events)
+	    ret++;
     }
 
     return ret;
 }
 
+/* Nothing to do: listeners are watched by the event loop */
 void
 NewListener(SERCD_SOCKET LSocketFd)
 {
+    /* Just to avoid compilation warnings */
+    LSocketFd = LSocketFd;
+}
+
+/* Create the non-blocking listening socket of the control interface
+   at Path, replacing a stale one. Returns -1 on error. */
+SERCD_SOCKET
+OpenControlSocket(const char *Path)
+{
+    struct sockaddr_un sun;
+    int fd, on = 1;
+
+    if (strlen(Path) >= sizeof(sun.sun_path)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+	return -1;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, Path);
+    unlink(Path);
+    if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0 || listen(fd, 4) < 0) {
+	close(fd);
+	return -1;
+    }
+    ioctl(fd, FIONBIO, &on);
+    return fd;
+}
 
+/* Close the control socket and remove it from the file system */
+void
+CloseControlSocket(SERCD_SOCKET LSocketFd, const char *Path)
+{
+    PollForget(LSocketFd);
+    close(LSocketFd);
+    unlink(Path);
 }
 
 /* Drop client connection and close serial port */
@@ -922,10 +2918,13 @@ DropConnection(PORTHANDLE * DeviceFd, SERCD_SOCKET * InSocketFd, SERCD_SOCKET *
     }
 
     if (InSocketFd) {
+	PollForget(*InSocketFd);
 	close(*InSocketFd);
     }
 
-    if (OutSocketFd) {
+    /* In standalone mode both point to the same socket */
+    if (OutSocketFd && (!InSocketFd || *OutSocketFd != *InSocketFd)) {
+	PollForget(*OutSocketFd);
 	close(*OutSocketFd);
     }
 }
@@ -936,9 +2935,19 @@ WriteToDev(PORTHANDLE port, const void *buf, size_t count)
     return write(port, buf, count);
 }
 
+ssize_t
+WriteToDevV(PORTHANDLE port, const struct iovec *iov, int iovcnt)
+{
+    return writev(port, iov, iovcnt);
+}
+
 ssize_t
 ReadFromDev(PORTHANDLE port, void *buf, size_t count)
 {
+#ifdef HAVE_IO_URING
+    if (Backend == BackendUring || UringReading(port))
+	return UringRead(port, buf, count);
+#endif
     return read(port, buf, count);
 }
 
@@ -948,9 +2957,35 @@ WriteToNet(SERCD_SOCKET sock, const void *buf, size_t count)
     return write(sock, buf, count);
 }
 
+/* More tells the kernel that further data follows shortly, so a
+   partial segment may be held back */
+ssize_t
+WriteToNetV(SERCD_SOCKET sock, const struct iovec *iov, int iovcnt, Boolean More)
+{
+#ifdef MSG_MORE
+    if (More) {
+	struct msghdr msg;
+	ssize_t iobytes;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = iovcnt;
+	iobytes = sendmsg(sock, &msg, MSG_MORE);
+	/* inetd may hand us something else than a socket */
+	if (iobytes >= 0 || errno != ENOTSOCK)
+	    return iobytes;
+    }
+#endif
+    return writev(sock, iov, iovcnt);
+}
+
 ssize_t
 ReadFromNet(SERCD_SOCKET sock, void *buf, size_t count)
 {
+#ifdef HAVE_IO_URING
+    if (Backend == BackendUring || UringReading(sock))
+	return UringRead(sock, buf, count);
+#endif
     return read(sock, buf, count);
 }
 
@@ -959,4 +2994,228 @@ ModemStateNotified()
 {
 }
 
+#ifdef HAVE_SPLICE
+/* Create a pipe for zero-copy forwarding, holding at most Size bytes */
+Boolean
+OpenRawPipe(RawPipeType * P, unsigned int Size)
+{
+    int PipeSize, NewSize;
+
+    P->Open = False;
+    if (pipe2(P->Fd, O_NONBLOCK | O_CLOEXEC) < 0)
+	return False;
+
+    PipeSize = fcntl(P->Fd[1], F_GETPIPE_SZ);
+    if (PipeSize > 0 && (unsigned int) PipeSize < Size) {
+	/* May fail if above the system limit; the pipe is used anyway */
+	NewSize = fcntl(P->Fd[1], F_SETPIPE_SZ, Size);
+	if (NewSize > 0)
+	    PipeSize = NewSize;
+    }
+    if (PipeSize <= 0) {
+	close(P->Fd[0]);
+	close(P->Fd[1]);
+	return False;
+    }
+
+    P->Size = MIN(Size, (unsigned int) PipeSize);
+    P->Len = 0;
+    P->Open = True;
+    return True;
+}
+
+void
+CloseRawPipe(RawPipeType * P)
+{
+    if (P->Open) {
+	close(P->Fd[0]);
+	close(P->Fd[1]);
+	P->Open = False;
+    }
+}
+
+ssize_t
+ReadFromRawPipe(RawPipeType * P, void *buf, size_t count)
+{
+    ssize_t iobytes = read(P->Fd[0], buf, count);
+
+    if (iobytes > 0)
+	P->Len -= iobytes;
+    return iobytes;
+}
+
+ssize_t
+WriteToRawPipe(RawPipeType * P, const void *buf, size_t count)
+{
+    ssize_t iobytes = write(P->Fd[1], buf, MIN(count, P->Size - P->Len));
+
+    if (iobytes > 0)
+	P->Len += iobytes;
+    return iobytes;
+}
+
+/* Move data from a descriptor into the pipe */
+static ssize_t
+SpliceIn(int fd, RawPipeType * P, size_t count)
+{
+    ssize_t iobytes;
+
+#ifdef HAVE_IO_URING
+    /* Data may already be waiting in the ring; copy from now on */
+    if (UringReading(fd)) {
+	errno = EINVAL;
+	return -1;
+    }
+#endif
+    iobytes = splice(fd, NULL, P->Fd[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (iobytes > 0)
+	P->Len += iobytes;
+    return iobytes;
+}
+
+/* Move data from the pipe to a descriptor */
+static ssize_t
+SpliceOut(int fd, RawPipeType * P, size_t count, Boolean More)
+{
+    ssize_t iobytes = splice(P->Fd[0], NULL, fd, NULL, count,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (More ? SPLICE_F_MORE : 0));
+
+    if (iobytes > 0)
+	P->Len -= iobytes;
+    return iobytes;
+}
+#else
+Boolean
+OpenRawPipe(RawPipeType * P, unsigned int Size)
+{
+    P->Open = False;
+    return False;
+}
+
+void
+CloseRawPipe(RawPipeType * P)
+{
+}
+
+ssize_t
+ReadFromRawPipe(RawPipeType * P, void *buf, size_t count)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t
+WriteToRawPipe(RawPipeType * P, const void *buf, size_t count)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+static ssize_t
+SpliceIn(int fd, RawPipeType * P, size_t count)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+static ssize_t
+SpliceOut(int fd, RawPipeType * P, size_t count, Boolean More)
+{
+    errno = EINVAL;
+    return -1;
+}
+#endif /* HAVE_SPLICE */
+
+ssize_t
+SpliceFromDev(PORTHANDLE port, RawPipeType * P, size_t count)
+{
+    return SpliceIn(port, P, count);
+}
+
+ssize_t
+SpliceToDev(PORTHANDLE port, RawPipeType * P, size_t count)
+{
+    return SpliceOut(port, P, count, False);
+}
+
+ssize_t
+SpliceFromNet(SERCD_SOCKET sock, RawPipeType * P, size_t count)
+{
+    return SpliceIn(sock, P, count);
+}
+
+ssize_t
+SpliceToNet(SERCD_SOCKET sock, RawPipeType * P, size_t count, Boolean More)
+{
+    return SpliceOut(sock, P, count, More);
+}
+
+/* Map the same memory twice, back to back, so that a ring buffer of
+   Size bytes can be accessed up to Size bytes past any position.
+   Size is rounded up to the page size. Returns NULL if the mapping is
+   not possible, in which case a plain buffer must be used. */
+void *
+MapMirrorBuffer(unsigned int *Size)
+{
+#ifdef HAVE_MEMFD_CREATE
+    long PageSize = sysconf(_SC_PAGESIZE);
+    unsigned int Len = *Size;
+    unsigned char *Base;
+    int fd;
+
+    if (PageSize <= 0 || (PageSize & (PageSize - 1)))
+	return NULL;
+    if (Len < (unsigned long) PageSize)
+	Len = PageSize;
+
+    fd = memfd_create("sercd-buffer", MFD_CLOEXEC);
+    if (fd < 0)
+	return NULL;
+    if (ftruncate(fd, Len) < 0) {
+	close(fd);
+	return NULL;
+    }
+
+    /* Reserve the address range, then map the memory into both halves */
+    Base = mmap(NULL, 2 * Len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Base == MAP_FAILED) {
+	close(fd);
+	return NULL;
+    }
+    if (mmap(Base, Len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	mmap(Base + Len, Len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+	munmap(Base, 2 * Len);
+	close(fd);
+	return NULL;
+    }
+    close(fd);
+
+    *Size = Len;
+    return Base;
+#else
+    return NULL;
+#endif
+}
+
+/* Map the first Len bytes of a file, creating or resizing it as needed,
+   so that data written to them outlives the process */
+void *
+MapHistoryFile(const char *Path, size_t Len)
+{
+    void *Base;
+    int fd;
+
+    fd = open(Path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+    if (fd < 0)
+	return NULL;
+    if (ftruncate(fd, Len) < 0) {
+	close(fd);
+	return NULL;
+    }
+    Base = mmap(NULL, Len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return Base == MAP_FAILED ? NULL : Base;
+}
+
 #endif /* WIN32 */
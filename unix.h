@@ -14,6 +14,8 @@
 #include <netinet/ip.h>		/* IPTOS_LOWDELAY */
 #include <arpa/inet.h>		/* inet_addr */
 #include <sys/socket.h>		/* setsockopt */
+#include <sys/time.h>		/* struct timeval */
+#include <sys/uio.h>		/* struct iovec */
 
 #define PORTHANDLE int
 
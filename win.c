@@ -11,10 +11,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
-
-extern Boolean BreakSignaled;
-
-extern int MaxLogLevel;
+#include <sys/time.h>
+#include <stdarg.h>
 
 /* Initial serial port settings */
 static DCB *InitialPortSettings;
@@ -36,15 +34,11 @@ static BOOL DeviceModemEvents = TRUE;
 static BOOL
 SercdGetCommState(HANDLE hFile, DCB * dcb)
 {
-    char LogStr[TmpStrLen];
-
     if (GetCommState(hFile, dcb)) {
 	return TRUE;
     }
     else {
-	snprintf(LogStr, sizeof(LogStr), "GetCommState failed with error 0x%lx", GetLastError());
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_ERR, LogStr);
+	LogMsg(LOG_ERR, "GetCommState failed with error 0x%lx", GetLastError());
 	return FALSE;
     }
 }
@@ -53,16 +47,11 @@ SercdGetCommState(HANDLE hFile, DCB * dcb)
 static BOOL
 SercdGetCommModemStatus(HANDLE hFile, DWORD * lpModemStat)
 {
-    char LogStr[TmpStrLen];
-
     if (GetCommModemStatus(hFile, lpModemStat)) {
 	return TRUE;
     }
     else {
-	snprintf(LogStr, sizeof(LogStr), "GetCommModemStatus failed with error 0x%lx",
-		 GetLastError());
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_ERR, LogStr);
+	LogMsg(LOG_ERR, "GetCommModemStatus failed with error 0x%lx", GetLastError());
 	return FALSE;
     }
 }
@@ -212,14 +201,6 @@ GetPortFlowControl(PORTHANDLE PortFd, unsigned char Which)
 
     /* Check wich kind of information is requested */
     switch (Which) {
-	/* BREAK State  */
-    case TNCOM_CMD_BREAK_REQ:
-	if (BreakSignaled == True)
-	    return TNCOM_CMD_BREAK_ON;
-	else
-	    return TNCOM_CMD_BREAK_OFF;
-	break;
-
 	/* DTR Signal State */
     case TNCOM_CMD_DTR_REQ:
 	/* See comment in unix.c */
@@ -282,6 +263,21 @@ GetModemState(PORTHANDLE PortFd, unsigned char PMState)
     return (MState);
 }
 
+/* The modem lines are only known by asking */
+Boolean
+GetKnownModemState(PORTHANDLE PortFd, unsigned char *State)
+{
+    return False;
+}
+
+/* Read the line error counters of the driver. The comm errors are
+   cleared by the select loop, so none are kept here. */
+Boolean
+GetLineCounts(PORTHANDLE PortFd, LineCountType * Counts)
+{
+    return False;
+}
+
 /* Set the serial port data size */
 void
 SetPortDataSize(PORTHANDLE PortFd, unsigned char DataSize)
@@ -371,6 +367,35 @@ SetPortStopSize(PORTHANDLE PortFd, unsigned char StopSize)
     WinLogPortSettings(&PortSettings);
 }
 
+/* Port setting changes are applied one by one */
+void
+StagePortSettings(PORTHANDLE PortFd)
+{
+}
+
+void
+CommitPortSettings(PORTHANDLE PortFd)
+{
+}
+
+/* Port changes are applied synchronously */
+int
+PortJobsPending(PORTHANDLE PortFd)
+{
+    return 0;
+}
+
+void
+FinishPortJobs(void)
+{
+}
+
+Boolean
+PortClosing(const char *DeviceName)
+{
+    return False;
+}
+
 /* Set the port flow control and DTR and RTS status */
 void
 SetPortFlowControl(PORTHANDLE PortFd, unsigned char How)
@@ -535,14 +560,24 @@ PlatformInit()
     }
 }
 
+/* Log messages are written synchronously, so none are dropped */
+unsigned long
+LogDroppedCount(void)
+{
+    return 0;
+}
+
 /* Some day, we might want to support logging to Windows event log */
 void
-LogMsg(int LogLevel, const char *const Msg)
+LogFormat(int LogLevel, const char *Fmt, ...)
 {
-    if (LogLevel <= MaxLogLevel) {
-	fprintf(stderr, "%s\n", Msg);
-	fflush(stderr);
-    }
+    va_list Args;
+
+    va_start(Args, Fmt);
+    vfprintf(stderr, Fmt, Args);
+    fputc('\n', stderr);
+    fflush(stderr);
+    va_end(Args);
 }
 
 int
@@ -550,7 +585,6 @@ OpenPort(const char *DeviceName, const char *LockFileName, PORTHANDLE * PortFd)
 {
     DCB PortSettings;
     PortSettings.DCBlength = sizeof(DCB);
-    char LogStr[TmpStrLen];
 
     *PortFd = CreateFile(DeviceName, GENERIC_READ | GENERIC_WRITE,
 			 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
@@ -584,18 +618,14 @@ OpenPort(const char *DeviceName, const char *LockFileName, PORTHANDLE * PortFd)
 
     /* Write the port settings to device */
     if (!SetCommState(*PortFd, &PortSettings)) {
-	snprintf(LogStr, sizeof(LogStr), "Unable to configure port %s", DeviceName);
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_NOTICE, LogStr);
+	LogMsg(LOG_NOTICE, "Unable to configure port %s", DeviceName);
 	return Error;
     }
 
     /* Set event mask */
     if (!SetCommMask(*PortFd,
 		     EV_BREAK | EV_CTS | EV_DSR | EV_RING | EV_RLSD | EV_RXCHAR | EV_TXEMPTY)) {
-	snprintf(LogStr, sizeof(LogStr), "SetCommMask failed.");
-	LogStr[sizeof(LogStr) - 1] = '\0';
-	LogMsg(LOG_NOTICE, LogStr);
+	LogMsg(LOG_NOTICE, "SetCommMask failed.");
 	return Error;
     }
 
@@ -632,7 +662,7 @@ ClosePort(PORTHANDLE PortFd, const char *LockFileName)
     CloseHandle(PortFd);
 }
 
-int
+static int
 SercdSelect(PORTHANDLE * DeviceIn, PORTHANDLE * DeviceOut, PORTHANDLE * ModemState,
 	    SERCD_SOCKET * SocketOut, SERCD_SOCKET * SocketIn,
 	    SERCD_SOCKET * SocketListen, long PollInterval)
@@ -646,7 +676,6 @@ SercdSelect(PORTHANDLE * DeviceIn, PORTHANDLE * DeviceOut, PORTHANDLE * ModemSta
     BOOL waitcomm;
     PORTHANDLE *Device = NULL;
     SERCD_SOCKET *Socket = NULL;
-    char LogStr[TmpStrLen];
 
     if (DeviceIn && DeviceOut) {
 	assert(DeviceIn == DeviceOut);
@@ -692,10 +721,7 @@ SercdSelect(PORTHANDLE * DeviceIn, PORTHANDLE * DeviceOut, PORTHANDLE * ModemSta
 		    DWORD ComErrors;
 		    COMSTAT Stat;
 		    if (!ClearCommError(*Device, &ComErrors, &Stat)) {
-			snprintf(LogStr, sizeof(LogStr), "Communications Error: 0x%lx\n",
-				 ComErrors);
-			LogStr[sizeof(LogStr) - 1] = '\0';
-			LogMsg(LOG_INFO, LogStr);
+			LogMsg(LOG_INFO, "Communications Error: 0x%lx\n", ComErrors);
 		    }
 		    DeviceReadChars = Stat.cbInQue;
 		}
@@ -754,9 +780,7 @@ SercdSelect(PORTHANDLE * DeviceIn, PORTHANDLE * DeviceOut, PORTHANDLE * ModemSta
 	    DWORD ComErrors;
 	    COMSTAT Stat;
 	    if (!ClearCommError(*Device, &ComErrors, &Stat)) {
-		snprintf(LogStr, sizeof(LogStr), "Communications Error: 0x%lx\n", ComErrors);
-		LogStr[sizeof(LogStr) - 1] = '\0';
-		LogMsg(LOG_INFO, LogStr);
+		LogMsg(LOG_INFO, "Communications Error: 0x%lx\n", ComErrors);
 	    }
 	    DeviceReadChars = Stat.cbInQue;
 	}
@@ -819,6 +843,25 @@ SercdSelect(PORTHANDLE * DeviceIn, PORTHANDLE * DeviceOut, PORTHANDLE * ModemSta
     return ret;
 }
 
+/* All sessions share one socket event, so only a single session is
+   supported */
+int
+SercdSelectMany(SercdWatch * Watches, int Count, long PollInterval)
+{
+    struct timeval now;
+    int ret;
+
+    assert(Count == 1);
+    gettimeofday(&now, NULL);
+    ret = SercdSelect(Watches->DeviceIn, Watches->DeviceOut, Watches->Modemstate,
+		      Watches->SocketOut, Watches->SocketIn, Watches->SocketConnect,
+		      WatchTimeout(Watches, Count, &now, PollInterval));
+    if (ret < 0)
+	return ret;
+    Watches->Events = ret;
+    WatchDeadlines(Watches, Count);
+    return Watches->Events ? 1 : 0;
+}
 
 void
 NewListener(SERCD_SOCKET LSocketFd)
@@ -829,6 +872,18 @@ NewListener(SERCD_SOCKET LSocketFd)
     WSAEventSelect(LSocketFd, SocketEvent, FD_ACCEPT | FD_WRITE | FD_READ | FD_CLOSE);
 }
 
+/* The control socket is a Unix domain socket, not available here */
+SERCD_SOCKET
+OpenControlSocket(const char *Path)
+{
+    return INVALID_SOCKET;
+}
+
+void
+CloseControlSocket(SERCD_SOCKET LSocketFd, const char *Path)
+{
+}
+
 
 /* Drop client connection and close serial port */
 void
@@ -920,6 +975,25 @@ WriteToDev(PORTHANDLE port, const void *buf, size_t count)
     return iobytes;
 }
 
+/* No scatter/gather for overlapped device I/O: write the segments in
+   turn, stopping at the first short write */
+ssize_t
+WriteToDevV(PORTHANDLE port, const struct iovec *iov, int iovcnt)
+{
+    ssize_t iobytes, total = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+	iobytes = WriteToDev(port, iov[i].iov_base, iov[i].iov_len);
+	if (iobytes <= 0)
+	    return total ? total : iobytes;
+	total += iobytes;
+	if ((size_t) iobytes < iov[i].iov_len)
+	    break;
+    }
+    return total;
+}
+
 ssize_t
 ReadFromDev(PORTHANDLE port, void *buf, size_t count)
 {
@@ -931,10 +1005,6 @@ ReadFromDev(PORTHANDLE port, void *buf, size_t count)
 	iobytes = -1;
     }
 
-    char *charbuf;
-    charbuf = buf;
-    charbuf[iobytes] = '\0';
-
     if (iobytes > 0) {
 	assert(iobytes <= DeviceReadChars);
 	DeviceReadChars -= iobytes;
@@ -954,6 +1024,27 @@ WriteToNet(SERCD_SOCKET sock, const void *buf, size_t count)
     return iobytes;
 }
 
+ssize_t
+WriteToNetV(SERCD_SOCKET sock, const struct iovec *iov, int iovcnt, Boolean More)
+{
+    WSABUF bufs[2];
+    DWORD sent;
+    int i;
+
+    assert(iovcnt <= 2);
+    for (i = 0; i < iovcnt; i++) {
+	bufs[i].buf = iov[i].iov_base;
+	bufs[i].len = iov[i].iov_len;
+    }
+    if (WSASend(sock, bufs, iovcnt, &sent, 0, NULL, NULL) != 0) {
+	if (WSAGetLastError() == WSAEWOULDBLOCK) {
+	    SocketWritable = FALSE;
+	}
+	return -1;
+    }
+    return sent;
+}
+
 ssize_t
 ReadFromNet(SERCD_SOCKET sock, void *buf, size_t count)
 {
@@ -966,4 +1057,134 @@ ModemStateNotified()
     DeviceModemEvents = FALSE;
 }
 
+unsigned long long
+MonotonicUs(void)
+{
+    LARGE_INTEGER Count, Frequency;
+
+    QueryPerformanceCounter(&Count);
+    QueryPerformanceFrequency(&Frequency);
+    return Count.QuadPart / Frequency.QuadPart * 1000000ULL +
+	Count.QuadPart % Frequency.QuadPart * 1000000ULL / Frequency.QuadPart;
+}
+
+/* No zero-copy forwarding on Windows; raw mode uses the buffers */
+Boolean
+OpenRawPipe(RawPipeType * P, unsigned int Size)
+{
+    P->Open = False;
+    return False;
+}
+
+void
+CloseRawPipe(RawPipeType * P)
+{
+}
+
+ssize_t
+ReadFromRawPipe(RawPipeType * P, void *buf, size_t count)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t
+WriteToRawPipe(RawPipeType * P, const void *buf, size_t count)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t
+SpliceFromDev(PORTHANDLE port, RawPipeType * P, size_t count)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t
+SpliceToDev(PORTHANDLE port, RawPipeType * P, size_t count)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t
+SpliceFromNet(SERCD_SOCKET sock, RawPipeType * P, size_t count)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t
+SpliceToNet(SERCD_SOCKET sock, RawPipeType * P, size_t count, Boolean More)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+/* Buffers are not mirrored on Windows */
+void *
+MapMirrorBuffer(unsigned int *Size)
+{
+    return NULL;
+}
+
+/* History files are not supported on Windows */
+void *
+MapHistoryFile(const char *Path, size_t Len)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int
+CpuCount(void)
+{
+    SYSTEM_INFO Info;
+
+    GetSystemInfo(&Info);
+    return Info.dwNumberOfProcessors;
+}
+
+/* All ports are served by the main thread on Windows */
+Boolean
+StartThread(void *(*Run) (void *), void *Arg)
+{
+    return False;
+}
+
+Boolean
+BindThreadToCpu(int Cpu)
+{
+    return False;
+}
+
+void
+JoinThreads(void)
+{
+}
+
+void *
+CreateLock(void)
+{
+    return NULL;
+}
+
+void
+TakeLock(void *Lock)
+{
+}
+
+void
+ReleaseLock(void *Lock)
+{
+}
+
+/* The event loop notices a stop request at its next timeout */
+void
+WakeEventLoops(void)
+{
+}
+
 #endif /* WIN32 */
@@ -15,6 +15,13 @@
 
 #define SERCD_SOCKET SOCKET
 
+/* Scatter/gather element, as in sys/uio.h */
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
+
 #define LOG_EMERG       0       /* system is unusable */
 #define LOG_ALERT       1       /* action must be taken immediately */
 #define LOG_CRIT        2       /* critical conditions */